@@ -0,0 +1,32 @@
+#include "alloc_stats.h"
+
+#include <stdlib.h>
+
+/*
+ * Defining these here overrides the C library's for the whole process,
+ * including allocations made inside libc and zlib.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long alloc_count = 0;
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+unsigned long alloc_stats_count(void) {
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
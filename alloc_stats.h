@@ -0,0 +1,13 @@
+#ifndef _ALLOC_STATS_H_
+#define _ALLOC_STATS_H_
+
+/*
+ * Heap allocation counting, linked into the bench and, with
+ * make ALLOC_STATS=1, into the launcher. Only code built with ALLOC_STATS
+ * set may call it.
+ */
+
+/* Allocations made by the whole process so far, from any thread */
+unsigned long alloc_stats_count(void);
+
+#endif
@@ -0,0 +1,90 @@
+#include "arena.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#define ARENA_ALIGN 16
+
+static __thread struct Arena arena;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_destroy(void* arg) {
+    struct Arena* a = arg;
+
+    munmap(a->base, a->cap);
+    memset(a, 0, sizeof(*a));
+}
+
+static void create_key(void) {
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+/*
+ * The calling thread's arena, reserved on first use and unmapped when the
+ * thread exits. NULL if the space could not be reserved.
+ */
+struct Arena* launch_arena(void) {
+    void* base;
+
+    if (arena.base != NULL) {
+        return &arena;
+    }
+
+    base = mmap(NULL, ARENA_RESERVE_LEN, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        LOG_WARN("Could not reserve the launch arena");
+        return NULL;
+    }
+
+    arena.base = base;
+    arena.cap = ARENA_RESERVE_LEN;
+    arena.used = 0;
+    pthread_once(&arena_once, create_key);
+    pthread_setspecific(arena_key, &arena);
+    return &arena;
+}
+
+/* Uninitialized, aligned for any type. NULL once the arena is full. */
+void* arena_alloc(struct Arena* a, size_t len) {
+    void* ptr;
+
+    len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a == NULL || len > a->cap - a->used) {
+        return NULL;
+    }
+
+    ptr = a->base + a->used;
+    a->used += len;
+    return ptr;
+}
+
+char* arena_strdup(struct Arena* a, const char* str) {
+    size_t len = strlen(str) + 1;
+    char* copy = arena_alloc(a, len);
+
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+size_t arena_mark(const struct Arena* a) {
+    return a != NULL ? a->used : 0;
+}
+
+/* Frees everything allocated since `mark` was taken */
+void arena_release(struct Arena* a, size_t mark) {
+    if (a != NULL && mark < a->used) {
+        a->used = mark;
+    }
+}
+
+void arena_reset(struct Arena* a) {
+    arena_release(a, 0);
+}
@@ -0,0 +1,29 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+/* Address space reserved per thread, pages are only backed once used */
+#define ARENA_RESERVE_LEN (16 * 1024 * 1024)
+
+/*
+ * A bump allocator for what one launch needs and drops: read buffers,
+ * transient strings and tables. Scopes give back what they took with
+ * arena_release, innermost first. arena_reset ends the launch and drops
+ * whatever is left. The pages stay mapped, so later launches on the same
+ * thread run without touching the heap or faulting memory in.
+ */
+struct Arena {
+    unsigned char* base;
+    size_t cap;
+    size_t used;
+};
+
+struct Arena* launch_arena(void);
+void* arena_alloc(struct Arena* a, size_t len);
+char* arena_strdup(struct Arena* a, const char* str);
+size_t arena_mark(const struct Arena* a);
+void arena_release(struct Arena* a, size_t mark);
+void arena_reset(struct Arena* a);
+
+#endif
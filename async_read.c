@@ -0,0 +1,136 @@
+#include "async_read.h"
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "log.h"
+
+static void* reader_thread(void* arg) {
+    struct AsyncRead* ar = arg;
+    size_t slot;
+    size_t len;
+    ssize_t rv;
+
+    pthread_mutex_lock(&ar->lock);
+    while (!ar->stop) {
+        while (ar->count == ASYNC_READ_DEPTH && !ar->stop) {
+            pthread_cond_wait(&ar->drained, &ar->lock);
+        }
+
+        if (ar->stop) {
+            break;
+        }
+
+        /* Nobody else touches the free slots */
+        slot = (ar->head + ar->count) % ASYNC_READ_DEPTH;
+        pthread_mutex_unlock(&ar->lock);
+
+        len = ar->end - ar->offset < ASYNC_READ_CHUNK ?
+              ar->end - ar->offset : ASYNC_READ_CHUNK;
+        rv = 0;
+        if (len > 0) {
+            do {
+                rv = pread(ar->fd, ar->buffs[slot], len, ar->offset);
+            } while (rv < 0 && errno == EINTR);
+        }
+
+        if (rv < 0) {
+            rv = -errno;
+        } else {
+            ar->offset += rv;
+        }
+
+        pthread_mutex_lock(&ar->lock);
+        ar->lens[slot] = rv;
+        ar->count++;
+        pthread_cond_signal(&ar->filled);
+
+        /* The end or an error is the last thing handed over */
+        if (rv <= 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ar->lock);
+
+    return NULL;
+}
+
+/*
+ * Starts reading `len` bytes at `offset` in the background, into `ring`,
+ * ASYNC_READ_LEN bytes that stay the caller's
+ */
+int async_read_start(struct AsyncRead* ar, int fd, off_t offset, off_t len,
+                     unsigned char* ring) {
+    size_t i;
+    int rv;
+
+    memset(ar, 0, sizeof(*ar));
+    ar->fd = fd;
+    ar->offset = offset;
+    ar->end = offset + len;
+
+    /* Doubles the kernel's own read-ahead, on top of the thread's */
+    posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+
+    for (i = 0; i < ASYNC_READ_DEPTH; i++) {
+        ar->buffs[i] = ring + i * ASYNC_READ_CHUNK;
+    }
+
+    pthread_mutex_init(&ar->lock, NULL);
+    pthread_cond_init(&ar->filled, NULL);
+    pthread_cond_init(&ar->drained, NULL);
+    if ((rv = pthread_create(&ar->thread, NULL, reader_thread, ar)) != 0) {
+        LOG_DEBUG("Could not start reader thread: %s", strerror(rv));
+        rv = -rv;
+        pthread_cond_destroy(&ar->drained);
+        pthread_cond_destroy(&ar->filled);
+        pthread_mutex_destroy(&ar->lock);
+        memset(ar, 0, sizeof(*ar));
+        return rv;
+    }
+
+    return 0;
+}
+
+/*
+ * Points `data` at the next chunk, which stays valid until the next call.
+ * Returns its length, 0 at the end of the range.
+ */
+ssize_t async_read_next(struct AsyncRead* ar, const unsigned char** data) {
+    ssize_t rv;
+
+    pthread_mutex_lock(&ar->lock);
+    if (ar->held) {
+        ar->head = (ar->head + 1) % ASYNC_READ_DEPTH;
+        ar->count--;
+        ar->held = 0;
+        pthread_cond_signal(&ar->drained);
+    }
+
+    while (ar->count == 0) {
+        pthread_cond_wait(&ar->filled, &ar->lock);
+    }
+
+    rv = ar->lens[ar->head];
+    if (rv > 0) {
+        *data = ar->buffs[ar->head];
+        ar->held = 1;
+    }
+    pthread_mutex_unlock(&ar->lock);
+
+    return rv;
+}
+
+void async_read_stop(struct AsyncRead* ar) {
+    pthread_mutex_lock(&ar->lock);
+    ar->stop = 1;
+    pthread_cond_signal(&ar->drained);
+    pthread_mutex_unlock(&ar->lock);
+    pthread_join(ar->thread, NULL);
+
+    pthread_cond_destroy(&ar->drained);
+    pthread_cond_destroy(&ar->filled);
+    pthread_mutex_destroy(&ar->lock);
+    memset(ar, 0, sizeof(*ar));
+}
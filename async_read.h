@@ -0,0 +1,42 @@
+#ifndef _ASYNC_READ_H_
+#define _ASYNC_READ_H_
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define ASYNC_READ_DEPTH 4
+#define ASYNC_READ_CHUNK (1024 * 1024)
+/* Size of the ring of buffers the caller hands in */
+#define ASYNC_READ_LEN (ASYNC_READ_DEPTH * ASYNC_READ_CHUNK)
+
+/*
+ * Reads a range of a file on a thread of its own, up to ASYNC_READ_DEPTH
+ * chunks ahead of the consumer, so the disk keeps reading while earlier
+ * chunks are hashed.
+ */
+struct AsyncRead {
+    int fd;
+    off_t offset;
+    off_t end;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    unsigned char* buffs[ASYNC_READ_DEPTH];
+    /* Bytes in each buffer, 0 at the end of the range, or -errno */
+    ssize_t lens[ASYNC_READ_DEPTH];
+    /* Ring of filled buffers, the first one held by the consumer if
+     * `held` is set */
+    size_t head;
+    size_t count;
+    int held;
+    int stop;
+};
+
+int async_read_start(struct AsyncRead* ar, int fd, off_t offset, off_t len,
+                     unsigned char* ring);
+ssize_t async_read_next(struct AsyncRead* ar, const unsigned char** data);
+void async_read_stop(struct AsyncRead* ar);
+
+#endif
@@ -0,0 +1,639 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sha1.h"
+#include "crc32.h"
+#include "parser.h"
+#include "db_index.h"
+#include "cddb.h"
+#include "cd_detect.h"
+#include "cd_image.h"
+#include "detect.h"
+#include "run_info.h"
+#include "alloc_stats.h"
+
+#include "log.h"
+
+/*
+ * Times each detection stage on its own, on synthetic roms and discs
+ * generated in a scratch directory, against the real db/, cddb/ and
+ * launch.conf. Every case is written as one JSON object per line.
+ */
+
+#define BENCH_OUTPUT "bench.json"
+#define BENCH_MAX_NAMES 1024
+#define BENCH_MAX_KEYS 1024
+
+/* Sizes we look for in the index, from 8-bit carts up to GBA */
+static const uint64_t ROM_SIZES[] = {
+    32 * 1024,
+    512 * 1024,
+    4 * 1024 * 1024,
+    16 * 1024 * 1024,
+    0
+};
+
+static const size_t HASH_SIZES[] = {
+    256 * 1024,
+    4 * 1024 * 1024,
+    32 * 1024 * 1024,
+    0
+};
+
+/* A 700 MB disc, only the first sectors are written */
+#define DISC_SECTORS 300000
+#define DISC_ROOT_LBA 22
+#define DISC_FILE_LBA 23
+
+/* Not counted, so the bench's own bookkeeping stays out of the numbers */
+extern void* __libc_malloc(size_t size);
+
+struct Bench {
+    FILE* out;
+    FILE* console;
+    int scale;
+    struct DetectContext ctx;
+    char dir[PATH_MAX];
+};
+
+/* One operation, returns the number of bytes it processed or -errno */
+typedef int64_t (*BenchFunction)(void* arg);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t* sorted, int count, int pct) {
+    return sorted[(size_t)(count - 1) * pct / 100];
+}
+
+static void run_bench(struct Bench* b, const char* stage, const char* name,
+                      int iterations, BenchFunction fn, void* arg) {
+    uint64_t* times;
+    uint64_t total = 0;
+    uint64_t bytes = 0;
+    uint64_t start;
+    unsigned long allocs;
+    int64_t rv;
+    int i;
+
+    iterations *= b->scale;
+    if ((times = __libc_malloc(iterations * sizeof(*times))) == NULL) {
+        return;
+    }
+
+    /* Warm the page cache and the lazily built tables */
+    if ((rv = fn(arg)) < 0) {
+        fprintf(b->console, "%s/%s: %s\n", stage, name, strerror(-rv));
+        free(times);
+        return;
+    }
+
+    allocs = alloc_stats_count();
+    for (i = 0; i < iterations; i++) {
+        start = now_ns();
+        rv = fn(arg);
+        times[i] = now_ns() - start;
+        total += times[i];
+        bytes += rv > 0 ? rv : 0;
+    }
+    allocs = alloc_stats_count() - allocs;
+
+    qsort(times, iterations, sizeof(*times), compare_u64);
+    fprintf(b->out, "{\"stage\":\"%s\",\"case\":\"%s\",\"iterations\":%d,"
+            "\"bytes_per_op\":%llu,\"mb_per_s\":%.1f,\"ops_per_s\":%.1f,"
+            "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,"
+            "\"max_ns\":%llu,\"allocs_per_op\":%.2f}\n",
+            stage, name, iterations,
+            (unsigned long long)(bytes / iterations),
+            total ? bytes * 1000.0 / total : 0.0,
+            total ? iterations * 1e9 / total : 0.0,
+            (unsigned long long)percentile(times, iterations, 50),
+            (unsigned long long)percentile(times, iterations, 90),
+            (unsigned long long)percentile(times, iterations, 99),
+            (unsigned long long)times[iterations - 1],
+            (double)allocs / iterations);
+    fprintf(b->console, "%-18s %-16s p50 %10.1f us\n", stage, name,
+            percentile(times, iterations, 50) / 1000.0);
+    free(times);
+}
+
+static void fill_random(unsigned char* buff, size_t len, uint32_t seed) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buff[i] = seed >> 16;
+    }
+}
+
+static int write_file(const char* path, const void* data, size_t len,
+                      off_t file_len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int rv = 0;
+
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (write(fd, data, len) != (ssize_t)len ||
+        (file_len > (off_t)len && ftruncate(fd, file_len) < 0)) {
+        rv = -EIO;
+    }
+
+    close(fd);
+    return rv;
+}
+
+/* get_sha1 and the CRC32 pass, on data already in memory */
+
+struct HashArg {
+    const unsigned char* data;
+    size_t len;
+};
+
+static int64_t bench_sha1(void* arg) {
+    struct HashArg* h = arg;
+    unsigned char digest[DB_SHA1_SIZE];
+    SHA1Context sha;
+
+    SHA1Reset(&sha);
+    SHA1Input(&sha, h->data, h->len);
+    SHA1ResultBinary(&sha, digest);
+    return h->len;
+}
+
+static int64_t bench_crc32(void* arg) {
+    struct HashArg* h = arg;
+    volatile uint32_t crc = crc32_update(0, h->data, h->len);
+    (void)crc;
+    return h->len;
+}
+
+static void bench_hashing(struct Bench* b) {
+    struct HashArg h;
+    unsigned char* data;
+    char name[32];
+    int i;
+
+    if ((data = malloc(HASH_SIZES[2])) == NULL) {
+        return;
+    }
+
+    fill_random(data, HASH_SIZES[2], 1);
+    for (i = 0; HASH_SIZES[i] != 0; i++) {
+        h.data = data;
+        h.len = HASH_SIZES[i];
+        snprintf(name, sizeof(name), "%zuKiB", h.len / 1024);
+        run_bench(b, "sha1", name, i == 2 ? 5 : 50, bench_sha1, &h);
+        run_bench(b, "crc32", name, i == 2 ? 5 : 50, bench_crc32, &h);
+    }
+
+    free(data);
+}
+
+/* find_rom_canonical_name, through detect_game on synthetic roms */
+
+struct RomArg {
+    const struct DetectContext* ctx;
+    char path[PATH_MAX];
+    uint64_t size;
+};
+
+static int64_t bench_rom(void* arg) {
+    struct RomArg* r = arg;
+    char game_name[MAX_TOKEN_LEN];
+    int rv = detect_game(r->ctx, r->path, game_name, sizeof(game_name));
+    return rv < 0 && rv != -ENOENT && rv != -EINVAL ? rv : (int64_t)r->size;
+}
+
+/* The smallest size at least `size` some DAT lists, so lookups go past
+ * the size prefilter */
+static uint64_t indexed_size(const struct DBIndex* idx, uint64_t size) {
+    uint32_t i;
+    for (i = 0; i < idx->header->entry_count; i++) {
+        if (idx->roms[i].size >= size) {
+            return idx->roms[i].size;
+        }
+    }
+
+    return size;
+}
+
+static void bench_roms(struct Bench* b) {
+    struct DetectContext strict_ctx = b->ctx;
+    struct RomArg r;
+    unsigned char* data;
+    char name[32];
+    int iterations;
+    int i;
+
+    strict_ctx.strict = 1;
+    for (i = 0; ROM_SIZES[i] != 0; i++) {
+        r.size = b->ctx.has_index ? indexed_size(&b->ctx.index, ROM_SIZES[i])
+                                  : ROM_SIZES[i];
+        if (snprintf(r.path, PATH_MAX, "%s/rom%d.bin", b->dir, i) >=
+                PATH_MAX ||
+            (data = malloc(r.size)) == NULL) {
+            return;
+        }
+
+        fill_random(data, r.size, i + 2);
+        write_file(r.path, data, r.size, 0);
+        free(data);
+
+        snprintf(name, sizeof(name), "%lluB",
+                 (unsigned long long)r.size);
+        iterations = r.size > 1024 * 1024 ? 10 : 100;
+        r.ctx = &b->ctx;
+        run_bench(b, "rom_lookup", name, iterations, bench_rom, &r);
+        r.ctx = &strict_ctx;
+        run_bench(b, "rom_lookup_strict", name, iterations, bench_rom, &r);
+        unlink(r.path);
+    }
+}
+
+/* get_run_info over game names taken from the index */
+
+struct NamesArg {
+    const struct LaunchRules* rules;
+    const char* names[BENCH_MAX_NAMES];
+    size_t count;
+    size_t next;
+};
+
+static int64_t bench_run_info(void* arg) {
+    struct NamesArg* n = arg;
+    struct RunInfo info;
+
+    get_run_info(n->rules, &info, n->names[n->next]);
+    n->next = (n->next + 1) % n->count;
+    return 0;
+}
+
+static void bench_run_infos(struct Bench* b) {
+    static struct NamesArg n;
+    static const char* ps1_names[] = {
+        "ps1.Ace Combat 3 - Electrosphere (USA)",
+        "ps1.Final Fantasy VII (USA) (Disc 1)",
+        "ps1.<unknown>",
+        "scd.<unknown>",
+        "pcecd.<unknown>",
+        NULL
+    };
+    const struct DBIndex* idx = &b->ctx.index;
+    size_t offset = 0;
+    size_t i;
+
+    memset(&n, 0, sizeof(n));
+    n.rules = &b->ctx.rules;
+    for (i = 0; ps1_names[i] != NULL; i++) {
+        n.names[n.count++] = ps1_names[i];
+    }
+
+    if (b->ctx.has_index) {
+        while (n.count < BENCH_MAX_NAMES &&
+               offset < idx->header->names_len) {
+            n.names[n.count++] = idx->names + offset;
+            offset += strlen(idx->names + offset) + 1;
+        }
+    }
+
+    run_bench(b, "run_info", "mixed", 100000, bench_run_info, &n);
+}
+
+/* cddb lookups, the PS1 half of find_ps1_canonical_name */
+
+struct KeysArg {
+    const struct CDDB* db;
+    uint64_t keys[BENCH_MAX_KEYS];
+    size_t count;
+    size_t next;
+};
+
+static int64_t bench_cddb(void* arg) {
+    struct KeysArg* k = arg;
+    volatile const char* name = cddb_find(k->db, k->keys[k->next]);
+    (void)name;
+    k->next = (k->next + 1) % k->count;
+    return 0;
+}
+
+static void bench_cddb_lookups(struct Bench* b) {
+    static struct KeysArg hits;
+    static struct KeysArg misses;
+    const struct CDDB* db = &b->ctx.ps1_ids;
+    uint32_t i;
+
+    if (db->map == NULL) {
+        fprintf(b->console, "cddb: no PS1 id list\n");
+        return;
+    }
+
+    memset(&hits, 0, sizeof(hits));
+    memset(&misses, 0, sizeof(misses));
+    hits.db = misses.db = db;
+    for (i = 0; i < db->header->slot_count && hits.count < BENCH_MAX_KEYS;
+         i++) {
+        if (db->slots[i].key != 0) {
+            hits.keys[hits.count++] = db->slots[i].key;
+            /* Same prefix and digit count, a number nobody uses */
+            misses.keys[misses.count++] = db->slots[i].key ^ 0x0FFFFFFF;
+        }
+    }
+
+    run_bench(b, "ps1_lookup", "hit", 100000, bench_cddb, &hits);
+    run_bench(b, "ps1_lookup", "miss", 100000, bench_cddb, &misses);
+}
+
+/* detect_cd_game on synthetic CUE/BIN images */
+
+struct DiscArg {
+    const struct CDDB* db;
+    char cue_path[PATH_MAX];
+};
+
+static int64_t bench_disc(void* arg) {
+    struct DiscArg* d = arg;
+    char game_name[MAX_TOKEN_LEN];
+    return detect_cd_game(d->db, NULL, d->cue_path, game_name,
+                          sizeof(game_name));
+}
+
+static void put_both32(unsigned char* data, uint32_t value) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        data[i] = value >> (i * 8);
+        data[7 - i] = value >> (i * 8);
+    }
+}
+
+static unsigned char to_bcd(int value) {
+    return (value / 10) << 4 | (value % 10);
+}
+
+/* Sync pattern, MSF address and mode of a raw sector */
+static void raw_header(unsigned char* sector, uint32_t lba, int mode) {
+    uint32_t frame = lba + 150;
+
+    sector[0] = 0;
+    memset(sector + 1, 0xff, 10);
+    sector[11] = 0;
+    sector[12] = to_bcd(frame / 75 / 60);
+    sector[13] = to_bcd(frame / 75 % 60);
+    sector[14] = to_bcd(frame % 75);
+    sector[15] = mode;
+}
+
+static void put_dir_record(unsigned char* record, const char* name,
+                           uint32_t lba, uint32_t size) {
+    size_t name_len = strlen(name);
+
+    record[0] = 33 + name_len + (name_len % 2 == 0);
+    put_both32(record + 2, lba);
+    put_both32(record + 10, size);
+    record[32] = name_len;
+    memcpy(record + 33, name, name_len);
+}
+
+/* A MODE2/2352 PS1 disc, found either by its label or by SYSTEM.CNF */
+static int write_ps1_disc(const char* bin_path, const char* volume_id,
+                          const char* boot_id) {
+    static unsigned char sectors[DISC_FILE_LBA + 1][CD_RAW_SECTOR_SIZE];
+    char system_cnf[128];
+    unsigned char* pvd;
+    uint32_t lba;
+
+    memset(sectors, 0, sizeof(sectors));
+    for (lba = 0; lba <= DISC_FILE_LBA; lba++) {
+        raw_header(sectors[lba], lba, 2);
+    }
+
+    snprintf(system_cnf, sizeof(system_cnf),
+             "BOOT = cdrom:\\%s;1\r\nTCB = 4\r\nEVENT = 10\r\n", boot_id);
+
+    pvd = sectors[16] + 24;
+    pvd[0] = 1;
+    memcpy(pvd + 1, "CD001", 5);
+    pvd[6] = 1;
+    memset(pvd + 8, ' ', 64);
+    memcpy(pvd + 8, "PLAYSTATION", 11);
+    memcpy(pvd + 40, volume_id, strlen(volume_id));
+    put_dir_record(pvd + 156, "", DISC_ROOT_LBA, CD_SECTOR_SIZE);
+    put_dir_record(sectors[DISC_ROOT_LBA] + 24, "SYSTEM.CNF;1",
+                   DISC_FILE_LBA, strlen(system_cnf));
+    memcpy(sectors[DISC_FILE_LBA] + 24, system_cnf, strlen(system_cnf));
+
+    return write_file(bin_path, sectors, sizeof(sectors),
+                      (off_t)DISC_SECTORS * CD_RAW_SECTOR_SIZE);
+}
+
+/* Sega CD discs are MODE1 with the system name right after the header */
+static int write_scd_disc(const char* bin_path) {
+    static unsigned char sector[CD_RAW_SECTOR_SIZE];
+
+    memset(sector, 0, sizeof(sector));
+    raw_header(sector, 0, 1);
+    memcpy(sector + 16, "SEGADISCSYSTEM  ", 16);
+    return write_file(bin_path, sector, sizeof(sector),
+                      (off_t)DISC_SECTORS * CD_RAW_SECTOR_SIZE);
+}
+
+static int write_cue(const char* cue_path, const char* bin_name,
+                     const char* mode) {
+    char cue[512];
+    int len = snprintf(cue, sizeof(cue),
+                       "FILE \"%s\" BINARY\r\n"
+                       "  TRACK 01 %s\r\n"
+                       "    INDEX 01 00:00:00\r\n"
+                       "FILE \"%s.audio\" BINARY\r\n"
+                       "  TRACK 02 AUDIO\r\n"
+                       "    INDEX 01 00:00:00\r\n",
+                       bin_name, mode, bin_name);
+    return write_file(cue_path, cue, len, 0);
+}
+
+static void bench_disc_case(struct Bench* b, const char* name,
+                            const char* mode, int (*write_bin)(const char*,
+                                                               void*),
+                            void* write_arg) {
+    struct DiscArg d;
+    char bin_name[64];
+    char bin_path[PATH_MAX];
+
+    if (snprintf(bin_name, sizeof(bin_name), "%s.bin", name) >=
+            (int)sizeof(bin_name) ||
+        snprintf(bin_path, PATH_MAX, "%s/%s", b->dir, bin_name) >=
+            PATH_MAX ||
+        snprintf(d.cue_path, PATH_MAX, "%s/%s.cue", b->dir, name) >=
+            PATH_MAX) {
+        fprintf(b->console, "cd_detect: path too long for '%s'\n", name);
+        return;
+    }
+
+    d.db = &b->ctx.ps1_ids;
+    if (write_bin(bin_path, write_arg) < 0 ||
+        write_cue(d.cue_path, bin_name, mode) < 0) {
+        fprintf(b->console, "cd_detect: could not write '%s'\n", bin_path);
+        return;
+    }
+
+    run_bench(b, "cd_detect", name, 1000, bench_disc, &d);
+    unlink(bin_path);
+    unlink(d.cue_path);
+}
+
+struct PS1Disc {
+    const char* volume_id;
+    const char* boot_id;
+};
+
+static int write_ps1_case(const char* bin_path, void* arg) {
+    struct PS1Disc* disc = arg;
+    return write_ps1_disc(bin_path, disc->volume_id, disc->boot_id);
+}
+
+static int write_scd_case(const char* bin_path, void* arg) {
+    return write_scd_disc(bin_path);
+}
+
+/* Spells a packed key the way boot paths do, e.g. SLUS_012.72 */
+static void format_serial(uint64_t key, char* serial, size_t max_len) {
+    char prefix[5];
+    int digits = key >> 28 & 0xF;
+    unsigned number = key & 0x0FFFFFFF;
+    char number_str[16];
+    int i;
+    int len = 0;
+
+    for (i = 3; i >= 0; i--) {
+        if ((key >> (32 + i * 8)) & 0xFF) {
+            prefix[len++] = (key >> (32 + i * 8)) & 0xFF;
+        }
+    }
+    prefix[len] = '\0';
+
+    snprintf(number_str, sizeof(number_str), "%0*u", digits, number);
+    snprintf(serial, max_len, "%s_%.*s.%s", prefix, digits - 2, number_str,
+             number_str + digits - 2);
+}
+
+static void bench_discs(struct Bench* b) {
+    const struct CDDB* db = &b->ctx.ps1_ids;
+    struct PS1Disc disc;
+    char serial[32] = "SLUS_000.00";
+    uint32_t i;
+
+    for (i = 0; db->map != NULL && i < db->header->slot_count; i++) {
+        if (db->slots[i].key != 0 && (db->slots[i].key >> 28 & 0xF) >= 3) {
+            format_serial(db->slots[i].key, serial, sizeof(serial));
+            break;
+        }
+    }
+
+    disc.volume_id = serial;
+    disc.boot_id = serial;
+    bench_disc_case(b, "ps1_label", "MODE2/2352", write_ps1_case, &disc);
+    disc.volume_id = "DISC";
+    bench_disc_case(b, "ps1_system_cnf", "MODE2/2352", write_ps1_case,
+                    &disc);
+    bench_disc_case(b, "scd_unknown", "MODE1/2352", write_scd_case, NULL);
+}
+
+static const struct option OPTIONS[] = {
+    {"output", required_argument, NULL, 'o'},
+    {"scale", required_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char* argv[]) {
+    struct Bench b;
+    const char* output = BENCH_OUTPUT;
+    int null_fd;
+    int stdout_fd;
+    int stderr_fd;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    b.scale = 1;
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                output = optarg;
+                break;
+            case 's':
+                b.scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    if ((b.out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Could not open '%s': %s\n", output,
+                strerror(errno));
+        return errno;
+    }
+
+    snprintf(b.dir, PATH_MAX, "/tmp/retrolaunch-bench.XXXXXX");
+    if (mkdtemp(b.dir) == NULL) {
+        fprintf(stderr, "Could not create a scratch directory: %s\n",
+                strerror(errno));
+        return errno;
+    }
+
+    /* Detection logs to both streams, which would end up in the timings
+     * of a terminal */
+    stdout_fd = dup(STDOUT_FILENO);
+    stderr_fd = dup(STDERR_FILENO);
+    b.console = fdopen(stderr_fd, "w");
+    setvbuf(b.console, NULL, _IOLBF, 0);
+    fflush(stdout);
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    fprintf(b.console, "sha1: %s, crc32: %s\n", SHA1SelectImplementation(),
+            crc32_select_implementation());
+    fprintf(b.out, "{\"sha1_implementation\":\"%s\","
+            "\"crc32_implementation\":\"%s\",\"timestamp\":%lld}\n",
+            SHA1SelectImplementation(), crc32_select_implementation(),
+            (long long)time(NULL));
+
+    detect_context_init(&b.ctx, 0);
+
+    bench_hashing(&b);
+    bench_roms(&b);
+    bench_run_infos(&b);
+    bench_cddb_lookups(&b);
+    bench_discs(&b);
+
+    detect_context_free(&b.ctx);
+    rmdir(b.dir);
+    fclose(b.out);
+
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    fprintf(b.console, "Results written to '%s'\n", output);
+    fclose(b.console);
+    return 0;
+}
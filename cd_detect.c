@@ -1,4 +1,10 @@
+#include "cd_detect.h"
 #include "parser.h"
+#include "cd_image.h"
+#include "cd_hash.h"
+#include "core_prefetch.h"
+#include "arena.h"
+#include "trace.h"
 
 #include <errno.h>
 #include <sys/types.h>
@@ -9,68 +15,143 @@
 #include <stdio.h>
 #include <libgen.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "log.h"
 
-#define MAGIC_LEN 16
+/* Sectors at the start of the data track read for the system probe, the
+ * volume descriptors and the root directory are usually among them */
+#define CD_SCAN_SECTORS 32
+/* Patterns that may be anywhere in the scanned sectors */
+#define CD_ANY_LBA UINT32_MAX
 
-struct MagicEntry {
+struct CDSignature {
     char* system_name;
-    char* magic;
+    uint32_t lba;
+    /* Offsets count from the start of the sector as stored, not from the
+     * user data */
+    int raw;
+    size_t offset;
+    char* pattern;
+    size_t len;
 };
 
-static struct MagicEntry MAGIC_NUMBERS[] = {
-    {"ps1", "\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00\x00\x02\x00\x02\x00"},
-    {"pcecd", "\x82\xb1\x82\xcc\x83\x76\x83\x8d\x83\x4f\x83\x89\x83\x80\x82\xcc\x92"},
-    {"scd", "\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00\x00\x02\x00\x01\x53"},
-    {NULL, NULL}
+/* Most specific first, the first one that matches wins. Matches are kept
+ * in a 32 bit mask, so there can be no more than 32. */
+static struct CDSignature CD_SIGNATURES[] = {
+    /* System areas at the start of the track */
+    {"saturn", 0, 0, 0, "SEGA SEGASATURN ", 16},
+    {"dc", 0, 0, 0, "SEGA SEGAKATANA ", 16},
+    {"scd", 0, 0, 0, "SEGADISCSYSTEM  ", 16},
+    {"pcfx", 0, 0, 0, "PC-FX:Hu_CD-ROM ", 16},
+    /* Opera volume header */
+    {"3do", 0, 0, 0, "\x01\x5a\x5a\x5a\x5a\x5a\x01", 7},
+    /* Volume descriptors */
+    {"cdi", 16, 0, 1, "CD-I ", 5},
+    {"ps1", 16, 0, 8, "PLAYSTATION ", 12},
+    /* Directory records of files only these discs have */
+    {"neocd", CD_ANY_LBA, 0, 0, "IPL.TXT;1", 9},
+    /* Sector headers and the PC Engine warning, the least specific */
+    {"ps1", 0, 1, 0, "\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00\x00\x02\x00\x02", 16},
+    {"pcecd", 0, 1, 0, "\x82\xb1\x82\xcc\x83\x76\x83\x8d\x83\x4f\x83\x89\x83\x80\x82\xcc", 16},
+    {"scd", 0, 1, 0, "\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x00\x00\x02\x00\x01", 16},
+    {NULL, 0, 0, 0, NULL, 0}
 };
 
-static int find_first_data_track(const char* cue_path, off_t* offset,
-                                 char* track_path, size_t max_len) {
-    int rv;
-    int fd = -1;
-    char tmp_token[MAX_TOKEN_LEN];
+/* Maximum length of a CUE track type, e.g. MODE2/2352 */
+#define TRACK_MODE_LEN 16
+
+/*
+ * Reads the INDEX lines of the current track. The track starts at INDEX
+ * 01, an INDEX 00 only marks its pregap and is used when there is no 01.
+ */
+static int find_track_start(struct Tokenizer* t, uint32_t* start_frame) {
+    struct Token token;
+    char tmp_token[MAX_TOKEN_LEN + 1];
+    int number;
     int m, s, f;
+    int rv = -EINVAL;
+
+    while (get_token(t, &token) > 0 && !token_case_equals(&token, "TRACK") &&
+           !token_case_equals(&token, "FILE")) {
+        if (!token_case_equals(&token, "INDEX")) {
+            continue;
+        }
+
+        if (get_token(t, &token) <= 0) {
+            break;
+        }
+        token_copy(&token, tmp_token, sizeof(tmp_token));
+        number = atoi(tmp_token);
+
+        if (get_token(t, &token) <= 0) {
+            break;
+        }
+        token_copy(&token, tmp_token, sizeof(tmp_token));
+        if (sscanf(tmp_token, "%02d:%02d:%02d", &m, &s, &f) < 3) {
+            LOG_WARN("Error parsing time stamp '%s'", tmp_token);
+            return -EINVAL;
+        }
+
+        if (number > 1) {
+            continue;
+        }
+
+        /* mm:ss:ff with 75 frames, i.e. sectors, a second */
+        *start_frame = (m * 60 + s) * 75 + f;
+        rv = 0;
+        if (number == 1) {
+            break;
+        }
+    }
+
+    return rv;
+}
+
+static int find_first_data_track(const char* cue_path, char* track_path,
+                                 size_t max_len, char* mode,
+                                 uint32_t* start_frame) {
+    int rv;
+    struct Tokenizer t;
+    struct Token token;
+    struct Arena* arena = launch_arena();
+    size_t mark = arena_mark(arena);
     char* cue_path_copy;
     char* cue_dir;
-    cue_path_copy = strdup(cue_path);
+
+    if ((cue_path_copy = arena_strdup(arena, cue_path)) == NULL) {
+        return -ENOMEM;
+    }
     cue_dir = dirname(cue_path_copy);
 
-    fd = open(cue_path, O_RDONLY);
-    if (fd < 0) {
+    if ((rv = tokenizer_open(&t, cue_path)) < 0) {
         LOG_WARN("Could not open CUE file '%s': %s", cue_path,
-                 strerror(errno));
-        rv = -errno;
+                 strerror(-rv));
         goto free_path_copy;
     }
 
     LOG_DEBUG("Parsing CUE file '%s'...", cue_path);
 
-    while (get_token(fd, tmp_token, MAX_TOKEN_LEN) > 0) {
-        if (strcmp(tmp_token, "FILE") == 0) {
-            get_token(fd, tmp_token, MAX_TOKEN_LEN);
-            snprintf(track_path, max_len, "%s/%s",
-                    cue_dir, tmp_token);
+    while (get_token(&t, &token) > 0) {
+        if (token_case_equals(&token, "FILE")) {
+            get_token(&t, &token);
+            snprintf(track_path, max_len, "%s/%.*s",
+                    cue_dir, (int)token.len, token.start);
 
-        } else if (strcasecmp(tmp_token, "TRACK") == 0) {
-            get_token(fd, tmp_token, MAX_TOKEN_LEN);
-            get_token(fd, tmp_token, MAX_TOKEN_LEN);
-            if (strcasecmp(tmp_token, "AUDIO") == 0) {
+        } else if (token_case_equals(&token, "TRACK")) {
+            get_token(&t, &token);
+            get_token(&t, &token);
+            if (token_case_equals(&token, "AUDIO")) {
                 continue;
             }
+            token_copy(&token, mode, TRACK_MODE_LEN);
 
-            find_token(fd, "INDEX");
-            get_token(fd, tmp_token, MAX_TOKEN_LEN);
-            get_token(fd, tmp_token, MAX_TOKEN_LEN);
-            if (sscanf(tmp_token, "%02d:%02d:%02d", &m, &s, &f) < 3) {
-                LOG_WARN("Error parsing time stamp '%s'", tmp_token);
-                return -errno;
+            if ((rv = find_track_start(&t, start_frame)) < 0) {
+                goto clean;
             }
-            *offset = ((m * 60) * (s * 75) * f) * 25;
 
-            LOG_DEBUG("Found 1st data track on file '%s+%d'",
-                    track_path, *offset);
+            LOG_DEBUG("Found 1st data track (%s) on file '%s+%u'",
+                    mode, track_path, *start_frame);
 
             rv = 0;
             goto clean;
@@ -80,199 +161,413 @@ static int find_first_data_track(const char* cue_path, off_t* offset,
     rv = -EINVAL;
 
 clean:
-    close(fd);
+    tokenizer_close(&t);
 free_path_copy:
-    free(cue_path_copy);
+    arena_release(arena, mark);
     return rv;
 }
 
-static int find_ps1_canonical_name(const char* game_id, char* game_name,
-                                   size_t max_len) {
-    int fd;
-    char tmp_token[MAX_TOKEN_LEN];
-    int rv = 0;
-    fd = open("cddb/ps1.idlst", O_RDONLY);
-    if (fd < 0) {
-        LOG_WARN("Could not open id list: %s", strerror(errno));
-        return -errno;
+/* GD-ROMs boot from the high density area, which starts here */
+#define GDI_HIGH_DENSITY_LBA 45000
+
+/*
+ * The data track a Dreamcast .gdi sheet boots from: the first one of the
+ * high density area, or the first one at all when there is none. GDI
+ * tracks are files of their own, so the data starts at their first sector.
+ */
+static int find_gdi_data_track(const char* gdi_path, char* track_path,
+                               size_t max_len, char* mode,
+                               uint32_t* start_frame) {
+    struct Tokenizer t;
+    struct Token count;
+    struct GDITrack track;
+    char gdi_dir[PATH_MAX];
+    int found = 0;
+    int rv;
+
+    strncpy(gdi_dir, gdi_path, PATH_MAX - 1);
+    gdi_dir[PATH_MAX - 1] = '\0';
+    dirname(gdi_dir);
+    if ((rv = tokenizer_open(&t, gdi_path)) < 0) {
+        LOG_WARN("Could not open GDI file '%s': %s", gdi_path,
+                 strerror(-rv));
+        return rv;
     }
 
-    while (get_token(fd, tmp_token, MAX_TOKEN_LEN) > 0) {
-        if(strcasecmp(tmp_token, game_id) != 0) {
-            get_token(fd, tmp_token, max_len);
+    LOG_DEBUG("Parsing GDI file '%s'...", gdi_path);
+    get_token(&t, &count);
+    while ((rv = gdi_next_track(&t, &track)) > 0) {
+        if (track.type != GDI_DATA ||
+            (found && track.lba < GDI_HIGH_DENSITY_LBA)) {
             continue;
         }
 
-        if ((rv = get_token(fd, game_name, max_len)) < 0) {
-            goto clean;
+        snprintf(track_path, max_len, "%s/%.*s", gdi_dir,
+                 (int)track.file.len, track.file.start);
+        snprintf(mode, TRACK_MODE_LEN, "MODE1/%d", track.sector_size);
+        *start_frame = 0;
+        found = 1;
+        if (track.lba >= GDI_HIGH_DENSITY_LBA) {
+            break;
         }
+    }
 
-        rv = 0;
-        goto clean;
+    tokenizer_close(&t);
+    if (rv < 0) {
+        return rv;
     }
 
-    rv = -ENOENT;
-clean:
-    close(fd);
-    return rv;
+    if (!found) {
+        return -EINVAL;
+    }
+
+    LOG_DEBUG("Found data track (%s) on file '%s'", mode, track_path);
+    return 0;
 }
 
-static int detect_ps1_game(const char* track_path, off_t offset,
-                          char* game_name, size_t max_len) {
-    int rv;
-    char buff[4096];
-    char* pattern = "cdrom:";
-    char* c;
-    char* id_start;
-    int i;
+/* Candidate ids from one disc, looked up together */
+#define PS1_MAX_IDS 8
+/* Longest boot path we expect after "cdrom:" */
+#define PS1_MAX_BOOT_PATH 64
+
+static void copy_name(const char* name, char* game_name, size_t max_len) {
+    strncpy(game_name, name, max_len - 1);
+    game_name[max_len - 1] = '\0';
+}
+
+/* Collects ids from boot paths like `cdrom:\SLUS_012.72;1` */
+static size_t find_boot_ids(const char* buff, size_t len, uint64_t* keys,
+                            size_t max_keys) {
+    static const char pattern[] = "cdrom:";
+    const size_t pattern_len = sizeof(pattern) - 1;
+    const char* c = buff;
+    const char* end = buff + len;
+    const char* id_start;
+    const char* id_end;
+    uint64_t key;
+    size_t count = 0;
+    size_t i;
+
+    while (count < max_keys &&
+           (c = memchr(c, 'c', end - c)) != NULL &&
+           (size_t)(end - c) > pattern_len) {
+        if (memcmp(c, pattern, pattern_len) != 0) {
+            c++;
+            continue;
+        }
+
+        id_start = id_end = c + pattern_len;
+        while (id_end < end && id_end - id_start < PS1_MAX_BOOT_PATH &&
+               *id_end != ';' && *id_end != '\0' &&
+               !isspace((unsigned char)*id_end)) {
+            if (*id_end == '\\' || *id_end == '/') {
+                id_start = id_end + 1;
+            }
+            id_end++;
+        }
+        c = id_end;
+
+        if (cddb_serial_key(id_start, id_end - id_start, &key) < 0) {
+            continue;
+        }
 
-    int fd = open(track_path, O_RDONLY);
-    if (fd < 0) {
-        LOG_DEBUG("Could not open data track: %s", strerror(errno));
-        return -errno;
+        for (i = 0; i < count && keys[i] != key; i++);
+        if (i == count) {
+            LOG_DEBUG("Found ps1 id %.*s", (int)(id_end - id_start), id_start);
+            keys[count++] = key;
+        }
     }
 
-    if (pread(fd, buff, 10, 0x9340) > 0) {
-        buff[10] = '\0';
-        buff[4] = '-';
+    return count;
+}
+
+/* Largest SYSTEM.CNF we look at, real ones are a few lines */
+#define PS1_MAX_SYSTEM_CNF 2048
+
+/*
+ * The volume label usually is the serial. Failing that, SYSTEM.CNF names
+ * the boot executable, which is named after it.
+ */
+static int detect_ps1_game(const struct CDDB* cddb, struct CDImage* img,
+                           char* game_name, size_t max_len) {
+    char buff[PS1_MAX_SYSTEM_CNF];
+    uint64_t keys[PS1_MAX_IDS];
+    const char* names[PS1_MAX_IDS];
+    const char* name;
+    uint32_t lba;
+    uint32_t size;
+    ssize_t len;
+    size_t count;
+    size_t i;
+    int rv;
+
+    if (cd_image_volume_id(img, buff, sizeof(buff)) == 0) {
         LOG_DEBUG("Found disk label '%s'", buff);
-        rv = find_ps1_canonical_name(buff, game_name, max_len);
-        if (rv == 0) {
+        if (cddb_serial_key(buff, strlen(buff), &keys[0]) == 0 &&
+            (name = cddb_find(cddb, keys[0])) != NULL) {
+            copy_name(name, game_name, max_len);
+            return 0;
+        }
+    }
+
+    if ((rv = cd_image_find_file(img, "SYSTEM.CNF", &lba, &size)) < 0) {
+        LOG_DEBUG("Could not find SYSTEM.CNF: %s", strerror(-rv));
+        return rv;
+    }
+
+    if ((len = cd_image_read_file(img, lba, size, buff, sizeof(buff))) < 0) {
+        return len;
+    }
+
+    count = find_boot_ids(buff, len, keys, PS1_MAX_IDS);
+    cddb_find_batch(cddb, keys, count, names);
+    for (i = 0; i < count; i++) {
+        if (names[i] != NULL) {
+            copy_name(names[i], game_name, max_len);
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* More games sharing every track than this is no identification */
+#define DISC_MAX_GAMES 256
+
+/*
+ * Hashes every track file and looks them up in the Redump DAT of the
+ * system, the way roms are looked up. Each track narrows the disc down to
+ * the games that list it with this size, crc and sha1; audio and pregap
+ * tracks are often shared between releases, so only the games every track
+ * agrees on are left. The name is only used when exactly one is.
+ */
+static int detect_disc_hash(const struct DBIndex* idx, const char* system,
+                            const char* cue_path, char* game_name,
+                            size_t max_len) {
+    struct Arena* arena = launch_arena();
+    size_t mark = arena_mark(arena);
+    struct CDTrackFile* files;
+    struct CDTrackFile* f;
+    uint32_t games[DISC_MAX_GAMES];
+    int counts[CD_MAX_TRACK_FILES];
+    char name[PATH_MAX];
+    size_t game_count;
+    size_t matches = 0;
+    size_t base = 0;
+    size_t count;
+    size_t i;
+    size_t j;
+    int rv;
+
+    /* Every entry used is filled in before it is read */
+    files = arena_alloc(arena, CD_MAX_TRACK_FILES * sizeof(*files));
+    if (files == NULL) {
+        rv = -ENOMEM;
+        goto clean;
+    }
+
+    if ((rv = cd_list_track_files(cue_path, files, CD_MAX_TRACK_FILES,
+                                  &count)) < 0) {
+        goto clean;
+    }
+
+    /* Sizes are free, so discs no DAT could know are never read */
+    for (i = 0; i < count; i++) {
+        if (db_index_find_size(idx, system, files[i].size, name,
+                               sizeof(name)) <= 0) {
+            LOG_DEBUG("No %s disc has a track of %llu bytes", system,
+                      (unsigned long long)files[i].size);
+            rv = -ENOENT;
             goto clean;
         }
     }
-    c = pattern;
-    while (1) {
-        rv = read(fd, buff, 4096);
-        if (rv < 0) {
-            rv = -errno;
+
+    LOG_DEBUG("Hashing %zu track files...", count);
+    if ((rv = cd_hash_track_files(files, count)) < 0) {
+        goto clean;
+    }
+
+    /* The track in the fewest games is where the candidates come from */
+    for (i = 0; i < count; i++) {
+        f = &files[i];
+        counts[i] = db_index_find_games(idx, system, f->size, f->crc,
+                                        f->sha1, NULL, 0);
+        LOG_DEBUG("Track '%s' is in %d games", f->path, counts[i]);
+        if (counts[i] == 0) {
+            rv = -ENOENT;
             goto clean;
         }
 
-        for(i = 0; i < 4096; i++) {
-            if (*c == buff[i]) {
-                c++;
-            } else {
-                c = pattern;
-                continue;
-            }
+        if (counts[i] < counts[base]) {
+            base = i;
+        }
+    }
 
-            if (*c == '\0') {
-                id_start = &buff[i] + 1;
-                *strchr(id_start, ';') = '\0';
-                c = strrchr(id_start, '\\') + 1;
-                if (c != NULL) {
-                    id_start = c;
-                }
-                id_start[4] = '-';
-                id_start[8] = id_start[9];
-                id_start[9] = id_start[10];
-                id_start[10] = '\0';
-                LOG_DEBUG("Found ps1 id %s", id_start);
-                rv = find_ps1_canonical_name(id_start, game_name, max_len);
-                goto clean;
+    if (counts[base] > DISC_MAX_GAMES) {
+        LOG_DEBUG("Every track is in more than %d games", DISC_MAX_GAMES);
+        rv = -ENOENT;
+        goto clean;
+    }
+
+    f = &files[base];
+    game_count = db_index_find_games(idx, system, f->size, f->crc, f->sha1,
+                                     games, DISC_MAX_GAMES);
+    for (i = 0; i < game_count; i++) {
+        for (j = 0; j < count; j++) {
+            if (j != base &&
+                !db_index_has_game(idx, system, files[j].size, files[j].crc,
+                                   files[j].sha1, games[i])) {
+                break;
             }
         }
+
+        if (j == count) {
+            games[matches++] = games[i];
+        }
     }
-    rv = -EINVAL;
+
+    if (matches != 1) {
+        LOG_DEBUG("The tracks agree on %zu games", matches);
+        rv = -ENOENT;
+        goto clean;
+    }
+
+    rv = db_index_game_name(idx, games[0], game_name, max_len);
 clean:
-    close(fd);
+    arena_release(arena, mark);
     return rv;
 }
 
-static int detect_system(const char* track_path, off_t offset,
-        char** system_name) {
-    int rv;
-    char magic[MAGIC_LEN];
-    int fd;
-    struct MagicEntry entry;
-    int i;
+/*
+ * Finds every unanchored signature in one pass. Only bytes some pattern
+ * starts with are looked at more closely, so the pass costs about the same
+ * however many systems there are. Returns a mask of CD_SIGNATURES indexes.
+ */
+static uint32_t scan_unanchored(const unsigned char* buff, size_t len) {
+    uint32_t first_bytes[256];
+    const struct CDSignature* sig;
+    uint32_t found = 0;
+    uint32_t mask;
+    size_t i;
+    int bit;
+
+    memset(first_bytes, 0, sizeof(first_bytes));
+    for (bit = 0; CD_SIGNATURES[bit].system_name != NULL; bit++) {
+        if (CD_SIGNATURES[bit].lba == CD_ANY_LBA) {
+            first_bytes[(unsigned char)CD_SIGNATURES[bit].pattern[0]] |=
+                1u << bit;
+        }
+    }
 
-    fd = open(track_path, O_RDONLY);
-    if (fd < 0) {
-        LOG_WARN("Could not open data track of file '%s': %s",
-                 track_path, strerror(errno));
-        rv = -errno;
-        goto clean;
+    for (i = 0; i < len; i++) {
+        for (mask = first_bytes[buff[i]] & ~found; mask != 0;
+             mask &= mask - 1) {
+            bit = __builtin_ctz(mask);
+            sig = &CD_SIGNATURES[bit];
+            if (i + sig->len <= len &&
+                memcmp(buff + i, sig->pattern, sig->len) == 0) {
+                found |= 1u << bit;
+            }
+        }
     }
 
-    if (pread(fd, magic, MAGIC_LEN, offset) < MAGIC_LEN) {
-        LOG_WARN("Could not read data from file '%s' at offset %d: %s",
-                track_path, offset, strerror(errno));
-        rv = -errno;
-        goto clean;
+    return found;
+}
+
+/*
+ * Reads the first CD_SCAN_SECTORS sectors once and checks every signature
+ * against them. The sectors stay cached for the id lookup that follows.
+ */
+static int detect_system(struct CDImage* img, char** system_name) {
+    unsigned char buff[CD_SCAN_SECTORS * CD_RAW_SECTOR_SIZE];
+    const struct CDSignature* sig;
+    uint32_t found = 0;
+    int scanned = 0;
+    size_t len;
+    size_t pos;
+    ssize_t rv;
+    int i;
+
+    if ((rv = cd_image_read_span(img, 0, CD_SCAN_SECTORS, buff)) <= 0) {
+        LOG_WARN("Could not read the first sector: %s",
+                 rv < 0 ? strerror(-rv) : "track is empty");
+        return rv < 0 ? rv : -EINVAL;
     }
+    len = rv * img->sector_size;
+
+    LOG_DEBUG("Comparing with known signatures...");
+    for (i = 0; CD_SIGNATURES[i].system_name != NULL; i++) {
+        sig = &CD_SIGNATURES[i];
+        if (sig->lba == CD_ANY_LBA) {
+            /* Only scanned when nothing before it matched */
+            if (!scanned) {
+                found = scan_unanchored(buff, len);
+                scanned = 1;
+            }
 
-    LOG_DEBUG("Comparing with known magic numbers...");
-    for (i = 0; MAGIC_NUMBERS[i].system_name != NULL; i++) {
-        if (memcmp(MAGIC_NUMBERS[i].magic, magic, MAGIC_LEN) == 0) {
-            *system_name = MAGIC_NUMBERS[i].system_name;
-            rv = 0;
-            goto clean;
+            if (found & (1u << i)) {
+                *system_name = sig->system_name;
+                return 0;
+            }
+            continue;
+        }
+
+        pos = (size_t)sig->lba * img->sector_size +
+              (sig->raw ? 0 : img->data_offset) + sig->offset;
+        if (pos + sig->len <= len &&
+            memcmp(buff + pos, sig->pattern, sig->len) == 0) {
+            *system_name = sig->system_name;
+            return 0;
         }
     }
 
     LOG_WARN("Could not find compatible system");
-    rv = -EINVAL;
-clean:
-    close(fd);
-    return rv;
+    return -EINVAL;
 }
 
 int find_fist_cue(const char* m3u_path, char* cue_path, size_t max_len) {
-    char c;
-    int skip = 0;
-    int midstream = 0;
+    struct Tokenizer t;
+    struct Token line;
     char tmp_path[PATH_MAX];
+    int rv;
 
-    int fd = open(m3u_path, O_RDONLY);
-    if (fd < 0) {
-        LOG_WARN("Could not open m3u '%s': %s", m3u_path, strerror(errno));
-        return -errno;
+    if ((rv = tokenizer_open(&t, m3u_path)) < 0) {
+        LOG_WARN("Could not open m3u '%s': %s", m3u_path, strerror(-rv));
+        return rv;
     }
 
     strncpy(tmp_path, m3u_path, PATH_MAX);
-    strcpy(cue_path, dirname(tmp_path));
-    cue_path += strlen(cue_path);
-    cue_path[0] = '/';
-    cue_path++;
-
-    while ((read(fd, &c, 1) > 0)) {
-        switch (c) {
-            case '#':
-                if (!midstream) {
-                    skip = 1;
-                }
-                break;
-            case '\n':
-                if (skip) {
-                    skip = 0;
-                } else if(midstream) {
-                    cue_path[0] = '\0';
-                    return 0;
-                }
-                break;
-            case ' ':
-                if (!midstream) {
-                    break;
-                }
-            default:
-                if (!skip) {
-                    midstream = 1;
-                    cue_path[0] = c;
-                    cue_path++;
-                }
+    rv = -EINVAL;
+    while (get_line(&t, &line) > 0) {
+        while (line.len > 0 && (*line.start == ' ' || *line.start == '\t')) {
+            line.start++;
+            line.len--;
         }
+
+        if (line.len == 0 || *line.start == '#') {
+            continue;
+        }
+
+        snprintf(cue_path, max_len, "%s/%.*s", dirname(tmp_path),
+                 (int)line.len, line.start);
+        rv = 0;
+        break;
     }
 
-    return -EINVAL;
+    tokenizer_close(&t);
+    return rv;
 }
 
-int detect_cd_game(const char* target_path, char* game_name, size_t max_len) {
+int detect_cd_game(const struct CDDB* cddb, const struct DBIndex* idx,
+                   const char* target_path, char* game_name, size_t max_len) {
     char cue_path[PATH_MAX];
     char track_path[PATH_MAX];
-    off_t offset;
+    char mode[TRACK_MODE_LEN];
+    uint32_t start_frame;
+    struct CDImage img;
+    struct TraceSpan span;
     char* system_name;
+    size_t prefix_len;
     int rv;
     if (strcasecmp(target_path + strlen(target_path) - 4, ".m3u") == 0) {
         rv = find_fist_cue(target_path, cue_path, PATH_MAX);
@@ -282,10 +577,18 @@ int detect_cd_game(const char* target_path, char* game_name, size_t max_len) {
         }
 
     } else {
-        strncpy(cue_path, target_path, max_len);
+        strncpy(cue_path, target_path, PATH_MAX);
     }
 
-    rv = find_first_data_track(cue_path, &offset, track_path, PATH_MAX);
+    TRACE_BEGIN(&span, TRACE_CD_DATA_TRACK);
+    if (cd_is_gdi(cue_path)) {
+        rv = find_gdi_data_track(cue_path, track_path, PATH_MAX, mode,
+                                 &start_frame);
+    } else {
+        rv = find_first_data_track(cue_path, track_path, PATH_MAX, mode,
+                                   &start_frame);
+    }
+    TRACE_END(&span);
     if (rv < 0) {
         LOG_WARN("Could not find valid data track: %s", strerror(-rv));
         return rv;
@@ -293,22 +596,48 @@ int detect_cd_game(const char* target_path, char* game_name, size_t max_len) {
 
     LOG_DEBUG("Reading 1st data track...");
 
-    if ((rv = detect_system(track_path, offset, &system_name)) < 0) {
+    if ((rv = cd_image_open(&img, track_path, mode, start_frame)) < 0) {
         return rv;
     }
 
+    TRACE_BEGIN(&span, TRACE_CD_SYSTEM);
+    rv = detect_system(&img, &system_name);
+    TRACE_END(&span);
+    if (rv < 0) {
+        goto clean;
+    }
 
     LOG_DEBUG("Detected %s media", system_name);
+    core_prefetch_system(system_name);
 
     snprintf(game_name, max_len, "%s.", system_name);
-    game_name += strlen(system_name) + 1;
-    max_len -= strlen(system_name) + 1;
+    prefix_len = strlen(system_name) + 1;
+    rv = 0;
     if (strcmp(system_name, "ps1") == 0) {
-        if (detect_ps1_game(track_path, offset, game_name, max_len) == 0) {
-            return 0;
+        TRACE_BEGIN(&span, TRACE_CD_PS1_GAME);
+        rv = detect_ps1_game(cddb, &img, game_name + prefix_len,
+                             max_len - prefix_len);
+        TRACE_END(&span);
+        if (rv == 0) {
+            goto clean;
         }
+        rv = 0;
     }
 
-    snprintf(game_name, max_len, "<unknown>", system_name);
-    return 0;
+    /* Index names carry the system already */
+    if (idx != NULL) {
+        TRACE_BEGIN(&span, TRACE_CD_HASH);
+        rv = detect_disc_hash(idx, system_name, cue_path, game_name,
+                              max_len);
+        TRACE_END(&span);
+        if (rv == 0) {
+            goto clean;
+        }
+        rv = 0;
+    }
+
+    snprintf(game_name + prefix_len, max_len - prefix_len, "<unknown>");
+clean:
+    cd_image_close(&img);
+    return rv;
 }
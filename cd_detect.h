@@ -1,3 +1,7 @@
 #include <unistd.h>
 
-int detect_cd_game(const char* cue_path, char* game_name, size_t max_len);
+#include "cddb.h"
+#include "db_index.h"
+
+int detect_cd_game(const struct CDDB* cddb, const struct DBIndex* idx,
+                   const char* cue_path, char* game_name, size_t max_len);
@@ -0,0 +1,223 @@
+#include "cd_hash.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "sha1.h"
+#include "crc32.h"
+#include "parser.h"
+#include "rom_reader.h"
+
+#include "log.h"
+
+/* Tracks are read in parallel, more threads than that only seek more */
+#define CD_HASH_MAX_JOBS 8
+
+int cd_is_gdi(const char* path) {
+    size_t len = strlen(path);
+    return len >= 4 && strcasecmp(path + len - 4, ".gdi") == 0;
+}
+
+/*
+ * Reads the next `number lba type sector_size file offset` line of a GDI
+ * sheet. Returns 1 for a track, 0 at the end and -EINVAL when the line is
+ * cut short.
+ */
+int gdi_next_track(struct Tokenizer* t, struct GDITrack* track) {
+    struct Token fields[6];
+    char tmp[16];
+    uint32_t values[4];
+    size_t i;
+    int rv;
+
+    if ((rv = get_token(t, &fields[0])) <= 0) {
+        return rv;
+    }
+
+    for (i = 1; i < 6; i++) {
+        if (get_token(t, &fields[i]) <= 0) {
+            return -EINVAL;
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        token_copy(&fields[i], tmp, sizeof(tmp));
+        values[i] = strtoul(tmp, NULL, 10);
+    }
+
+    track->number = values[0];
+    track->lba = values[1];
+    track->type = values[2];
+    track->sector_size = values[3];
+    track->file = fields[4];
+    return 1;
+}
+
+/* Track files of a GDI sheet, one per line */
+static int next_gdi_file(struct Tokenizer* t, struct Token* file) {
+    struct GDITrack track;
+    int rv;
+
+    if ((rv = gdi_next_track(t, &track)) > 0) {
+        *file = track.file;
+    }
+    return rv;
+}
+
+/* Track files of a CUE sheet, each after a FILE keyword */
+static int next_cue_file(struct Tokenizer* t, struct Token* file) {
+    struct Token token;
+    int rv;
+
+    while ((rv = get_token(t, &token)) > 0) {
+        if (token_case_equals(&token, "FILE")) {
+            return get_token(t, file) > 0 ? 1 : -EINVAL;
+        }
+    }
+
+    return rv;
+}
+
+/* Lists the files of a CUE or GDI sheet in order, with their sizes */
+int cd_list_track_files(const char* cue_path, struct CDTrackFile* files,
+                        size_t max_files, size_t* count) {
+    struct Tokenizer t;
+    struct Token token;
+    struct stat st;
+    int (*next_file)(struct Tokenizer*, struct Token*);
+    char cue_copy[PATH_MAX];
+    const char* cue_dir;
+    struct CDTrackFile* f;
+    int rv;
+
+    strncpy(cue_copy, cue_path, PATH_MAX - 1);
+    cue_copy[PATH_MAX - 1] = '\0';
+    cue_dir = dirname(cue_copy);
+    if ((rv = tokenizer_open(&t, cue_path)) < 0) {
+        LOG_WARN("Could not open CD sheet '%s': %s", cue_path,
+                 strerror(-rv));
+        return rv;
+    }
+
+    *count = 0;
+    next_file = next_cue_file;
+    if (cd_is_gdi(cue_path)) {
+        /* The first line only holds the number of tracks */
+        next_file = next_gdi_file;
+        get_token(&t, &token);
+    }
+
+    while ((rv = next_file(&t, &token)) > 0) {
+        if (*count == max_files) {
+            rv = -EINVAL;
+            break;
+        }
+
+        f = &files[(*count)++];
+        memset(f, 0, sizeof(*f));
+        snprintf(f->path, PATH_MAX, "%s/%.*s", cue_dir,
+                 (int)token.len, token.start);
+        if (stat(f->path, &st) < 0) {
+            rv = -errno;
+            LOG_DEBUG("Could not find track '%s': %s", f->path,
+                      strerror(errno));
+            break;
+        }
+        f->size = st.st_size;
+    }
+
+    tokenizer_close(&t);
+    return rv == 0 && *count == 0 ? -EINVAL : rv;
+}
+
+static int hash_track_file(struct CDTrackFile* f) {
+    struct RomReader r;
+    SHA1Context sha;
+    const unsigned char* data;
+    ssize_t rv;
+
+    if ((rv = rom_reader_open(&r, f->path, NULL)) < 0) {
+        return rv;
+    }
+
+    SHA1Reset(&sha);
+    f->crc = 0;
+    while ((rv = rom_reader_next(&r, &data)) > 0) {
+        f->crc = crc32_update(f->crc, data, rv);
+        SHA1Input(&sha, data, rv);
+    }
+
+    rom_reader_close(&r);
+    if (rv == 0 && !SHA1ResultBinary(&sha, f->sha1)) {
+        rv = -EINVAL;
+    }
+
+    return rv;
+}
+
+struct HashJobs {
+    struct CDTrackFile* files;
+    size_t count;
+    size_t next;
+    int rv;
+};
+
+static void* hash_worker(void* arg) {
+    struct HashJobs* jobs = arg;
+    size_t i;
+    int rv;
+
+    while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) <
+           jobs->count) {
+        if ((rv = hash_track_file(&jobs->files[i])) < 0) {
+            LOG_DEBUG("Could not hash track '%s': %s", jobs->files[i].path,
+                      strerror(-rv));
+            __atomic_store_n(&jobs->rv, rv, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Hashes every track file, each on a core of its own, the calling thread
+ * included. Every file is read sequentially, so a disc is hashed about
+ * as fast as the disk reads it.
+ */
+int cd_hash_track_files(struct CDTrackFile* files, size_t count) {
+    pthread_t threads[CD_HASH_MAX_JOBS];
+    struct HashJobs jobs;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = 0;
+    size_t max_threads;
+
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.files = files;
+    jobs.count = count;
+
+    max_threads = count < CD_HASH_MAX_JOBS ? count : CD_HASH_MAX_JOBS;
+    if (cpus > 0 && (size_t)cpus < max_threads) {
+        max_threads = cpus;
+    }
+
+    /* The calling thread is one of the workers */
+    while (thread_count + 1 < max_threads &&
+           pthread_create(&threads[thread_count], NULL, hash_worker,
+                          &jobs) == 0) {
+        thread_count++;
+    }
+
+    hash_worker(&jobs);
+    while (thread_count > 0) {
+        pthread_join(threads[--thread_count], NULL);
+    }
+
+    return jobs.rv;
+}
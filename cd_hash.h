@@ -0,0 +1,40 @@
+#ifndef _CD_HASH_H_
+#define _CD_HASH_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "db_index.h"
+#include "parser.h"
+
+/* A CUE or GDI sheet holds at most 99 tracks */
+#define CD_MAX_TRACK_FILES 99
+
+/* One FILE of a sheet, hashed whole the way Redump DATs list them */
+struct CDTrackFile {
+    char path[PATH_MAX];
+    uint64_t size;
+    uint32_t crc;
+    unsigned char sha1[DB_SHA1_SIZE];
+};
+
+/* One line of a Dreamcast .gdi sheet, after the track count */
+struct GDITrack {
+    uint32_t number;
+    uint32_t lba;
+    /* GDI_DATA or audio */
+    int type;
+    int sector_size;
+    struct Token file;
+};
+
+#define GDI_DATA 4
+
+int cd_is_gdi(const char* path);
+int gdi_next_track(struct Tokenizer* t, struct GDITrack* track);
+int cd_list_track_files(const char* cue_path, struct CDTrackFile* files,
+                        size_t max_files, size_t* count);
+int cd_hash_track_files(struct CDTrackFile* files, size_t count);
+
+#endif
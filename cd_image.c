@@ -0,0 +1,289 @@
+#include "cd_image.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "trace.h"
+
+#include "log.h"
+
+#define CD_NO_SECTOR UINT32_MAX
+
+/* ISO9660 */
+#define ISO_PVD_LBA 16
+#define ISO_SYSTEM_ID_OFFSET 8
+#define ISO_SYSTEM_ID_LEN 32
+#define ISO_VOLUME_ID_OFFSET 40
+#define ISO_VOLUME_ID_LEN 32
+#define ISO_ROOT_RECORD_OFFSET 156
+#define ISO_MAX_DIR_SECTORS 16
+
+struct SectorLayout {
+    const char* mode;
+    int sector_size;
+    int data_offset;
+};
+
+/* CUE track types, raw sectors carry sync, header and subheader bytes */
+static const struct SectorLayout SECTOR_LAYOUTS[] = {
+    {"MODE1/2048", 2048, 0},
+    {"MODE1/2352", 2352, 16},
+    {"MODE2/2048", 2048, 0},
+    {"MODE2/2336", 2336, 8},
+    {"MODE2/2352", 2352, 24},
+    {"CDI/2336", 2336, 8},
+    {"CDI/2352", 2352, 24},
+    {NULL, 0, 0}
+};
+
+static uint32_t read_le32(const unsigned char* data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+int cd_image_open(struct CDImage* img, const char* path, const char* mode,
+                  uint32_t start_frame) {
+    const struct SectorLayout* layout;
+    int i;
+
+    for (layout = SECTOR_LAYOUTS; layout->mode != NULL; layout++) {
+        if (strcasecmp(layout->mode, mode) == 0) {
+            break;
+        }
+    }
+
+    if (layout->mode == NULL) {
+        LOG_WARN("Unsupported track type '%s'", mode);
+        return -EINVAL;
+    }
+
+    img->fd = open(path, O_RDONLY);
+    if (img->fd < 0) {
+        LOG_WARN("Could not open data track '%s': %s", path,
+                 strerror(errno));
+        return -errno;
+    }
+
+    img->sector_size = layout->sector_size;
+    img->data_offset = layout->data_offset;
+    img->track_offset = (off_t)start_frame * layout->sector_size;
+    img->sectors_read = 0;
+    for (i = 0; i < CD_CACHE_SECTORS; i++) {
+        img->cached_lba[i] = CD_NO_SECTOR;
+    }
+
+    return 0;
+}
+
+void cd_image_close(struct CDImage* img) {
+    LOG_DEBUG("Read %u sectors", img->sectors_read);
+    close(img->fd);
+    img->fd = -1;
+}
+
+/* The sector as stored in the file, sector_size bytes */
+int cd_image_read_raw(struct CDImage* img, uint32_t lba,
+                      const unsigned char** sector) {
+    int slot = lba % CD_CACHE_SECTORS;
+    ssize_t rv;
+
+    if (img->cached_lba[slot] != lba) {
+        rv = pread(img->fd, img->cache[slot], img->sector_size,
+                   img->track_offset + (off_t)lba * img->sector_size);
+        TRACE_READ(rv);
+        TRACE_CACHE(0);
+        if (rv < 0) {
+            return -errno;
+        }
+
+        if (rv < img->sector_size) {
+            return -ENODATA;
+        }
+
+        img->cached_lba[slot] = lba;
+        img->sectors_read++;
+    } else {
+        TRACE_CACHE(1);
+    }
+
+    *sector = img->cache[slot];
+    return 0;
+}
+
+/*
+ * Reads up to `count` raw sectors from `lba` into `buff` with one call,
+ * and keeps them in the cache for later reads. Returns the number of
+ * whole sectors read.
+ */
+ssize_t cd_image_read_span(struct CDImage* img, uint32_t lba, uint32_t count,
+                           unsigned char* buff) {
+    ssize_t rv;
+    uint32_t i;
+    int slot;
+
+    rv = pread(img->fd, buff, (size_t)count * img->sector_size,
+               img->track_offset + (off_t)lba * img->sector_size);
+    TRACE_READ(rv);
+    if (rv < 0) {
+        return -errno;
+    }
+
+    count = rv / img->sector_size;
+    for (i = 0; i < count; i++) {
+        slot = (lba + i) % CD_CACHE_SECTORS;
+        memcpy(img->cache[slot], buff + (size_t)i * img->sector_size,
+               img->sector_size);
+        img->cached_lba[slot] = lba + i;
+    }
+    img->sectors_read += count;
+
+    return count;
+}
+
+/* The 2048 bytes of user data */
+int cd_image_read(struct CDImage* img, uint32_t lba,
+                  const unsigned char** data) {
+    int rv;
+    if ((rv = cd_image_read_raw(img, lba, data)) < 0) {
+        return rv;
+    }
+
+    *data += img->data_offset;
+    return 0;
+}
+
+static int read_pvd(struct CDImage* img, const unsigned char** pvd) {
+    int rv;
+    if ((rv = cd_image_read(img, ISO_PVD_LBA, pvd)) < 0) {
+        return rv;
+    }
+
+    if ((*pvd)[0] != 1 || memcmp(*pvd + 1, "CD001", 5) != 0) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* PVD strings are padded with spaces */
+static int read_pvd_string(struct CDImage* img, size_t offset, size_t len,
+                           char* out, size_t max_len) {
+    const unsigned char* pvd;
+    int rv;
+
+    if ((rv = read_pvd(img, &pvd)) < 0) {
+        return rv;
+    }
+
+    while (len > 0 && (pvd[offset + len - 1] == ' ' ||
+                       pvd[offset + len - 1] == '\0')) {
+        len--;
+    }
+
+    if (len >= max_len) {
+        len = max_len - 1;
+    }
+
+    memcpy(out, pvd + offset, len);
+    out[len] = '\0';
+    return 0;
+}
+
+int cd_image_system_id(struct CDImage* img, char* system_id, size_t max_len) {
+    return read_pvd_string(img, ISO_SYSTEM_ID_OFFSET, ISO_SYSTEM_ID_LEN,
+                           system_id, max_len);
+}
+
+int cd_image_volume_id(struct CDImage* img, char* volume_id, size_t max_len) {
+    return read_pvd_string(img, ISO_VOLUME_ID_OFFSET, ISO_VOLUME_ID_LEN,
+                           volume_id, max_len);
+}
+
+/* Compares a directory record name, ignoring the ";1" version suffix */
+static int record_name_equals(const unsigned char* record_name,
+                              size_t record_len, const char* name) {
+    size_t len = strlen(name);
+    const unsigned char* version = memchr(record_name, ';', record_len);
+    if (version != NULL) {
+        record_len = version - record_name;
+    }
+
+    return record_len == len &&
+           strncasecmp((const char*)record_name, name, len) == 0;
+}
+
+/* Looks a file up in the root directory */
+int cd_image_find_file(struct CDImage* img, const char* name,
+                       uint32_t* lba, uint32_t* size) {
+    const unsigned char* pvd;
+    const unsigned char* dir;
+    const unsigned char* record;
+    uint32_t dir_lba;
+    uint32_t dir_sectors;
+    uint32_t i;
+    size_t pos;
+    int rv;
+
+    if ((rv = read_pvd(img, &pvd)) < 0) {
+        return rv;
+    }
+
+    dir_lba = read_le32(pvd + ISO_ROOT_RECORD_OFFSET + 2);
+    dir_sectors = (read_le32(pvd + ISO_ROOT_RECORD_OFFSET + 10) +
+                   CD_SECTOR_SIZE - 1) / CD_SECTOR_SIZE;
+    if (dir_sectors > ISO_MAX_DIR_SECTORS) {
+        dir_sectors = ISO_MAX_DIR_SECTORS;
+    }
+
+    for (i = 0; i < dir_sectors; i++) {
+        if ((rv = cd_image_read(img, dir_lba + i, &dir)) < 0) {
+            return rv;
+        }
+
+        /* Records never cross sectors, a zero length pads to the next one */
+        for (pos = 0; pos + 33 < CD_SECTOR_SIZE && dir[pos] != 0;
+             pos += dir[pos]) {
+            record = dir + pos;
+            if (pos + record[0] > CD_SECTOR_SIZE ||
+                33 + (size_t)record[32] > record[0]) {
+                return -EINVAL;
+            }
+
+            if (record_name_equals(record + 33, record[32], name)) {
+                *lba = read_le32(record + 2);
+                *size = read_le32(record + 10);
+                return 0;
+            }
+        }
+    }
+
+    return -ENOENT;
+}
+
+ssize_t cd_image_read_file(struct CDImage* img, uint32_t lba, uint32_t size,
+                           char* buff, size_t max_len) {
+    const unsigned char* data;
+    size_t len = 0;
+    size_t chunk;
+    int rv;
+
+    if (size < max_len) {
+        max_len = size;
+    }
+
+    while (len < max_len) {
+        if ((rv = cd_image_read(img, lba++, &data)) < 0) {
+            return rv;
+        }
+
+        chunk = max_len - len < CD_SECTOR_SIZE ? max_len - len
+                                               : CD_SECTOR_SIZE;
+        memcpy(buff + len, data, chunk);
+        len += chunk;
+    }
+
+    return len;
+}
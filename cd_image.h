@@ -0,0 +1,42 @@
+#ifndef _CD_IMAGE_H_
+#define _CD_IMAGE_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define CD_RAW_SECTOR_SIZE 2352
+#define CD_SECTOR_SIZE 2048
+#define CD_CACHE_SECTORS 16
+
+/*
+ * A data track in a BIN/ISO file. Sectors are read whole through a small
+ * cache so the system probe and the id lookup share the reads.
+ */
+struct CDImage {
+    int fd;
+    /* Bytes per sector in the file and where the 2048 data bytes start */
+    int sector_size;
+    int data_offset;
+    off_t track_offset;
+    uint32_t cached_lba[CD_CACHE_SECTORS];
+    unsigned char cache[CD_CACHE_SECTORS][CD_RAW_SECTOR_SIZE];
+    unsigned sectors_read;
+};
+
+int cd_image_open(struct CDImage* img, const char* path, const char* mode,
+                  uint32_t start_frame);
+void cd_image_close(struct CDImage* img);
+int cd_image_read_raw(struct CDImage* img, uint32_t lba,
+                      const unsigned char** sector);
+int cd_image_read(struct CDImage* img, uint32_t lba,
+                  const unsigned char** data);
+ssize_t cd_image_read_span(struct CDImage* img, uint32_t lba, uint32_t count,
+                           unsigned char* buff);
+int cd_image_system_id(struct CDImage* img, char* system_id, size_t max_len);
+int cd_image_volume_id(struct CDImage* img, char* volume_id, size_t max_len);
+int cd_image_find_file(struct CDImage* img, const char* name,
+                       uint32_t* lba, uint32_t* size);
+ssize_t cd_image_read_file(struct CDImage* img, uint32_t lba, uint32_t size,
+                           char* buff, size_t max_len);
+
+#endif
@@ -0,0 +1,439 @@
+#include "cddb.h"
+
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "parser.h"
+
+#include "log.h"
+
+#define CDDB_MAGIC "RLCD"
+#define CDDB_VERSION 1
+
+struct ListEntry {
+    uint64_t key;
+    uint32_t name_offset;
+};
+
+struct ListBuilder {
+    struct ListEntry* entries;
+    size_t entry_count;
+    size_t entry_cap;
+    char* names;
+    size_t names_len;
+    size_t names_cap;
+};
+
+/*
+ * Packs an id such as "SLUS-01272", or "SLUS_012.72" as it appears in the
+ * boot path, into the four prefix letters, the digit count and the number.
+ */
+int cddb_serial_key(const char* serial, size_t len, uint64_t* key) {
+    uint64_t prefix = 0;
+    uint32_t number = 0;
+    int digits = 0;
+    size_t i;
+
+    for (i = 0; i < len && i < 4 && isalpha((unsigned char)serial[i]); i++) {
+        prefix = (prefix << 8) | toupper((unsigned char)serial[i]);
+    }
+
+    if (i < len && (serial[i] == '-' || serial[i] == '_')) {
+        i++;
+    }
+
+    for (; i < len; i++) {
+        if (serial[i] == '.') {
+            continue;
+        }
+
+        if (!isdigit((unsigned char)serial[i]) || ++digits > 7) {
+            return -EINVAL;
+        }
+
+        number = number * 10 + (serial[i] - '0');
+    }
+
+    if (digits == 0) {
+        return -EINVAL;
+    }
+
+    *key = (prefix << 32) | ((uint64_t)digits << 28) | number;
+    return 0;
+}
+
+static uint32_t key_slot(uint64_t key, uint32_t slot_count) {
+    /* slot_count is a power of two */
+    return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (slot_count - 1);
+}
+
+static uint64_t mtime_ns(const struct stat* st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+static int builder_add(struct ListBuilder* b, uint64_t key,
+                       const struct Token* name) {
+    void* tmp;
+    size_t cap;
+
+    if (b->entry_count == b->entry_cap) {
+        cap = b->entry_cap ? b->entry_cap * 2 : 4096;
+        if ((tmp = realloc(b->entries, cap * sizeof(*b->entries))) == NULL) {
+            return -ENOMEM;
+        }
+        b->entries = tmp;
+        b->entry_cap = cap;
+    }
+
+    if (b->names_len + name->len + 1 > b->names_cap) {
+        cap = b->names_cap ? b->names_cap * 2 : 65536;
+        while (cap < b->names_len + name->len + 1) {
+            cap *= 2;
+        }
+        if ((tmp = realloc(b->names, cap)) == NULL) {
+            return -ENOMEM;
+        }
+        b->names = tmp;
+        b->names_cap = cap;
+    }
+
+    b->entries[b->entry_count].key = key;
+    b->entries[b->entry_count].name_offset = b->names_len;
+    b->entry_count++;
+    memcpy(b->names + b->names_len, name->start, name->len);
+    b->names[b->names_len + name->len] = '\0';
+    b->names_len += name->len + 1;
+    return 0;
+}
+
+static int parse_list(const char* list_path, struct ListBuilder* b) {
+    struct Tokenizer t;
+    struct Token serial;
+    struct Token name;
+    uint64_t key;
+    int rv;
+
+    if ((rv = tokenizer_open(&t, list_path)) < 0) {
+        LOG_WARN("Could not open id list '%s': %s", list_path,
+                 strerror(-rv));
+        return rv;
+    }
+
+    rv = 0;
+    while (get_token(&t, &serial) > 0) {
+        if (get_token(&t, &name) <= 0) {
+            rv = -EINVAL;
+            break;
+        }
+
+        if (cddb_serial_key(serial.start, serial.len, &key) < 0) {
+            LOG_DEBUG("Skipping malformed id '%.*s'", (int)serial.len,
+                      serial.start);
+            continue;
+        }
+
+        if ((rv = builder_add(b, key, &name)) < 0) {
+            break;
+        }
+    }
+
+    tokenizer_close(&t);
+    return rv;
+}
+
+/* Lays out the header, slots and names in one buffer, ready to be saved */
+static int build_table(const char* list_path, const struct stat* list_st,
+                       void** table, size_t* table_len) {
+    struct ListBuilder b;
+    struct CDDBHeader* header;
+    struct CDDBSlot* slots;
+    uint32_t slot_count = 16;
+    uint32_t slot;
+    size_t len;
+    size_t i;
+    int rv;
+
+    memset(&b, 0, sizeof(b));
+    if ((rv = parse_list(list_path, &b)) < 0) {
+        goto clean;
+    }
+
+    /* Keep the table at most three quarters full so probes stay short */
+    while (slot_count / 4 * 3 < b.entry_count) {
+        slot_count *= 2;
+    }
+
+    len = sizeof(*header) + slot_count * sizeof(*slots) + b.names_len;
+    if ((header = calloc(1, len)) == NULL) {
+        rv = -ENOMEM;
+        goto clean;
+    }
+
+    slots = (struct CDDBSlot*)(header + 1);
+    memcpy(header->magic, CDDB_MAGIC, sizeof(header->magic));
+    header->version = CDDB_VERSION;
+    header->source_size = list_st->st_size;
+    header->source_mtime_ns = mtime_ns(list_st);
+    header->slot_count = slot_count;
+    header->names_offset = sizeof(*header) + slot_count * sizeof(*slots);
+    header->names_len = b.names_len;
+    memcpy((char*)header + header->names_offset, b.names, b.names_len);
+
+    for (i = 0; i < b.entry_count; i++) {
+        slot = key_slot(b.entries[i].key, slot_count);
+        while (slots[slot].key != 0 && slots[slot].key != b.entries[i].key) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+
+        /* Like the linear search this replaces, the first listing wins */
+        if (slots[slot].key == 0) {
+            slots[slot].key = b.entries[i].key;
+            slots[slot].name_offset = b.entries[i].name_offset;
+            header->entry_count++;
+        }
+    }
+
+    *table = header;
+    *table_len = len;
+    rv = 0;
+clean:
+    free(b.entries);
+    free(b.names);
+    return rv;
+}
+
+static int save_table(const char* index_path, const void* table, size_t len) {
+    char tmp_path[PATH_MAX];
+    const char* c = table;
+    ssize_t written;
+    int fd;
+    int rv = 0;
+
+    snprintf(tmp_path, PATH_MAX, "%s.%d", index_path, (int)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    while (len > 0) {
+        written = write(fd, c, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rv = -errno;
+            break;
+        }
+        c += written;
+        len -= written;
+    }
+
+    close(fd);
+    if (rv == 0 && rename(tmp_path, index_path) < 0) {
+        rv = -errno;
+    }
+
+    if (rv < 0) {
+        unlink(tmp_path);
+    }
+    return rv;
+}
+
+int cddb_build(const char* list_path, const char* index_path) {
+    struct stat st;
+    void* table;
+    size_t len;
+    int rv;
+
+    if (stat(list_path, &st) < 0) {
+        return -errno;
+    }
+
+    if ((rv = build_table(list_path, &st, &table, &len)) < 0) {
+        return rv;
+    }
+
+    if ((rv = save_table(index_path, table, len)) < 0) {
+        LOG_WARN("Could not save '%s': %s", index_path, strerror(-rv));
+    } else {
+        LOG_INFO("Indexed %u ids from '%s'",
+                 ((struct CDDBHeader*)table)->entry_count, list_path);
+    }
+
+    free(table);
+    return rv;
+}
+
+/* Embedded tables have no list to compare with, `list_st` is NULL */
+static int table_is_valid(const void* table, size_t len,
+                          const struct stat* list_st) {
+    const struct CDDBHeader* header = table;
+    uint32_t slot_count;
+
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, CDDB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CDDB_VERSION) {
+        return 0;
+    }
+
+    if (list_st != NULL &&
+        (header->source_size != (uint64_t)list_st->st_size ||
+         header->source_mtime_ns != mtime_ns(list_st))) {
+        return 0;
+    }
+
+    /* Probes end on a free slot, so there has to be one. The names run to
+     * the end of the file and the last one is terminated. */
+    slot_count = header->slot_count;
+    return slot_count != 0 && (slot_count & (slot_count - 1)) == 0 &&
+           header->entry_count < slot_count &&
+           header->names_offset ==
+               sizeof(*header) + (size_t)slot_count * sizeof(struct CDDBSlot) &&
+           header->names_offset + (size_t)header->names_len == len &&
+           (header->names_len == 0 ||
+            ((const char*)table)[len - 1] == '\0');
+}
+
+static void use_table(struct CDDB* db, void* table, size_t len, int storage) {
+    db->map = table;
+    db->map_len = len;
+    db->storage = storage;
+    db->header = table;
+    db->slots = (const struct CDDBSlot*)(db->header + 1);
+    db->names = (const char*)table + db->header->names_offset;
+}
+
+/*
+ * Maps the generated table next to the id list, regenerating it when the
+ * list has changed. If it can't be saved the table is only kept in memory.
+ */
+int cddb_open(struct CDDB* db, const char* list_path, const char* index_path) {
+    struct stat list_st;
+    struct stat st;
+    void* table;
+    size_t len;
+    int fd;
+    int rv;
+
+    memset(db, 0, sizeof(*db));
+    if (stat(list_path, &list_st) < 0) {
+        return -errno;
+    }
+
+    fd = open(index_path, O_RDONLY);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            table = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (table != MAP_FAILED) {
+                if (table_is_valid(table, st.st_size, &list_st)) {
+                    close(fd);
+                    use_table(db, table, st.st_size, CDDB_MAPPED);
+                    return 0;
+                }
+                munmap(table, st.st_size);
+            }
+        }
+        close(fd);
+    }
+
+    LOG_DEBUG("Generating '%s' from '%s'", index_path, list_path);
+    if ((rv = build_table(list_path, &list_st, &table, &len)) < 0) {
+        return rv;
+    }
+
+    if ((rv = save_table(index_path, table, len)) < 0) {
+        LOG_DEBUG("Could not save '%s': %s", index_path, strerror(-rv));
+    }
+
+    use_table(db, table, len, CDDB_HEAP);
+    return 0;
+}
+
+/* A table built into the executable */
+int cddb_open_static(struct CDDB* db, const void* table, size_t len) {
+    memset(db, 0, sizeof(*db));
+    if (!table_is_valid(table, len, NULL)) {
+        return -EINVAL;
+    }
+
+    use_table(db, (void*)table, len, CDDB_STATIC);
+    return 0;
+}
+
+void cddb_close(struct CDDB* db) {
+    if (db->storage == CDDB_MAPPED) {
+        munmap(db->map, db->map_len);
+    } else if (db->storage == CDDB_HEAP) {
+        free(db->map);
+    }
+
+    memset(db, 0, sizeof(*db));
+}
+
+/* Gives up after one lap, in case a damaged table has no free slot */
+static const char* probe(const struct CDDB* db, uint64_t key, uint32_t slot) {
+    uint32_t mask = db->header->slot_count - 1;
+    uint32_t steps;
+
+    for (steps = 0; steps < db->header->slot_count &&
+                    db->slots[slot].key != 0; steps++) {
+        if (db->slots[slot].key == key) {
+            return db->slots[slot].name_offset < db->header->names_len ?
+                   db->names + db->slots[slot].name_offset : NULL;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    return NULL;
+}
+
+const char* cddb_find(const struct CDDB* db, uint64_t key) {
+    if (db->map == NULL || key == 0) {
+        return NULL;
+    }
+
+    return probe(db, key, key_slot(key, db->header->slot_count));
+}
+
+/*
+ * Looks up every key at once, touching all the home slots first so the
+ * cache misses overlap. Returns how many were found, names[i] is NULL for
+ * the rest.
+ */
+size_t cddb_find_batch(const struct CDDB* db, const uint64_t* keys,
+                       size_t count, const char** names) {
+    uint32_t slots[16];
+    size_t found = 0;
+    size_t base;
+    size_t n;
+    size_t i;
+
+    if (db->map == NULL) {
+        memset(names, 0, count * sizeof(*names));
+        return 0;
+    }
+
+    for (base = 0; base < count; base += n) {
+        n = count - base < 16 ? count - base : 16;
+        for (i = 0; i < n; i++) {
+            slots[i] = key_slot(keys[base + i], db->header->slot_count);
+            __builtin_prefetch(&db->slots[slots[i]]);
+        }
+
+        for (i = 0; i < n; i++) {
+            names[base + i] = keys[base + i] == 0 ? NULL :
+                              probe(db, keys[base + i], slots[i]);
+            found += names[base + i] != NULL;
+        }
+    }
+
+    return found;
+}
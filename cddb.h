@@ -0,0 +1,52 @@
+#ifndef _CDDB_H_
+#define _CDDB_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define CDDB_PS1_LIST "cddb/ps1.idlst"
+#define CDDB_PS1_INDEX "cddb/ps1.idx"
+
+struct CDDBHeader {
+    char magic[4];
+    uint32_t version;
+    /* The id list the table was generated from */
+    uint64_t source_size;
+    uint64_t source_mtime_ns;
+    uint32_t slot_count;
+    uint32_t entry_count;
+    uint32_t names_offset;
+    uint32_t names_len;
+};
+
+/* Open addressed table of packed serials, a zero key marks a free slot */
+struct CDDBSlot {
+    uint64_t key;
+    uint32_t name_offset;
+    uint32_t reserved;
+};
+
+/* Where a CDDB table lives, which decides how it is released */
+#define CDDB_HEAP 0
+#define CDDB_MAPPED 1
+#define CDDB_STATIC 2
+
+struct CDDB {
+    void* map;
+    size_t map_len;
+    int storage;
+    const struct CDDBHeader* header;
+    const struct CDDBSlot* slots;
+    const char* names;
+};
+
+int cddb_serial_key(const char* serial, size_t len, uint64_t* key);
+int cddb_build(const char* list_path, const char* index_path);
+int cddb_open(struct CDDB* db, const char* list_path, const char* index_path);
+int cddb_open_static(struct CDDB* db, const void* table, size_t len);
+void cddb_close(struct CDDB* db);
+const char* cddb_find(const struct CDDB* db, uint64_t key);
+size_t cddb_find_batch(const struct CDDB* db, const uint64_t* keys,
+                       size_t count, const char** names);
+
+#endif
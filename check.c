@@ -0,0 +1,928 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <ftw.h>
+#include <glob.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "sha1.h"
+#include "crc32.h"
+#include "parser.h"
+#include "cddb.h"
+#include "cd_detect.h"
+#include "db_index.h"
+#include "detect.h"
+#include "run_info.h"
+
+#include "log.h"
+
+/*
+ * Checks the compiled tables against the simple code they replaced, run
+ * from the top of the tree against the real db/, cddb/ and launch.conf.
+ * Prints every failure and exits non-zero when there was one.
+ */
+
+#define CHECK_MAX_NAME 512
+#define CHECK_MAX_ID 16
+#define CHECK_MAX_ANSWERS 2048
+
+static int checks;
+static int failures;
+static char scratch[64];
+
+#define CHECK(cond, msg, ...) \
+    do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            fprintf(stderr, "FAIL %s+%d: " msg "\n", __FILE__, __LINE__, \
+                    ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/* launch.conf rules, first match in file order, the way they used to be */
+
+static int linear_run_info(const char* conf_path, struct RunInfo* info,
+                           const char* game_name) {
+    char pattern[MAX_TOKEN_LEN + 1];
+    struct Tokenizer t;
+    struct Token token;
+    int rv;
+
+    memset(info, 0, sizeof(*info));
+    if ((rv = tokenizer_open(&t, conf_path)) < 0) {
+        return rv;
+    }
+
+    rv = -ENOENT;
+    while (get_token(&t, &token) > 0) {
+        token_copy(&token, pattern, sizeof(pattern));
+        if (fnmatch(pattern, game_name, 0) != 0) {
+            if (find_token(&t, ";") < 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (get_token(&t, &token) <= 0) {
+            rv = -EINVAL;
+            break;
+        }
+
+        token_copy(&token, info->core, sizeof(info->core));
+        rv = 0;
+        while (get_token(&t, &token) > 0 && !token_equals(&token, ";")) {
+            if (token_equals(&token, "multitap")) {
+                info->multitap = 1;
+            } else if (token_equals(&token, "dualanalog")) {
+                info->dualanalog = 1;
+            }
+        }
+        break;
+    }
+
+    tokenizer_close(&t);
+    return rv;
+}
+
+static void check_run_info(const struct LaunchRules* rules,
+                           const char* game_name) {
+    struct RunInfo expected;
+    struct RunInfo info;
+    int expected_rv;
+    int rv;
+
+    expected_rv = linear_run_info(LAUNCH_CONF_PATH, &expected, game_name);
+    rv = get_run_info(rules, &info, game_name);
+    CHECK((rv < 0) == (expected_rv < 0) &&
+          (rv < 0 || (strcmp(info.core, expected.core) == 0 &&
+                      info.multitap == expected.multitap &&
+                      info.dualanalog == expected.dualanalog)),
+          "'%s' gets %s instead of %s", game_name,
+          rv < 0 ? "no rule" : info.core,
+          expected_rv < 0 ? "no rule" : expected.core);
+}
+
+/* Names around every pattern: what its wildcards stand for, and misses */
+static void check_rule_names(const struct LaunchRules* rules) {
+    static const char* FILLERS[] = {"", " (USA)", "x", "*", NULL};
+    char name[CHECK_MAX_NAME];
+    char pattern[MAX_TOKEN_LEN + 1];
+    struct Tokenizer t;
+    struct Token token;
+    const char** filler;
+    size_t len;
+    size_t i;
+
+    if (tokenizer_open(&t, LAUNCH_CONF_PATH) < 0) {
+        CHECK(0, "could not open '%s'", LAUNCH_CONF_PATH);
+        return;
+    }
+
+    while (get_token(&t, &token) > 0) {
+        token_copy(&token, pattern, sizeof(pattern));
+        for (filler = FILLERS; *filler != NULL; filler++) {
+            for (i = 0, len = 0; pattern[i] != '\0' &&
+                                 len + strlen(*filler) + 1 < sizeof(name);
+                 i++) {
+                if (pattern[i] == '*' || pattern[i] == '?') {
+                    len += sprintf(name + len, "%s", *filler);
+                } else if (pattern[i] != '\\') {
+                    name[len++] = pattern[i];
+                }
+            }
+            name[len] = '\0';
+            check_run_info(rules, name);
+
+            /* One character short of the literal part */
+            if (len > 1) {
+                name[len - 1] = '\0';
+                check_run_info(rules, name);
+            }
+        }
+
+        if (find_token(&t, ";") < 0) {
+            break;
+        }
+    }
+
+    tokenizer_close(&t);
+}
+
+static void check_run_infos(const struct DetectContext* ctx) {
+    const struct DBIndex* idx = &ctx->index;
+    size_t offset = 0;
+
+    check_rule_names(&ctx->rules);
+    check_run_info(&ctx->rules, "ps1.<unknown>");
+    check_run_info(&ctx->rules, "unknown.<unknown>");
+    check_run_info(&ctx->rules, "");
+
+    /* Every game the index knows */
+    if (ctx->has_index) {
+        while (offset < idx->header->names_len) {
+            check_run_info(&ctx->rules, idx->names + offset);
+            offset += strlen(idx->names + offset) + 1;
+        }
+    }
+}
+
+/* PS1 ids, compared as text in list order the way they used to be */
+
+struct SerialEntry {
+    /* Prefix letters and digits, "SLUS:01272" */
+    char id[CHECK_MAX_ID];
+    char name[MAX_TOKEN_LEN + 1];
+};
+
+struct SerialList {
+    struct SerialEntry* entries;
+    size_t count;
+    size_t cap;
+};
+
+static int serial_id(const char* serial, char* id) {
+    size_t len = 0;
+    int digits = 0;
+
+    while (len < 4 && isalpha((unsigned char)*serial)) {
+        id[len++] = toupper((unsigned char)*serial++);
+    }
+    id[len++] = ':';
+
+    if (*serial == '-' || *serial == '_') {
+        serial++;
+    }
+
+    for (; *serial != '\0'; serial++) {
+        if (*serial == '.') {
+            continue;
+        }
+        if (!isdigit((unsigned char)*serial) || ++digits > 7) {
+            return -EINVAL;
+        }
+        id[len++] = *serial;
+    }
+
+    id[len] = '\0';
+    return digits > 0 ? 0 : -EINVAL;
+}
+
+/* "SLUS-01272", or "SLUS_012.72" the way the boot path spells it */
+static void format_serial(char* serial, const char* id, int boot) {
+    const char* digits = strchr(id, ':') + 1;
+    int prefix_len = (int)(digits - 1 - id);
+    int split = (int)strlen(digits) - 2;
+
+    if (boot && split > 0) {
+        sprintf(serial, "%.*s_%.*s.%s", prefix_len, id, split, digits,
+                digits + split);
+    } else {
+        sprintf(serial, "%.*s-%s", prefix_len, id, digits);
+    }
+}
+
+static int serial_list_add(struct SerialList* list, const char* id,
+                           const char* name) {
+    void* tmp;
+    size_t cap;
+
+    if (list->count == list->cap) {
+        cap = list->cap ? list->cap * 2 : 1024;
+        if ((tmp = realloc(list->entries, cap * sizeof(*list->entries))) ==
+            NULL) {
+            return -ENOMEM;
+        }
+        list->entries = tmp;
+        list->cap = cap;
+    }
+
+    strcpy(list->entries[list->count].id, id);
+    snprintf(list->entries[list->count].name, MAX_TOKEN_LEN + 1, "%s", name);
+    list->count++;
+    return 0;
+}
+
+static int serial_list_read(struct SerialList* list, const char* list_path) {
+    char serial[MAX_TOKEN_LEN + 1];
+    char name[MAX_TOKEN_LEN + 1];
+    char id[MAX_TOKEN_LEN + 2];
+    struct Tokenizer t;
+    struct Token token;
+    int rv;
+
+    if ((rv = tokenizer_open(&t, list_path)) < 0) {
+        return rv;
+    }
+
+    while (get_token(&t, &token) > 0) {
+        token_copy(&token, serial, sizeof(serial));
+        if (get_token(&t, &token) <= 0) {
+            rv = -EINVAL;
+            break;
+        }
+
+        token_copy(&token, name, sizeof(name));
+        if (serial_id(serial, id) == 0 &&
+            (rv = serial_list_add(list, id, name)) < 0) {
+            break;
+        }
+    }
+
+    tokenizer_close(&t);
+    return rv;
+}
+
+static const char* linear_find(const struct SerialList* list, const char* id) {
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        if (strcmp(list->entries[i].id, id) == 0) {
+            return list->entries[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+static void check_serial(const struct CDDB* db, const struct SerialList* list,
+                         const char* serial) {
+    char id[MAX_TOKEN_LEN + 2];
+    const char* expected = NULL;
+    const char* name = NULL;
+    uint64_t key;
+    int valid;
+
+    valid = serial_id(serial, id) == 0;
+    if (valid) {
+        expected = linear_find(list, id);
+    }
+
+    CHECK((cddb_serial_key(serial, strlen(serial), &key) == 0) == valid,
+          "'%s' is %s", serial, valid ? "rejected" : "accepted");
+    if (valid) {
+        name = cddb_find(db, key);
+    }
+
+    CHECK(name == expected ||
+          (name != NULL && expected != NULL && strcmp(name, expected) == 0),
+          "'%s' finds '%s' instead of '%s'", serial, name ? name : "nothing",
+          expected ? expected : "nothing");
+}
+
+/* Every listed id, spelled both ways, and its neighbours that aren't */
+static void check_serial_list(const struct CDDB* db,
+                              const struct SerialList* list) {
+    char serial[CHECK_MAX_ID + 2];
+    char id[CHECK_MAX_ID + 1];
+    const char** names;
+    uint64_t* keys;
+    size_t found = 0;
+    size_t len;
+    size_t i;
+
+    for (i = 0; i < list->count; i++) {
+        format_serial(serial, list->entries[i].id, 0);
+        check_serial(db, list, serial);
+        format_serial(serial, list->entries[i].id, 1);
+        check_serial(db, list, serial);
+
+        /* One digit more or less, and one prefix letter less */
+        strcpy(id, list->entries[i].id);
+        len = strlen(id);
+        if (len < CHECK_MAX_ID - 1) {
+            id[len] = '0';
+            id[len + 1] = '\0';
+            format_serial(serial, id, 0);
+            check_serial(db, list, serial);
+        }
+        id[len - 1] = '\0';
+        format_serial(serial, id, 0);
+        check_serial(db, list, serial);
+        if (id[0] != ':') {
+            format_serial(serial, id + 1, 0);
+            check_serial(db, list, serial);
+        }
+    }
+
+    /* The batch lookup agrees with the single one */
+    keys = malloc(list->count * sizeof(*keys));
+    names = malloc(list->count * sizeof(*names));
+    if (keys == NULL || names == NULL) {
+        CHECK(0, "out of memory");
+        goto clean;
+    }
+
+    for (i = 0; i < list->count; i++) {
+        format_serial(serial, list->entries[i].id, 0);
+        cddb_serial_key(serial, strlen(serial), &keys[i]);
+        found += cddb_find(db, keys[i]) != NULL;
+    }
+
+    CHECK(cddb_find_batch(db, keys, list->count, names) == found,
+          "the batch lookup finds a different number of ids");
+    for (i = 0; i < list->count; i++) {
+        CHECK(names[i] == cddb_find(db, keys[i]),
+              "the batch lookup disagrees on '%s'", list->entries[i].id);
+    }
+
+clean:
+    free(keys);
+    free(names);
+}
+
+/*
+ * A list crowded enough to probe: every prefix length, every digit count,
+ * ids that only differ in leading zeros, and repeats that must lose.
+ */
+static int write_serial_list(const char* list_path) {
+    static const char* PREFIXES[] = {"", "S", "SL", "SLU", "SLUS", "SCES",
+                                     "SLPM", "PAPX", "slus", NULL};
+    const char** prefix;
+    uint32_t modulus;
+    uint32_t j;
+    FILE* f;
+    int digits;
+
+    if ((f = fopen(list_path, "w")) == NULL) {
+        return -errno;
+    }
+
+    for (prefix = PREFIXES; *prefix != NULL; prefix++) {
+        for (digits = 1, modulus = 10; digits <= 7; digits++, modulus *= 10) {
+            for (j = 0; j < 40; j++) {
+                fprintf(f, "%s-%0*u \"Game %s %d %u\"\n", *prefix, digits,
+                        (j * 7919 + digits * 31) % modulus, *prefix, digits,
+                        j);
+            }
+        }
+    }
+
+    /* Malformed ids are skipped */
+    fprintf(f, "SLUS-12345678 \"Too Long\"\nSLUS- \"No Number\"\n"
+               "SLUSX-123 \"Long Prefix\"\nSLUS-12a \"Letter\"\n");
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+static void check_cddb(const struct DetectContext* ctx) {
+    static const char* ODD_SERIALS[] = {"", "-", "SLUS", "SLUS-", "SLUS_.",
+                                        "SLUS-12345678", "SLUSX-123",
+                                        "slus_012.72", "SLUS-9999999",
+                                        "SLUS--1", "1", NULL};
+    char list_path[PATH_MAX];
+    char index_path[PATH_MAX];
+    struct SerialList list;
+    struct CDDB db;
+    const char** serial;
+    int rv;
+
+    memset(&list, 0, sizeof(list));
+    snprintf(list_path, PATH_MAX, "%s/ids.idlst", scratch);
+    snprintf(index_path, PATH_MAX, "%s/ids.idx", scratch);
+    if ((rv = write_serial_list(list_path)) < 0 ||
+        (rv = serial_list_read(&list, list_path)) < 0 ||
+        (rv = cddb_open(&db, list_path, index_path)) < 0) {
+        CHECK(0, "could not build '%s': %s", index_path, strerror(-rv));
+        goto clean;
+    }
+
+    check_serial_list(&db, &list);
+    for (serial = ODD_SERIALS; *serial != NULL; serial++) {
+        check_serial(&db, &list, *serial);
+    }
+    cddb_close(&db);
+
+    /* The shipped list, through the table detection uses */
+    free(list.entries);
+    memset(&list, 0, sizeof(list));
+    if ((rv = serial_list_read(&list, CDDB_PS1_LIST)) < 0) {
+        CHECK(0, "could not read '%s': %s", CDDB_PS1_LIST, strerror(-rv));
+        goto clean;
+    }
+
+    check_serial_list(&ctx->ps1_ids, &list);
+clean:
+    unlink(list_path);
+    unlink(index_path);
+    free(list.entries);
+}
+
+/* An index brought up to date answers like one built from scratch */
+
+static int copy_file(const char* src, const char* dest) {
+    char buf[65536];
+    FILE* in;
+    FILE* out;
+    size_t len;
+    int rv = 0;
+
+    if ((in = fopen(src, "rb")) == NULL) {
+        return -errno;
+    }
+
+    if ((out = fopen(dest, "wb")) == NULL) {
+        rv = -errno;
+        fclose(in);
+        return rv;
+    }
+
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, len, out) != len) {
+            rv = -EIO;
+            break;
+        }
+    }
+
+    fclose(in);
+    if (fclose(out) != 0 && rv == 0) {
+        rv = -errno;
+    }
+    return rv;
+}
+
+/* Links every shipped DAT into db/ of the working directory */
+static int link_dats(const char* top) {
+    char pattern[PATH_MAX];
+    char link_path[PATH_MAX];
+    glob_t glb;
+    size_t i;
+    int rv = 0;
+
+    if (snprintf(pattern, PATH_MAX, "%s/db/*.dat", top) >= PATH_MAX ||
+        glob(pattern, 0, NULL, &glb) != 0) {
+        return -ENOENT;
+    }
+
+    for (i = 0; i < glb.gl_pathc && rv == 0; i++) {
+        snprintf(link_path, PATH_MAX, "db/%s", basename(glb.gl_pathv[i]));
+        if (symlink(glb.gl_pathv[i], link_path) < 0) {
+            rv = -errno;
+        }
+    }
+
+    globfree(&glb);
+    return rv;
+}
+
+/* Disc DATs filed under a system the cartridge DATs also have */
+static int write_disc_dat(const char* path, int games) {
+    FILE* f;
+    int i;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        return -errno;
+    }
+
+    fprintf(f, "clrmamepro (\n\tname \"Check\"\n)\n\n");
+    for (i = 0; i < games; i++) {
+        fprintf(f, "game (\n\tname \"Disc %d\"\n"
+                   "\trom ( name \"Disc %d.bin\" size %d crc %08X "
+                   "sha1 %040X )\n"
+                   "\trom ( name \"Shared.bin\" size 2352 crc 0BADF00D "
+                   "sha1 %040X )\n)\n\n",
+                i, i, 1000 + i, 0x1000 + i, 0x2000 + i, 0xF00D);
+    }
+
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+/* Every answer the index gives about one rom, as text to compare */
+static void index_answers(const struct DBIndex* idx, const char* system,
+                          const struct DBIndexRom* rom,
+                          const unsigned char* sha1, char* answers) {
+    char name[CHECK_MAX_NAME];
+    uint32_t games[4];
+    size_t len;
+    int count;
+    int rv;
+    int i;
+
+    name[0] = '\0';
+    rv = db_index_find_sha1(idx, sha1, name, sizeof(name));
+    len = snprintf(answers, CHECK_MAX_ANSWERS, "sha1 %d '%s'", rv, name);
+
+    name[0] = '\0';
+    rv = db_index_find_crc(idx, system, rom->size, rom->crc, name,
+                           sizeof(name));
+    len += snprintf(answers + len, CHECK_MAX_ANSWERS - len, ", crc %d '%s'",
+                    rv, name);
+
+    name[0] = '\0';
+    rv = db_index_find_size(idx, system, rom->size, name, sizeof(name));
+    len += snprintf(answers + len, CHECK_MAX_ANSWERS - len, ", size %d '%s'",
+                    rv, name);
+
+    count = db_index_find_games(idx, system, rom->size, rom->crc, sha1, games,
+                                4);
+    len += snprintf(answers + len, CHECK_MAX_ANSWERS - len, ", games %d",
+                    count);
+    for (i = 0; i < count && i < 4 && len < CHECK_MAX_ANSWERS; i++) {
+        db_index_game_name(idx, games[i], name, sizeof(name));
+        len += snprintf(answers + len, CHECK_MAX_ANSWERS - len, " '%s'",
+                        name);
+    }
+}
+
+static void check_rom_answers(const struct DBIndex* a, const struct DBIndex* b,
+                              const char* system, struct DBIndexRom rom,
+                              const unsigned char* sha1) {
+    char answers_a[CHECK_MAX_ANSWERS];
+    char answers_b[CHECK_MAX_ANSWERS];
+    int miss;
+
+    /* The rom itself, then a size and a crc that are not quite it */
+    for (miss = 0; miss < 3; miss++) {
+        rom.size += miss == 1;
+        rom.crc ^= miss == 2;
+        index_answers(a, system, &rom, sha1, answers_a);
+        index_answers(b, system, &rom, sha1, answers_b);
+        CHECK(strcmp(answers_a, answers_b) == 0,
+              "%s %llu %08X: %s, then %s", system ? system : "any",
+              (unsigned long long)rom.size, rom.crc, answers_a, answers_b);
+    }
+}
+
+/* Walks the roms of `walk`, one system block at a time */
+static void check_same_answers(const struct DBIndex* walk,
+                               const struct DBIndex* a,
+                               const struct DBIndex* b) {
+    const struct DBIndexSource* source;
+    const struct DBIndexRom* rom;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < walk->header->dat_count; i++) {
+        source = &walk->sources[i];
+        for (j = 0; j < source->rom_count; j++) {
+            rom = &walk->system_roms[source->rom_first + j];
+            check_rom_answers(a, b, source->system, *rom,
+                              walk->entries[rom->entry].sha1);
+            check_rom_answers(a, b, NULL, *rom,
+                              walk->entries[rom->entry].sha1);
+        }
+    }
+
+    check_rom_answers(a, b, "none", walk->roms[0], walk->entries[0].sha1);
+}
+
+static void check_indexes(const char* label, const char* built_path,
+                          const char* updated_path) {
+    struct DBIndex built;
+    struct DBIndex updated;
+    int rv;
+
+    if ((rv = db_index_open(&built, built_path, 0)) < 0) {
+        CHECK(0, "%s: could not open '%s': %s", label, built_path,
+              strerror(-rv));
+        return;
+    }
+
+    if ((rv = db_index_open(&updated, updated_path, 0)) < 0) {
+        CHECK(0, "%s: could not open '%s': %s", label, updated_path,
+              strerror(-rv));
+        db_index_close(&built);
+        return;
+    }
+
+    CHECK(built.header->entry_count == updated.header->entry_count &&
+          built.header->dat_count == updated.header->dat_count &&
+          built.header->names_len == updated.header->names_len,
+          "%s: %u roms from %u DATs, then %u from %u", label,
+          built.header->entry_count, built.header->dat_count,
+          updated.header->entry_count, updated.header->dat_count);
+    if (built.header->entry_count > 0 && updated.header->entry_count > 0) {
+        check_same_answers(&built, &built, &updated);
+        check_same_answers(&updated, &built, &updated);
+    }
+
+    db_index_close(&updated);
+    db_index_close(&built);
+}
+
+/* The cached result of a file outlives launches, not DAT changes */
+static void check_cache(int stored) {
+    struct DetectCacheKey key;
+    struct DetectCache cache;
+    struct RunInfo info;
+    char name[DETECT_CACHE_NAME_LEN];
+    int rv;
+
+    memset(&info, 0, sizeof(info));
+    if ((rv = detect_cache_open(&cache, "detect.cache")) < 0 ||
+        (rv = detect_cache_key("db/gb.dat", 0, &key)) < 0) {
+        CHECK(0, "could not open the cache: %s", strerror(-rv));
+        return;
+    }
+
+    if (stored) {
+        rv = detect_cache_lookup(&cache, &key, name, sizeof(name), &info);
+        CHECK(rv == 0 && strcmp(name, "gb.Check") == 0 &&
+              strcmp(info.core, "check") == 0,
+              "the cached result is %s",
+              rv == 0 ? name : strerror(-rv));
+    } else {
+        CHECK(detect_cache_lookup(&cache, &key, name, sizeof(name),
+                                  &info) < 0,
+              "a result outlived the DATs it came from");
+        snprintf(info.core, sizeof(info.core), "check");
+        CHECK(detect_cache_store(&cache, &key, "gb.Check", &info) == 0,
+              "could not store a result");
+    }
+
+    detect_cache_close(&cache);
+}
+
+static void check_index_updates(void) {
+    char top[PATH_MAX];
+    char dir[PATH_MAX];
+    char dat[PATH_MAX];
+    int rv = 0;
+
+    if (getcwd(top, sizeof(top)) == NULL) {
+        CHECK(0, "could not get the working directory");
+        return;
+    }
+
+    snprintf(dir, PATH_MAX, "%s/index", scratch);
+    if (mkdir(dir, 0755) < 0 || chdir(dir) < 0 ||
+        mkdir("db", 0755) < 0 || mkdir("cddb", 0755) < 0 ||
+        (rv = link_dats(top)) < 0 ||
+        (rv = write_disc_dat("cddb/gb.dat", 3)) < 0) {
+        CHECK(0, "could not set up '%s': %s", dir, strerror(rv ? -rv : errno));
+        goto clean;
+    }
+
+    CHECK(db_index_build("built.bin") == 0, "could not build the index");
+    CHECK(db_index_update("updated.bin") == 0, "could not update the index");
+    check_indexes("unchanged", "built.bin", "updated.bin");
+    check_cache(0);
+    check_cache(1);
+
+    /* One DAT rewritten as is, one grown, one gone */
+    unlink("db/gbc.dat");
+    CHECK(snprintf(dat, PATH_MAX, "%s/db/gbc.dat", top) < PATH_MAX &&
+          copy_file(dat, "db/gbc.dat") == 0, "could not copy '%s'", dat);
+    CHECK(write_disc_dat("cddb/gb.dat", 4) == 0, "could not grow a DAT");
+    unlink("db/nes.dat");
+    check_cache(0);
+
+    CHECK(db_index_update("updated.bin") == 0, "could not update the index");
+    CHECK(db_index_build("built.bin") == 0, "could not build the index");
+    check_indexes("changed", "built.bin", "updated.bin");
+
+clean:
+    if (chdir(top) < 0) {
+        CHECK(0, "could not go back to '%s'", top);
+    }
+}
+
+/* Multi-track discs, named after the one game all their tracks are in */
+
+struct CheckTrack {
+    const char* path;
+    size_t size;
+    unsigned char fill;
+    uint32_t crc;
+    unsigned char sha1[DB_SHA1_SIZE];
+};
+
+/* Data tracks start with a Saturn system area, the rest is the fill */
+static int write_track(struct CheckTrack* track, int data) {
+    static const char SYSTEM_AREA[] = "SEGA SEGASATURN ";
+    unsigned char buf[2352];
+    SHA1Context sha;
+    FILE* f;
+    size_t left;
+    size_t len;
+    size_t i;
+
+    if ((f = fopen(track->path, "wb")) == NULL) {
+        return -errno;
+    }
+
+    SHA1Reset(&sha);
+    track->crc = 0;
+    for (left = track->size; left > 0; left -= len) {
+        len = left < sizeof(buf) ? left : sizeof(buf);
+        for (i = 0; i < len; i++) {
+            buf[i] = track->fill + i * 7;
+        }
+        if (data && left == track->size) {
+            memcpy(buf, SYSTEM_AREA, sizeof(SYSTEM_AREA) - 1);
+        }
+
+        track->crc = crc32_update(track->crc, buf, len);
+        SHA1Input(&sha, buf, len);
+        fwrite(buf, 1, len, f);
+    }
+
+    SHA1ResultBinary(&sha, track->sha1);
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+static void write_dat_rom(FILE* f, const struct CheckTrack* track,
+                          int wrong_sha1) {
+    unsigned char sha1[DB_SHA1_SIZE];
+    char hex[DB_SHA1_SIZE * 2 + 1];
+
+    memcpy(sha1, track->sha1, sizeof(sha1));
+    sha1[0] ^= wrong_sha1;
+    db_format_hex(sha1, sizeof(sha1), hex);
+    fprintf(f, "\trom ( name \"%s\" size %zu crc %08X sha1 %s )\n",
+            track->path, track->size, track->crc, hex);
+}
+
+static int write_cue(const char* path, const struct CheckTrack* data,
+                     const struct CheckTrack* audio) {
+    FILE* f;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        return -errno;
+    }
+
+    fprintf(f, "FILE \"%s\" BINARY\n  TRACK 01 MODE1/2048\n"
+               "    INDEX 01 00:00:00\n", data->path);
+    if (audio != NULL) {
+        fprintf(f, "FILE \"%s\" BINARY\n  TRACK 02 AUDIO\n"
+                   "    INDEX 01 00:00:00\n", audio->path);
+    }
+
+    return fclose(f) == 0 ? 0 : -errno;
+}
+
+static void check_disc(const struct DBIndex* idx, const char* cue_path,
+                       const char* expected) {
+    char name[CHECK_MAX_NAME];
+    int rv;
+
+    rv = detect_cd_game(NULL, idx, cue_path, name, sizeof(name));
+    CHECK(rv == 0 && strcmp(name, expected) == 0,
+          "'%s' is %s instead of '%s'", cue_path,
+          rv == 0 ? name : strerror(-rv), expected);
+}
+
+static void check_discs(void) {
+    enum { DATA, DATA_REV, DATA_C, AUDIO, AUDIO_B, AUDIO_ALT, TRACKS };
+    struct CheckTrack tracks[TRACKS] = {
+        {"data.bin", 40960, 0x11, 0, {0}},
+        {"data_rev.bin", 40960, 0x22, 0, {0}},
+        {"data_c.bin", 40960, 0x33, 0, {0}},
+        {"audio.bin", 70560, 0x44, 0, {0}},
+        {"audio_b.bin", 72912, 0x55, 0, {0}},
+        /* Passes the size check, not the hashes */
+        {"audio_alt.bin", 70560, 0x66, 0, {0}},
+    };
+    struct DBIndex idx;
+    char top[PATH_MAX];
+    char dir[PATH_MAX];
+    FILE* f;
+    int i;
+    int rv = 0;
+
+    if (getcwd(top, sizeof(top)) == NULL) {
+        CHECK(0, "could not get the working directory");
+        return;
+    }
+
+    snprintf(dir, PATH_MAX, "%s/discs", scratch);
+    if (mkdir(dir, 0755) < 0 || chdir(dir) < 0 || mkdir("db", 0755) < 0 ||
+        mkdir("cddb", 0755) < 0) {
+        CHECK(0, "could not set up '%s': %s", dir, strerror(errno));
+        goto clean;
+    }
+
+    for (i = 0; i < TRACKS && rv == 0; i++) {
+        rv = write_track(&tracks[i], i < AUDIO);
+    }
+
+    /* Revisions share their audio, and game B shares game A's data. Game
+     * C lists a track with the crc of A's audio but another sha1. */
+    if (rv < 0 || (f = fopen("cddb/saturn.dat", "w")) == NULL) {
+        CHECK(0, "could not write the discs");
+        goto clean;
+    }
+
+    fprintf(f, "game (\n\tname \"Game A\"\n");
+    write_dat_rom(f, &tracks[DATA], 0);
+    write_dat_rom(f, &tracks[AUDIO], 0);
+    fprintf(f, ")\n\ngame (\n\tname \"Game A (Rev 1)\"\n");
+    write_dat_rom(f, &tracks[DATA_REV], 0);
+    write_dat_rom(f, &tracks[AUDIO], 0);
+    fprintf(f, ")\n\ngame (\n\tname \"Game B\"\n");
+    write_dat_rom(f, &tracks[DATA], 0);
+    write_dat_rom(f, &tracks[AUDIO_B], 0);
+    fprintf(f, ")\n\ngame (\n\tname \"Game C\"\n");
+    write_dat_rom(f, &tracks[DATA_C], 0);
+    write_dat_rom(f, &tracks[AUDIO], 1);
+    fprintf(f, ")\n");
+    fclose(f);
+
+    if (write_cue("a.cue", &tracks[DATA], &tracks[AUDIO]) < 0 ||
+        write_cue("rev.cue", &tracks[DATA_REV], &tracks[AUDIO]) < 0 ||
+        write_cue("b.cue", &tracks[DATA], &tracks[AUDIO_B]) < 0 ||
+        write_cue("c.cue", &tracks[DATA_C], &tracks[AUDIO]) < 0 ||
+        write_cue("mix.cue", &tracks[DATA], &tracks[AUDIO_ALT]) < 0 ||
+        write_cue("data.cue", &tracks[DATA], NULL) < 0 ||
+        db_index_build("index.bin") < 0 ||
+        db_index_open(&idx, "index.bin", 0) < 0) {
+        CHECK(0, "could not index the discs");
+        goto clean;
+    }
+
+    check_disc(&idx, "a.cue", "saturn.Game A");
+    check_disc(&idx, "rev.cue", "saturn.Game A (Rev 1)");
+    check_disc(&idx, "b.cue", "saturn.Game B");
+    check_disc(&idx, "c.cue", "saturn.<unknown>");
+    check_disc(&idx, "mix.cue", "saturn.<unknown>");
+    check_disc(&idx, "data.cue", "saturn.<unknown>");
+    db_index_close(&idx);
+
+clean:
+    if (chdir(top) < 0) {
+        CHECK(0, "could not go back to '%s'", top);
+    }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag,
+                        struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(void) {
+    struct DetectContext ctx;
+
+    /* Failures are what matters, RETROLAUNCH_LOG asks for more */
+    log_level = LOG_LEVEL_WARN;
+    log_init();
+    detect_external_db = 1;
+
+    snprintf(scratch, sizeof(scratch), "/tmp/retrolaunch-check.XXXXXX");
+    if (mkdtemp(scratch) == NULL) {
+        fprintf(stderr, "Could not create a scratch directory: %s\n",
+                strerror(errno));
+        return 1;
+    }
+
+    detect_context_init(&ctx, 0);
+    check_run_infos(&ctx);
+    check_cddb(&ctx);
+    detect_context_free(&ctx);
+    check_index_updates();
+    check_discs();
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures > 0;
+}
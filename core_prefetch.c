@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+
+#include "core_prefetch.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <link.h>
+#include <elf.h>
+#include <pthread.h>
+
+#include "parser.h"
+
+#include "log.h"
+
+#define CORE_USAGE_MAX 128
+#define CORE_SYSTEM_LEN 32
+#define CORE_NAME_LEN sizeof(((struct RunInfo*)NULL)->core)
+#define PREFETCH_BUFF_LEN (256 * 1024)
+#define PREFETCH_MAX_NEEDED 32
+#define ELF_NATIVE_CLASS (__ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32)
+
+#if defined(__x86_64__)
+#define MULTIARCH_DIR "x86_64-linux-gnu"
+#elif defined(__aarch64__)
+#define MULTIARCH_DIR "aarch64-linux-gnu"
+#elif defined(__arm__)
+#define MULTIARCH_DIR "arm-linux-gnueabihf"
+#else
+#define MULTIARCH_DIR "."
+#endif
+
+/* Where the dynamic loader will find what cores link against */
+static const char* LIBRARY_DIRS[] = {
+    "./cores",
+    "/usr/local/lib",
+    "/usr/lib/" MULTIARCH_DIR,
+    "/lib/" MULTIARCH_DIR,
+    "/usr/lib",
+    "/lib",
+    NULL
+};
+
+struct CoreUsage {
+    char system[CORE_SYSTEM_LEN];
+    char core[CORE_NAME_LEN];
+    uint32_t count;
+};
+
+/* What a prefetch thread reads, guessed there when only the system is set */
+struct PrefetchJob {
+    char system[CORE_SYSTEM_LEN];
+    char core[CORE_NAME_LEN];
+};
+
+static const struct LaunchRules* prefetch_rules;
+static int prefetch_started;
+
+/* Only launches prefetch, scans and the daemon leave it off */
+void core_prefetch_enable(const struct LaunchRules* rules) {
+    prefetch_rules = rules;
+}
+
+/* Reads the whole file, so it is in the page cache when retroarch maps it */
+static int warm_file(const char* path, unsigned char* buff) {
+    ssize_t rv;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -errno;
+    }
+
+    /* Lets the kernel start on all of it before the reads get there */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    do {
+        rv = read(fd, buff, PREFETCH_BUFF_LEN);
+    } while (rv > 0 || (rv < 0 && errno == EINTR));
+
+    close(fd);
+    return rv < 0 ? -errno : 0;
+}
+
+static int find_loaded(struct dl_phdr_info* info, size_t size, void* data) {
+    const char* name = strrchr(info->dlpi_name, '/');
+
+    name = name ? name + 1 : info->dlpi_name;
+    return strcmp(name, data) == 0;
+}
+
+/* Libraries the launcher has loaded itself are warm already */
+static int is_loaded(const char* name) {
+    return dl_iterate_phdr(find_loaded, (void*)name);
+}
+
+/* File offset of a virtual address, through the segment that maps it */
+static int vaddr_offset(const ElfW(Phdr)* phdrs, size_t count,
+                        ElfW(Addr) vaddr, size_t* offset) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (phdrs[i].p_type == PT_LOAD && vaddr >= phdrs[i].p_vaddr &&
+            vaddr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+            *offset = vaddr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+/* Collects the DT_NEEDED names of a shared library of our own class */
+static size_t find_needed(const unsigned char* map, size_t len,
+                          char needed[][NAME_MAX + 1], size_t max_needed) {
+    const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)map;
+    const ElfW(Phdr)* phdrs;
+    const ElfW(Dyn)* dyn = NULL;
+    size_t dyn_count = 0;
+    size_t strtab = 0;
+    size_t offset;
+    size_t count = 0;
+    size_t i;
+
+    if (len < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_ident[EI_CLASS] != ELF_NATIVE_CLASS ||
+        ehdr->e_phoff + ehdr->e_phnum * sizeof(*phdrs) > len) {
+        return 0;
+    }
+
+    phdrs = (const ElfW(Phdr)*)(map + ehdr->e_phoff);
+    for (i = 0; i < ehdr->e_phnum; i++) {
+        if (phdrs[i].p_type == PT_DYNAMIC &&
+            phdrs[i].p_offset + phdrs[i].p_filesz <= len) {
+            dyn = (const ElfW(Dyn)*)(map + phdrs[i].p_offset);
+            dyn_count = phdrs[i].p_filesz / sizeof(*dyn);
+        }
+    }
+
+    for (i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL; i++) {
+        if (dyn[i].d_tag == DT_STRTAB &&
+            vaddr_offset(phdrs, ehdr->e_phnum, dyn[i].d_un.d_ptr,
+                         &strtab) < 0) {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < dyn_count && dyn[i].d_tag != DT_NULL &&
+                count < max_needed; i++) {
+        offset = strtab + dyn[i].d_un.d_val;
+        if (dyn[i].d_tag != DT_NEEDED || strtab == 0 || offset >= len) {
+            continue;
+        }
+
+        snprintf(needed[count++], NAME_MAX + 1, "%.*s",
+                 (int)strnlen((const char*)map + offset, len - offset),
+                 (const char*)map + offset);
+    }
+
+    return count;
+}
+
+/* Warms up the libraries the core links against, one level deep */
+static void warm_needed(const char* core_path, unsigned char* buff) {
+    char needed[PREFETCH_MAX_NEEDED][NAME_MAX + 1];
+    char path[PATH_MAX];
+    const char** dir;
+    struct stat st;
+    void* map;
+    size_t count;
+    size_t i;
+    int fd;
+
+    if ((fd = open(core_path, O_RDONLY)) < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) < 0 || (map = mmap(NULL, st.st_size, PROT_READ,
+                                          MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    count = find_needed(map, st.st_size, needed, PREFETCH_MAX_NEEDED);
+    munmap(map, st.st_size);
+
+    for (i = 0; i < count; i++) {
+        if (is_loaded(needed[i])) {
+            continue;
+        }
+
+        for (dir = LIBRARY_DIRS; *dir != NULL; dir++) {
+            if (snprintf(path, PATH_MAX, "%s/%s", *dir, needed[i]) >=
+                PATH_MAX) {
+                continue;
+            }
+
+            if (warm_file(path, buff) == 0) {
+                LOG_DEBUG("Prefetched '%s'", path);
+                break;
+            }
+        }
+    }
+}
+
+static size_t load_usage(struct CoreUsage* usage, size_t max_usage) {
+    struct Tokenizer t;
+    struct Token system;
+    struct Token core;
+    struct Token count;
+    char tmp[16];
+    size_t n = 0;
+
+    if (tokenizer_open(&t, CORE_USAGE_PATH) < 0) {
+        return 0;
+    }
+
+    while (n < max_usage && get_token(&t, &system) > 0 &&
+           get_token(&t, &core) > 0 && get_token(&t, &count) > 0) {
+        token_copy(&system, usage[n].system, CORE_SYSTEM_LEN);
+        token_copy(&core, usage[n].core, CORE_NAME_LEN);
+        token_copy(&count, tmp, sizeof(tmp));
+        usage[n].count = strtoul(tmp, NULL, 10);
+        n++;
+    }
+
+    tokenizer_close(&t);
+    return n;
+}
+
+/* Replaces `core` with the one launched most often for the system, if
+ * cache/cores.tsv has any launch for it */
+static void guess_core(const char* system, char* core) {
+    struct CoreUsage usage[CORE_USAGE_MAX];
+    uint32_t best = 0;
+    size_t count;
+    size_t i;
+
+    count = load_usage(usage, CORE_USAGE_MAX);
+    for (i = 0; i < count; i++) {
+        if (strcmp(usage[i].system, system) == 0 && usage[i].count > best) {
+            best = usage[i].count;
+            strcpy(core, usage[i].core);
+        }
+    }
+}
+
+static void* prefetch_thread(void* arg) {
+    struct PrefetchJob* job = arg;
+    char core_path[PATH_MAX];
+    unsigned char* buff = NULL;
+    int rv;
+
+    /* Parsed here, off the thread that goes on detecting */
+    if (job->system[0] != '\0') {
+        guess_core(job->system, job->core);
+    }
+
+    if (job->core[0] == '\0' ||
+        (buff = malloc(PREFETCH_BUFF_LEN)) == NULL) {
+        goto clean;
+    }
+
+    snprintf(core_path, PATH_MAX, CORE_PATH_FORMAT, job->core);
+    LOG_DEBUG("Prefetching '%s'", core_path);
+    if ((rv = warm_file(core_path, buff)) < 0) {
+        LOG_DEBUG("Could not prefetch '%s': %s", core_path, strerror(-rv));
+    } else {
+        warm_needed(core_path, buff);
+    }
+
+clean:
+    free(buff);
+    free(job);
+    return NULL;
+}
+
+static void start_prefetch(struct PrefetchJob* job) {
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    /* Nobody waits for it, exec ends it if it is not done by then */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, prefetch_thread, job) != 0) {
+        free(job);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Starts reading the core the game will most likely be launched with on
+ * a thread of its own, as soon as the system is known. Any launch recorded
+ * for the system wins, the core launched most often; the core its
+ * catch-all rule in launch.conf names is only used for systems with no
+ * launch recorded. Only the first guess of a launch counts.
+ */
+void core_prefetch_system(const char* system) {
+    struct PrefetchJob* job;
+    struct RunInfo info;
+    char name[CORE_SYSTEM_LEN + 1];
+
+    if (prefetch_rules == NULL || system == NULL ||
+        strlen(system) >= CORE_SYSTEM_LEN ||
+        __atomic_exchange_n(&prefetch_started, 1, __ATOMIC_RELAXED) ||
+        (job = calloc(1, sizeof(*job))) == NULL) {
+        return;
+    }
+
+    /* The rules are only valid while the caller's context is */
+    snprintf(name, sizeof(name), "%s.", system);
+    if (get_run_info(prefetch_rules, &info, name) == 0) {
+        strcpy(job->core, info.core);
+    }
+
+    strcpy(job->system, system);
+    LOG_DEBUG("Prefetching the core for %s", system);
+    start_prefetch(job);
+}
+
+/* Starts reading a core that is already known, like one the daemon named */
+void core_prefetch_core(const char* core) {
+    struct PrefetchJob* job;
+
+    if (core == NULL || core[0] == '\0' ||
+        __atomic_exchange_n(&prefetch_started, 1, __ATOMIC_RELAXED) ||
+        (job = calloc(1, sizeof(*job))) == NULL) {
+        return;
+    }
+
+    snprintf(job->core, CORE_NAME_LEN, "%s", core);
+    start_prefetch(job);
+}
+
+/* Counts a launch of `core` for the system of `game_name` */
+int core_usage_record(const char* game_name, const char* core) {
+    struct CoreUsage usage[CORE_USAGE_MAX];
+    char system[CORE_SYSTEM_LEN];
+    char tmp_path[PATH_MAX];
+    const char* dot;
+    size_t count;
+    size_t i;
+    FILE* out;
+    int rv;
+
+    if ((dot = strchr(game_name, '.')) == NULL ||
+        dot - game_name >= CORE_SYSTEM_LEN) {
+        return -EINVAL;
+    }
+    snprintf(system, sizeof(system), "%.*s", (int)(dot - game_name),
+             game_name);
+
+    count = load_usage(usage, CORE_USAGE_MAX);
+    for (i = 0; i < count; i++) {
+        if (strcmp(usage[i].system, system) == 0 &&
+            strcmp(usage[i].core, core) == 0) {
+            break;
+        }
+    }
+
+    if (i == count) {
+        if (count == CORE_USAGE_MAX) {
+            return -ENOSPC;
+        }
+        snprintf(usage[i].system, CORE_SYSTEM_LEN, "%s", system);
+        snprintf(usage[i].core, CORE_NAME_LEN, "%s", core);
+        usage[i].count = 0;
+        count++;
+    }
+    usage[i].count++;
+
+    /* Written aside and renamed, like the other files under cache/ */
+    strncpy(tmp_path, CORE_USAGE_PATH, PATH_MAX - 1);
+    tmp_path[PATH_MAX - 1] = '\0';
+    if (mkdir(dirname(tmp_path), 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    snprintf(tmp_path, PATH_MAX, "%s.%d", CORE_USAGE_PATH, (int)getpid());
+    if ((out = fopen(tmp_path, "w")) == NULL) {
+        return -errno;
+    }
+
+    for (i = 0; i < count; i++) {
+        fprintf(out, "%s\t%s\t%u\n", usage[i].system, usage[i].core,
+                usage[i].count);
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, CORE_USAGE_PATH) < 0) {
+        rv = -errno;
+        unlink(tmp_path);
+        return rv;
+    }
+
+    return 0;
+}
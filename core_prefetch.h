@@ -0,0 +1,14 @@
+#ifndef _CORE_PREFETCH_H_
+#define _CORE_PREFETCH_H_
+
+#include "run_info.h"
+
+#define CORE_PATH_FORMAT "./cores/libretro-%s.so"
+#define CORE_USAGE_PATH "cache/cores.tsv"
+
+void core_prefetch_enable(const struct LaunchRules* rules);
+void core_prefetch_system(const char* system);
+void core_prefetch_core(const char* core);
+int core_usage_record(const char* game_name, const char* core);
+
+#endif
@@ -0,0 +1,275 @@
+#include "crc32.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CRC32_POLY 0xEDB88320
+
+typedef uint32_t (*crc32_function)(uint32_t crc, const unsigned char* data,
+                                   size_t len);
+
+static uint32_t crc_table[8][256];
+
+static void crc32_init_tables(void) {
+    uint32_t crc;
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLY : 0);
+        }
+        crc_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+                              crc_table[0][crc_table[j - 1][i] & 0xFF];
+        }
+    }
+}
+
+/* Works on the inverted crc state, like the accelerated kernels */
+static uint32_t crc32_bytes(uint32_t crc, const unsigned char* data,
+                            size_t len) {
+    while (len--) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *data++) & 0xFF];
+    }
+
+    return crc;
+}
+
+/* Slicing-by-8 */
+static uint32_t crc32_generic(uint32_t crc, const unsigned char* data,
+                              size_t len) {
+    uint32_t lo, hi;
+    while (len >= 8) {
+        lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+                    (uint32_t)data[3] << 24);
+        hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+
+    return crc32_bytes(crc, data, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_ACCEL_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static int crc32_has_pclmul(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+/*
+ * Folds four 128 bit lanes at a time with carry-less multiplication and
+ * Barrett-reduces the result, see Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction". len must be a multiple of 16 and
+ * at least 64.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const unsigned char* data,
+                                  size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = k1k2;
+    data += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        len -= 64;
+    }
+
+    /* Fold the four lanes into one */
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        len -= 16;
+    }
+
+    /* 128 to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x0 = k5k0;
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = poly;
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char* data,
+                             size_t len) {
+    size_t chunk;
+    if (len >= 64) {
+        chunk = len & ~(size_t)15;
+        crc = crc32_pclmul_fold(crc, data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+
+    return crc32_bytes(crc, data, len);
+}
+
+#endif /* x86 */
+
+#if defined(__aarch64__) && defined(__linux__)
+#define CRC32_ACCEL_ARMV8
+
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+
+static int crc32_has_armv8(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char* data,
+                            size_t len) {
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32d(crc, word);
+        data += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32b(crc, *data++);
+    }
+
+    return crc;
+}
+
+#endif /* aarch64 */
+
+static int crc32_always_supported(void) {
+    return 1;
+}
+
+static uint32_t crc32_resolve(uint32_t crc, const unsigned char* data,
+                              size_t len);
+
+static crc32_function crc32_impl = crc32_resolve;
+
+struct Crc32Implementation {
+    const char* name;
+    crc32_function update;
+    int (*supported)(void);
+};
+
+/* In order of preference */
+static const struct Crc32Implementation CRC32_IMPLEMENTATIONS[] = {
+#if defined(CRC32_ACCEL_X86)
+    {"pclmul", crc32_pclmul, crc32_has_pclmul},
+#endif
+#if defined(CRC32_ACCEL_ARMV8)
+    {"armv8-crc", crc32_armv8, crc32_has_armv8},
+#endif
+    {"generic", crc32_generic, crc32_always_supported},
+    {NULL, NULL, NULL}
+};
+
+const char* crc32_select_implementation(void) {
+    const struct Crc32Implementation* impl;
+    const char* forced = getenv("RETROLAUNCH_CRC32");
+
+    crc32_init_tables();
+    for (impl = CRC32_IMPLEMENTATIONS; impl->name != NULL; impl++) {
+        if (forced != NULL && strcmp(forced, impl->name) != 0) {
+            continue;
+        }
+
+        if (impl->supported()) {
+            break;
+        }
+    }
+
+    if (impl->name == NULL) {
+        impl = &CRC32_IMPLEMENTATIONS[sizeof(CRC32_IMPLEMENTATIONS) /
+                                      sizeof(CRC32_IMPLEMENTATIONS[0]) - 2];
+    }
+
+    crc32_impl = impl->update;
+    return impl->name;
+}
+
+static uint32_t crc32_resolve(uint32_t crc, const unsigned char* data,
+                              size_t len) {
+    crc32_select_implementation();
+    return crc32_impl(crc, data, len);
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t len) {
+    return ~crc32_impl(~crc, data, len);
+}
@@ -0,0 +1,11 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Standard (zlib compatible) CRC-32, start with crc = 0 */
+uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t len);
+const char* crc32_select_implementation(void);
+
+#endif
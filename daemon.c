@@ -0,0 +1,512 @@
+#include "daemon.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "detect.h"
+#include "detect_cache.h"
+#include "arena.h"
+
+#include "log.h"
+
+#define DAEMON_MAX_JOBS 64
+/* Accepted connections waiting for a worker */
+#define DAEMON_MAX_PENDING 256
+/* Seconds between checks for changed databases */
+#define DAEMON_RELOAD_INTERVAL 2
+/* Seconds a client may stall mid-request before it is dropped */
+#define DAEMON_IO_TIMEOUT 5
+
+/*
+ * Everything loaded from db/, cddb/ and launch.conf. Requests hold a
+ * reference while they run, so a reload swaps new tables in without
+ * waiting for them and the old ones go away with the last request.
+ */
+struct DaemonTables {
+    struct DetectContext ctx;
+    struct DetectCache cache;
+    uint64_t generation;
+    int refs;
+};
+
+struct Daemon {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct DaemonTables* tables;
+    int use_cache;
+    int conns[DAEMON_MAX_PENDING];
+    size_t head;
+    size_t count;
+    int stop;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+static int read_full(int fd, void* buff, size_t len) {
+    char* c = buff;
+    ssize_t rv;
+
+    while (len > 0) {
+        rv = read(fd, c, len);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rv <= 0) {
+            return rv < 0 ? -errno : -EPIPE;
+        }
+
+        c += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void* buff, size_t len) {
+    const char* c = buff;
+    ssize_t rv;
+
+    while (len > 0) {
+        rv = send(fd, c, len, MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        c += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+static int socket_address(const char* socket_path, struct sockaddr_un* addr) {
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        return -ENAMETOOLONG;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+static int connect_socket(const char* socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+    int rv;
+
+    if ((rv = socket_address(socket_path, &addr)) < 0) {
+        return rv;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -errno;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        rv = -errno;
+        close(fd);
+        return rv;
+    }
+
+    return fd;
+}
+
+static int listen_socket(const char* socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+    int rv;
+
+    if ((rv = socket_address(socket_path, &addr)) < 0) {
+        return rv;
+    }
+
+    /* A socket nobody answers on was left behind by a daemon that died */
+    if ((fd = connect_socket(socket_path)) >= 0) {
+        close(fd);
+        return -EADDRINUSE;
+    }
+    unlink(socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -errno;
+    }
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        rv = -errno;
+        close(fd);
+        return rv;
+    }
+
+    return fd;
+}
+
+static struct DaemonTables* tables_load(int use_cache) {
+    struct DaemonTables* t;
+    int rv;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL) {
+        return NULL;
+    }
+
+    /* Taken first, so changes made while loading trigger another reload */
+    t->generation = detect_cache_generation();
+    t->refs = 1;
+    detect_context_init(&t->ctx, 0);
+
+    if (!use_cache ||
+        (rv = detect_cache_open(&t->cache, DETECT_CACHE_PATH)) < 0) {
+        if (use_cache) {
+            LOG_DEBUG("Detection cache unavailable: %s", strerror(-rv));
+        }
+        memset(&t->cache, 0, sizeof(t->cache));
+    }
+
+    return t;
+}
+
+static void tables_free(struct DaemonTables* t) {
+    detect_cache_close(&t->cache);
+    detect_context_free(&t->ctx);
+    free(t);
+}
+
+static struct DaemonTables* tables_acquire(struct Daemon* d) {
+    struct DaemonTables* t;
+
+    pthread_mutex_lock(&d->lock);
+    t = d->tables;
+    t->refs++;
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+static void tables_release(struct Daemon* d, struct DaemonTables* t) {
+    int refs;
+
+    pthread_mutex_lock(&d->lock);
+    refs = --t->refs;
+    pthread_mutex_unlock(&d->lock);
+    if (refs == 0) {
+        tables_free(t);
+    }
+}
+
+static void tables_swap(struct Daemon* d, struct DaemonTables* t) {
+    struct DaemonTables* old;
+
+    pthread_mutex_lock(&d->lock);
+    old = d->tables;
+    d->tables = t;
+    pthread_mutex_unlock(&d->lock);
+    tables_release(d, old);
+}
+
+static int daemon_stopping(struct Daemon* d) {
+    return __atomic_load_n(&d->stop, __ATOMIC_SEQ_CST);
+}
+
+static void conn_push(struct Daemon* d, int fd) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == DAEMON_MAX_PENDING) {
+        pthread_mutex_unlock(&d->lock);
+        LOG_WARN("Too many pending clients, dropping one");
+        close(fd);
+        return;
+    }
+
+    d->conns[(d->head + d->count++) % DAEMON_MAX_PENDING] = fd;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Returns -1 once the daemon is stopping */
+static int conn_pop(struct Daemon* d) {
+    int fd = -1;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->count == 0 && !d->stop) {
+        pthread_cond_wait(&d->cond, &d->lock);
+    }
+
+    if (!d->stop) {
+        fd = d->conns[d->head];
+        d->head = (d->head + 1) % DAEMON_MAX_PENDING;
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return fd;
+}
+
+static void handle_request(struct Daemon* d, const struct DaemonRequest* req,
+                           const char* path, struct DaemonResponse* resp) {
+    struct DaemonTables* t = tables_acquire(d);
+    struct DetectContext ctx = t->ctx;
+    struct DetectCache* cache;
+    int rv;
+
+    /* The tables are read only, so a copy can differ in strictness */
+    ctx.strict = (req->flags & DAEMON_STRICT) != 0;
+    cache = req->flags & DAEMON_NO_CACHE ? NULL : &t->cache;
+
+    LOG_DEBUG("Request %u for '%s'", req->op, path);
+    if (req->op == DAEMON_IDENTIFY) {
+        rv = detect_game(&ctx, path, resp->game_name, DAEMON_NAME_LEN);
+    } else {
+        rv = detect_resolve(&ctx, cache, path, resp->game_name,
+                            DAEMON_NAME_LEN, &resp->info);
+    }
+
+    resp->status = rv < 0 ? rv : 0;
+    arena_reset(launch_arena());
+    tables_release(d, t);
+}
+
+/* Clients may send any number of requests, one after the other */
+static void serve_connection(struct Daemon* d, int fd) {
+    struct DaemonRequest req;
+    struct DaemonResponse resp;
+    char path[PATH_MAX];
+
+    while (read_full(fd, &req, sizeof(req)) == 0) {
+        if (req.magic != DAEMON_MAGIC || req.version != DAEMON_VERSION ||
+            req.path_len == 0 || req.path_len >= PATH_MAX ||
+            read_full(fd, path, req.path_len) < 0) {
+            break;
+        }
+        path[req.path_len] = '\0';
+
+        memset(&resp, 0, sizeof(resp));
+        resp.magic = DAEMON_MAGIC;
+        if (req.op == DAEMON_IDENTIFY || req.op == DAEMON_RESOLVE) {
+            handle_request(d, &req, path, &resp);
+        } else {
+            resp.status = -EINVAL;
+        }
+
+        if (write_full(fd, &resp, sizeof(resp)) < 0) {
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+static void* daemon_worker(void* arg) {
+    struct Daemon* d = arg;
+    int fd;
+
+    while ((fd = conn_pop(d)) >= 0) {
+        serve_connection(d, fd);
+    }
+
+    return NULL;
+}
+
+static void* daemon_watcher(void* arg) {
+    struct Daemon* d = arg;
+    struct DaemonTables* t;
+    uint64_t generation;
+    int i;
+
+    while (!daemon_stopping(d)) {
+        for (i = 0; i < DAEMON_RELOAD_INTERVAL && !daemon_stopping(d); i++) {
+            sleep(1);
+        }
+
+        /* Only this thread replaces the tables */
+        generation = d->tables->generation;
+        if (daemon_stopping(d) || detect_cache_generation() == generation) {
+            continue;
+        }
+
+        LOG_INFO("Databases changed, reloading");
+        if ((t = tables_load(d->use_cache)) == NULL) {
+            LOG_WARN("Could not reload databases: %s", strerror(ENOMEM));
+            continue;
+        }
+
+        tables_swap(d, t);
+    }
+
+    return NULL;
+}
+
+static void set_timeouts(int fd) {
+    struct timeval tv;
+
+    tv.tv_sec = DAEMON_IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * Loads every database once and answers detection requests on a Unix
+ * socket until SIGINT or SIGTERM, reloading when any of them change.
+ */
+int daemon_serve(const char* socket_path, int jobs, int use_cache) {
+    struct Daemon d;
+    pthread_t workers[DAEMON_MAX_JOBS];
+    pthread_t watcher;
+    struct sigaction sa;
+    sigset_t mask;
+    sigset_t old_mask;
+    int has_watcher;
+    int started;
+    int listen_fd;
+    int fd;
+    int rv;
+    int i;
+
+    if (jobs <= 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (jobs <= 0) {
+        jobs = 1;
+    } else if (jobs > DAEMON_MAX_JOBS) {
+        jobs = DAEMON_MAX_JOBS;
+    }
+
+    if ((listen_fd = listen_socket(socket_path)) < 0) {
+        LOG_WARN("Could not listen on '%s': %s", socket_path,
+                 strerror(-listen_fd));
+        return listen_fd;
+    }
+
+    /* Rebuilt here, once, instead of by every launch */
+    detect_update_index = 1;
+    memset(&d, 0, sizeof(d));
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    d.use_cache = use_cache;
+    if ((d.tables = tables_load(use_cache)) == NULL) {
+        rv = -ENOMEM;
+        goto clean;
+    }
+
+    /* Without SA_RESTART, a signal breaks the main thread out of accept */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* The other threads leave the signals to the main thread */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (started = 0; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, daemon_worker, &d) != 0) {
+            break;
+        }
+    }
+    has_watcher = pthread_create(&watcher, NULL, daemon_watcher, &d) == 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (started == 0) {
+        rv = -EAGAIN;
+        goto stop;
+    }
+
+    LOG_INFO("Serving on '%s' with %d workers", socket_path, started);
+    while (!stop_requested) {
+        fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                LOG_WARN("Could not accept: %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+
+        set_timeouts(fd);
+        conn_push(&d, fd);
+    }
+
+    LOG_INFO("Shutting down");
+    rv = 0;
+stop:
+    pthread_mutex_lock(&d.lock);
+    __atomic_store_n(&d.stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&d.cond);
+    pthread_mutex_unlock(&d.lock);
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    if (has_watcher) {
+        pthread_join(watcher, NULL);
+    }
+
+    for (; d.count > 0; d.count--) {
+        close(d.conns[d.head]);
+        d.head = (d.head + 1) % DAEMON_MAX_PENDING;
+    }
+
+    tables_release(&d, d.tables);
+clean:
+    close(listen_fd);
+    unlink(socket_path);
+    pthread_cond_destroy(&d.cond);
+    pthread_mutex_destroy(&d.lock);
+    return rv;
+}
+
+int daemon_request(const char* socket_path, int op, uint32_t flags,
+                   const char* path, struct DaemonResponse* resp) {
+    char abs_path[PATH_MAX];
+    struct DaemonRequest req;
+    int fd;
+    int rv;
+
+    /* The daemon resolves paths from its own directory */
+    if (realpath(path, abs_path) == NULL) {
+        return -errno;
+    }
+
+    if ((fd = connect_socket(socket_path)) < 0) {
+        return fd;
+    }
+
+    req.magic = DAEMON_MAGIC;
+    req.version = DAEMON_VERSION;
+    req.op = op;
+    req.flags = flags;
+    req.path_len = strlen(abs_path);
+    if ((rv = write_full(fd, &req, sizeof(req))) < 0 ||
+        (rv = write_full(fd, abs_path, req.path_len)) < 0 ||
+        (rv = read_full(fd, resp, sizeof(*resp))) < 0) {
+        goto clean;
+    }
+
+    if (resp->magic != DAEMON_MAGIC) {
+        rv = -EPROTO;
+        goto clean;
+    }
+
+    resp->game_name[DAEMON_NAME_LEN - 1] = '\0';
+    rv = 0;
+clean:
+    close(fd);
+    return rv;
+}
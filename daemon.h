@@ -0,0 +1,47 @@
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stdint.h>
+
+#include "run_info.h"
+
+#define DAEMON_SOCKET_PATH "./retrolaunchd.sock"
+
+#define DAEMON_MAGIC 0x444c5452
+#define DAEMON_VERSION 1
+#define DAEMON_NAME_LEN 256
+
+/* Ops */
+#define DAEMON_IDENTIFY 1
+#define DAEMON_RESOLVE 2
+
+/* Request flags */
+#define DAEMON_STRICT 0x1
+#define DAEMON_NO_CACHE 0x2
+
+/*
+ * Both ends run on the same machine, so requests and responses are sent as
+ * the structs themselves. The request is followed by path_len bytes of an
+ * absolute path.
+ */
+struct DaemonRequest {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t path_len;
+};
+
+struct DaemonResponse {
+    uint32_t magic;
+    /* 0 or a negative errno */
+    int32_t status;
+    struct RunInfo info;
+    char game_name[DAEMON_NAME_LEN];
+};
+
+int daemon_serve(const char* socket_path, int jobs, int use_cache);
+int daemon_request(const char* socket_path, int op, uint32_t flags,
+                   const char* path, struct DaemonResponse* resp);
+
+#endif
@@ -0,0 +1,1110 @@
+#include "db_index.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include "crc32.h"
+#include "parser.h"
+
+#include "log.h"
+
+#define DB_INDEX_MAGIC "RLDB"
+#define DB_INDEX_VERSION 5
+#define DB_DAT_GLOB "db/*.dat"
+/* Redump DATs of CD systems, hashed track by track */
+#define DB_DISC_DAT_GLOB "cddb/*.dat"
+#define DB_SHARD_MAGIC "RLSH"
+#define DB_SHARD_VERSION 1
+#define DB_SHARD_DIR "db/shards"
+
+struct BuildEntry {
+    struct DBIndexEntry entry;
+    uint64_t size;
+    uint32_t crc;
+    /* The DAT it came from, only set while merging */
+    uint32_t source;
+};
+
+/* A rom of the per system view, sorted by source first */
+struct SystemRom {
+    uint32_t source;
+    struct DBIndexRom rom;
+};
+
+/* db/shards/<dir>_<system>.shard: the parsed roms and names of one DAT */
+struct ShardHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    uint64_t source_mtime_ns;
+    uint32_t source_crc;
+    uint32_t entry_count;
+    uint32_t names_len;
+    uint32_t reserved;
+};
+
+struct IndexBuilder {
+    struct BuildEntry* entries;
+    size_t entry_count;
+    size_t entry_cap;
+    char* names;
+    size_t names_len;
+    size_t names_cap;
+};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+int db_parse_hex(const char* hex, size_t hex_len,
+                 unsigned char* out, size_t out_len) {
+    size_t i;
+    int hi, lo;
+    if (hex_len != out_len * 2) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < out_len; i++) {
+        if ((hi = hex_value(hex[i * 2])) < 0 ||
+            (lo = hex_value(hex[i * 2 + 1])) < 0) {
+            return -EINVAL;
+        }
+
+        out[i] = (hi << 4) | lo;
+    }
+
+    return 0;
+}
+
+void db_format_hex(const unsigned char* data, size_t len, char* out) {
+    static const char digits[] = "0123456789ABCDEF";
+    size_t i;
+    for (i = 0; i < len; i++) {
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0xF];
+    }
+
+    out[len * 2] = '\0';
+}
+
+static int builder_add_name(struct IndexBuilder* b, const char* system,
+                            const struct Token* name, uint32_t* offset) {
+    size_t system_len = strlen(system);
+    size_t len = system_len + 1 + name->len + 1;
+    char* tmp;
+    while (b->names_len + len > b->names_cap) {
+        b->names_cap = b->names_cap ? b->names_cap * 2 : 1 << 16;
+        if ((tmp = realloc(b->names, b->names_cap)) == NULL) {
+            return -ENOMEM;
+        }
+        b->names = tmp;
+    }
+
+    *offset = b->names_len;
+    tmp = b->names + b->names_len;
+    memcpy(tmp, system, system_len);
+    tmp[system_len] = '.';
+    memcpy(tmp + system_len + 1, name->start, name->len);
+    tmp[len - 1] = '\0';
+    b->names_len += len;
+    return 0;
+}
+
+static int builder_add_entry(struct IndexBuilder* b,
+                             const struct BuildEntry* entry) {
+    struct BuildEntry* tmp;
+    if (b->entry_count == b->entry_cap) {
+        b->entry_cap = b->entry_cap ? b->entry_cap * 2 : 4096;
+        tmp = realloc(b->entries, b->entry_cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            return -ENOMEM;
+        }
+        b->entries = tmp;
+    }
+
+    b->entries[b->entry_count++] = *entry;
+    return 0;
+}
+
+static int parse_number(const struct Token* token, int base, uint64_t* value) {
+    char tmp[32];
+    char* end;
+    token_copy(token, tmp, sizeof(tmp));
+    errno = 0;
+    *value = strtoull(tmp, &end, base);
+    if (errno != 0 || end == tmp || *end != '\0') {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Reads `key value` pairs of a `rom ( ... )` block */
+static int parse_rom(struct Tokenizer* t, struct IndexBuilder* b,
+                     uint32_t name_offset) {
+    struct BuildEntry entry;
+    struct Token key;
+    struct Token value;
+    uint64_t crc = 0;
+    int has_sha1 = 0;
+    int has_crc = 0;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.entry.name_offset = name_offset;
+    while (1) {
+        if (get_token(t, &key) <= 0) {
+            return -EINVAL;
+        }
+
+        if (token_equals(&key, ")")) {
+            break;
+        }
+
+        if (get_token(t, &value) <= 0) {
+            return -EINVAL;
+        }
+
+        if (token_equals(&key, "sha1")) {
+            has_sha1 = db_parse_hex(value.start, value.len, entry.entry.sha1,
+                                    DB_SHA1_SIZE) == 0;
+        } else if (token_equals(&key, "crc")) {
+            has_crc = parse_number(&value, 16, &crc) == 0;
+        } else if (token_equals(&key, "size")) {
+            parse_number(&value, 10, &entry.size);
+        }
+    }
+
+    if (!has_sha1 || !has_crc) {
+        LOG_WARN("Ignoring rom without valid sha1 and crc");
+        return 0;
+    }
+
+    entry.crc = crc;
+    return builder_add_entry(b, &entry);
+}
+
+static int parse_game(struct Tokenizer* t, const char* system,
+                      struct IndexBuilder* b) {
+    struct Token key;
+    struct Token value;
+    uint32_t name_offset = UINT32_MAX;
+    int rv;
+
+    if (get_token(t, &key) <= 0 || !token_equals(&key, "(")) {
+        return -EINVAL;
+    }
+
+    while (1) {
+        if (get_token(t, &key) <= 0) {
+            return -EINVAL;
+        }
+
+        if (token_equals(&key, ")")) {
+            return 0;
+        }
+
+        if (get_token(t, &value) <= 0) {
+            return -EINVAL;
+        }
+
+        if (token_equals(&key, "name") && name_offset == UINT32_MAX) {
+            if ((rv = builder_add_name(b, system, &value, &name_offset)) < 0) {
+                return rv;
+            }
+        } else if (token_equals(&key, "rom") && name_offset != UINT32_MAX) {
+            if ((rv = parse_rom(t, b, name_offset)) < 0) {
+                return rv;
+            }
+        }
+    }
+}
+
+/* The system a DAT is for, from its name, e.g. "gba" for db/gba.dat */
+static void dat_system(const char* dat_path, char* system, size_t max_len) {
+    char path_copy[PATH_MAX];
+    char* name;
+    char* c;
+
+    strncpy(path_copy, dat_path, PATH_MAX - 1);
+    path_copy[PATH_MAX - 1] = '\0';
+    name = basename(path_copy);
+    if ((c = strchr(name, '.')) != NULL) {
+        *c = '\0';
+    }
+
+    strncpy(system, name, max_len - 1);
+    system[max_len - 1] = '\0';
+}
+
+/* The directory a DAT is in, e.g. "cddb" for cddb/ps1.dat */
+static void dat_dir(const char* dat_path, char* dir, size_t max_len) {
+    char path_copy[PATH_MAX];
+
+    strncpy(path_copy, dat_path, PATH_MAX - 1);
+    path_copy[PATH_MAX - 1] = '\0';
+    strncpy(dir, basename(dirname(path_copy)), max_len - 1);
+    dir[max_len - 1] = '\0';
+}
+
+static int parse_dat(struct Tokenizer* t, const char* dat_path,
+                     const char* system, struct IndexBuilder* b) {
+    int rv = 0;
+
+    while (find_token(t, "game") == 0) {
+        if ((rv = parse_game(t, system, b)) < 0) {
+            LOG_WARN("Malformed game entry in '%s'", dat_path);
+            break;
+        }
+    }
+
+    return rv;
+}
+
+/* Cartridge DATs first, then disc DATs */
+static int glob_dats(glob_t* glb, int flags) {
+    int rv = glob(DB_DAT_GLOB, flags, NULL, glb);
+
+    if (glob(DB_DISC_DAT_GLOB, flags | (rv == 0 ? GLOB_APPEND : 0), NULL,
+             glb) != 0 && rv != 0) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return memcmp(((const struct BuildEntry*)a)->entry.sha1,
+                  ((const struct BuildEntry*)b)->entry.sha1, DB_SHA1_SIZE);
+}
+
+static int compare_roms(const void* a, const void* b) {
+    const struct DBIndexRom* rom_a = a;
+    const struct DBIndexRom* rom_b = b;
+    if (rom_a->size != rom_b->size) {
+        return rom_a->size < rom_b->size ? -1 : 1;
+    } else if (rom_a->crc != rom_b->crc) {
+        return rom_a->crc < rom_b->crc ? -1 : 1;
+    }
+
+    return rom_a->entry < rom_b->entry ? -1 : rom_a->entry > rom_b->entry;
+}
+
+static int compare_system_roms(const void* a, const void* b) {
+    const struct SystemRom* rom_a = a;
+    const struct SystemRom* rom_b = b;
+    if (rom_a->source != rom_b->source) {
+        return rom_a->source < rom_b->source ? -1 : 1;
+    }
+
+    return compare_roms(&rom_a->rom, &rom_b->rom);
+}
+
+static int write_all(int fd, const void* buff, size_t len) {
+    const char* c = buff;
+    ssize_t rv;
+    while (len > 0) {
+        rv = write(fd, c, len);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        c += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+static uint64_t mtime_ns(const struct stat* st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* Written to a temporary file first, so readers see the old or the new
+ * file and never half of one */
+static int save_file(const char* path, const struct iovec* parts,
+                     int count) {
+    char tmp_path[PATH_MAX];
+    int fd;
+    int rv = 0;
+    int i;
+
+    snprintf(tmp_path, PATH_MAX, "%s.%d", path, (int)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_WARN("Could not create '%s': %s", tmp_path, strerror(errno));
+        return -errno;
+    }
+
+    for (i = 0; i < count && rv == 0; i++) {
+        rv = write_all(fd, parts[i].iov_base, parts[i].iov_len);
+    }
+
+    close(fd);
+    if (rv < 0) {
+        unlink(tmp_path);
+        return rv;
+    }
+
+    if (rename(tmp_path, path) < 0) {
+        rv = -errno;
+        unlink(tmp_path);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Named after the DAT's directory too, db/ and cddb/ share system names */
+static void shard_path(const struct DBIndexSource* source, char* path) {
+    snprintf(path, PATH_MAX, "%s/%s_%s.shard", DB_SHARD_DIR, source->dir,
+             source->system);
+}
+
+static int save_shard(const char* path, const struct ShardHeader* header,
+                      const struct IndexBuilder* b) {
+    struct iovec parts[] = {
+        { (void*)header, sizeof(*header) },
+        { b->entries, b->entry_count * sizeof(*b->entries) },
+        { b->names, b->names_len }
+    };
+
+    return save_file(path, parts, 3);
+}
+
+/* Maps a shard, or returns NULL if there is no usable one */
+static const struct ShardHeader* map_shard(const char* path, size_t* len) {
+    const struct ShardHeader* header;
+    struct stat st;
+    void* map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(*header) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    header = map;
+    if (memcmp(header->magic, DB_SHARD_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DB_SHARD_VERSION ||
+        sizeof(*header) + header->entry_count * sizeof(struct BuildEntry) +
+            header->names_len > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    *len = st.st_size;
+    return header;
+}
+
+/* Adds one DAT's roms and names to the merged index */
+static int merge_entries(struct IndexBuilder* b,
+                         const struct BuildEntry* entries, size_t count,
+                         const char* names, size_t names_len) {
+    struct BuildEntry entry;
+    size_t names_base = b->names_len;
+    size_t i;
+    char* tmp;
+    int rv;
+
+    while (b->names_len + names_len > b->names_cap) {
+        b->names_cap = b->names_cap ? b->names_cap * 2 : 1 << 16;
+        if ((tmp = realloc(b->names, b->names_cap)) == NULL) {
+            return -ENOMEM;
+        }
+        b->names = tmp;
+    }
+    memcpy(b->names + b->names_len, names, names_len);
+    b->names_len += names_len;
+
+    for (i = 0; i < count; i++) {
+        entry = entries[i];
+        entry.entry.name_offset += names_base;
+        if ((rv = builder_add_entry(b, &entry)) < 0) {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+static int merge_shard(struct IndexBuilder* b,
+                       const struct ShardHeader* header) {
+    const struct BuildEntry* entries = (const struct BuildEntry*)(header + 1);
+    return merge_entries(b, entries, header->entry_count,
+                         (const char*)(entries + header->entry_count),
+                         header->names_len);
+}
+
+/*
+ * Brings the shard of one DAT up to date and merges it. A shard is kept
+ * while the DAT's size and mtime match it, or failing that, while its
+ * contents do; only DATs that really changed are parsed again.
+ */
+static int update_shard(const char* dat_path, struct DBIndexSource* source,
+                        int force, struct IndexBuilder* merged,
+                        int* rebuilt) {
+    const struct ShardHeader* old;
+    struct ShardHeader header;
+    struct IndexBuilder b;
+    struct Tokenizer t;
+    struct stat st;
+    char path[PATH_MAX];
+    size_t old_len = 0;
+    int rv;
+
+    memset(source, 0, sizeof(*source));
+    dat_system(dat_path, source->system, sizeof(source->system));
+    dat_dir(dat_path, source->dir, sizeof(source->dir));
+    shard_path(source, path);
+    if (stat(dat_path, &st) < 0) {
+        return -errno;
+    }
+
+    source->size = st.st_size;
+    source->mtime_ns = mtime_ns(&st);
+    old = force ? NULL : map_shard(path, &old_len);
+    if (old != NULL && old->source_size == source->size &&
+        old->source_mtime_ns == source->mtime_ns) {
+        rv = merge_shard(merged, old);
+        munmap((void*)old, old_len);
+        return rv;
+    }
+
+    if ((rv = tokenizer_open(&t, dat_path)) < 0) {
+        LOG_WARN("Could not open DAT '%s': %s", dat_path, strerror(-rv));
+        goto unmap;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DB_SHARD_MAGIC, sizeof(header.magic));
+    header.version = DB_SHARD_VERSION;
+    header.source_size = source->size;
+    header.source_mtime_ns = source->mtime_ns;
+    header.source_crc = crc32_update(0, (const unsigned char*)t.buff, t.len);
+
+    memset(&b, 0, sizeof(b));
+    if (old != NULL && old->source_size == t.len &&
+        old->source_crc == header.source_crc) {
+        /* Only touched, so the old shard just gets the new mtime */
+        LOG_DEBUG("'%s' is unchanged", dat_path);
+        header.entry_count = old->entry_count;
+        header.names_len = old->names_len;
+        rv = merge_shard(merged, old);
+        if (rv == 0) {
+            struct iovec parts[] = {
+                { &header, sizeof(header) },
+                { (void*)(old + 1), old_len - sizeof(header) }
+            };
+            save_file(path, parts, 2);
+        }
+        goto close;
+    }
+
+    LOG_DEBUG("Indexing '%s'...", dat_path);
+    if ((rv = parse_dat(&t, dat_path, source->system, &b)) < 0) {
+        goto free_builder;
+    }
+
+    header.entry_count = b.entry_count;
+    header.names_len = b.names_len;
+    if ((rv = save_shard(path, &header, &b)) < 0) {
+        LOG_WARN("Could not save shard '%s': %s", path, strerror(-rv));
+    }
+
+    (*rebuilt)++;
+    rv = merge_entries(merged, b.entries, b.entry_count, b.names,
+                       b.names_len);
+free_builder:
+    free(b.entries);
+    free(b.names);
+close:
+    tokenizer_close(&t);
+unmap:
+    if (old != NULL) {
+        munmap((void*)old, old_len);
+    }
+    return rv;
+}
+
+static int update_index(const char* index_path, int force) {
+    struct IndexBuilder b;
+    struct DBIndexHeader header;
+    struct DBIndexSource* sources = NULL;
+    struct DBIndexEntry* entries = NULL;
+    struct DBIndexRom* roms = NULL;
+    struct SystemRom* system_roms = NULL;
+    struct DBIndexRom* by_system = NULL;
+    uint32_t* group = NULL;
+    struct iovec parts[6];
+    glob_t glb;
+    int rebuilt = 0;
+    size_t first;
+    size_t i;
+    int rv;
+
+    memset(&b, 0, sizeof(b));
+    if (glob_dats(&glb, 0) < 0) {
+        LOG_WARN("No DAT files found");
+        return -ENOENT;
+    }
+
+    if (mkdir(DB_SHARD_DIR, 0755) < 0 && errno != EEXIST) {
+        LOG_DEBUG("Could not create '%s': %s", DB_SHARD_DIR,
+                  strerror(errno));
+    }
+
+    if ((sources = calloc(glb.gl_pathc, sizeof(*sources))) == NULL ||
+        (group = calloc(glb.gl_pathc, sizeof(*group))) == NULL) {
+        rv = -ENOMEM;
+        goto clean;
+    }
+
+    for (i = 0; i < glb.gl_pathc; i++) {
+        first = b.entry_count;
+        if ((rv = update_shard(glb.gl_pathv[i], &sources[i], force, &b,
+                               &rebuilt)) < 0) {
+            goto clean;
+        }
+
+        for (; first < b.entry_count; first++) {
+            b.entries[first].source = i;
+        }
+    }
+
+    qsort(b.entries, b.entry_count, sizeof(*b.entries), compare_entries);
+
+    entries = calloc(b.entry_count + 1, sizeof(*entries));
+    roms = calloc(b.entry_count + 1, sizeof(*roms));
+    system_roms = calloc(b.entry_count + 1, sizeof(*system_roms));
+    by_system = calloc(b.entry_count + 1, sizeof(*by_system));
+    if (entries == NULL || roms == NULL || system_roms == NULL ||
+        by_system == NULL) {
+        rv = -ENOMEM;
+        goto clean;
+    }
+
+    /* Every DAT of a system is filed under the first one */
+    for (i = 0; i < glb.gl_pathc; i++) {
+        for (group[i] = 0; strncmp(sources[group[i]].system,
+                                   sources[i].system, DB_SYSTEM_LEN) != 0;
+             group[i]++);
+    }
+
+    for (i = 0; i < b.entry_count; i++) {
+        entries[i] = b.entries[i].entry;
+        roms[i].size = b.entries[i].size;
+        roms[i].crc = b.entries[i].crc;
+        roms[i].entry = i;
+        system_roms[i].source = group[b.entries[i].source];
+        system_roms[i].rom = roms[i];
+    }
+
+    qsort(roms, b.entry_count, sizeof(*roms), compare_roms);
+
+    /* Each system's roms get a block of their own, so lookups scoped to
+     * one system never touch the others */
+    qsort(system_roms, b.entry_count, sizeof(*system_roms),
+          compare_system_roms);
+    for (i = 0; i < b.entry_count; i++) {
+        if (sources[system_roms[i].source].rom_count++ == 0) {
+            sources[system_roms[i].source].rom_first = i;
+        }
+        by_system[i] = system_roms[i].rom;
+    }
+
+    for (i = 0; i < glb.gl_pathc; i++) {
+        sources[i].rom_first = sources[group[i]].rom_first;
+        sources[i].rom_count = sources[group[i]].rom_count;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DB_INDEX_MAGIC, sizeof(header.magic));
+    header.version = DB_INDEX_VERSION;
+    header.dat_count = glb.gl_pathc;
+    header.entry_count = b.entry_count;
+    header.sources_offset = sizeof(header);
+    header.entries_offset = header.sources_offset +
+                            glb.gl_pathc * sizeof(*sources);
+    header.roms_offset = header.entries_offset +
+                         b.entry_count * sizeof(*entries);
+    header.system_roms_offset = header.roms_offset +
+                                b.entry_count * sizeof(*roms);
+    header.names_offset = header.system_roms_offset +
+                          b.entry_count * sizeof(*roms);
+    header.names_len = b.names_len;
+
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+    parts[1].iov_base = sources;
+    parts[1].iov_len = glb.gl_pathc * sizeof(*sources);
+    parts[2].iov_base = entries;
+    parts[2].iov_len = b.entry_count * sizeof(*entries);
+    parts[3].iov_base = roms;
+    parts[3].iov_len = b.entry_count * sizeof(*roms);
+    parts[4].iov_base = by_system;
+    parts[4].iov_len = b.entry_count * sizeof(*roms);
+    parts[5].iov_base = b.names;
+    parts[5].iov_len = b.names_len;
+    if ((rv = save_file(index_path, parts, 6)) < 0) {
+        LOG_WARN("Could not save '%s': %s", index_path, strerror(-rv));
+        goto clean;
+    }
+
+    LOG_INFO("Indexed %zu roms from %zu DAT files, %d of them reparsed",
+             b.entry_count, glb.gl_pathc, rebuilt);
+    rv = 0;
+clean:
+    globfree(&glb);
+    free(sources);
+    free(group);
+    free(entries);
+    free(roms);
+    free(system_roms);
+    free(by_system);
+    free(b.entries);
+    free(b.names);
+    return rv;
+}
+
+/* Parses every DAT again */
+int db_index_build(const char* index_path) {
+    return update_index(index_path, 1);
+}
+
+/* Only parses the DATs that changed since their shard was built */
+int db_index_update(const char* index_path) {
+    return update_index(index_path, 0);
+}
+
+/* The first DAT of the system, or that of the system in `dir` if set */
+static const struct DBIndexSource* find_source(
+        const struct DBIndexHeader* header, const char* dir,
+        const char* system) {
+    const struct DBIndexSource* sources = (const struct DBIndexSource*)
+        ((const char*)header + header->sources_offset);
+    uint32_t i;
+
+    for (i = 0; i < header->dat_count; i++) {
+        if (strncmp(sources[i].system, system, DB_SYSTEM_LEN) == 0 &&
+            (dir == NULL ||
+             strncmp(sources[i].dir, dir, DB_DIR_LEN) == 0)) {
+            return &sources[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Stale as soon as a DAT is added, removed or modified */
+static int index_is_stale(const struct DBIndexHeader* header) {
+    const struct DBIndexSource* source;
+    char system[DB_SYSTEM_LEN];
+    char dir[DB_DIR_LEN];
+    struct stat st;
+    glob_t glb;
+    size_t i;
+    int stale = 0;
+
+    if (glob_dats(&glb, GLOB_NOSORT) < 0) {
+        return header->dat_count != 0;
+    }
+
+    if (glb.gl_pathc != header->dat_count) {
+        stale = 1;
+    }
+
+    for (i = 0; i < glb.gl_pathc && !stale; i++) {
+        dat_system(glb.gl_pathv[i], system, sizeof(system));
+        dat_dir(glb.gl_pathv[i], dir, sizeof(dir));
+        source = find_source(header, dir, system);
+        if (source == NULL || stat(glb.gl_pathv[i], &st) < 0 ||
+            source->size != (uint64_t)st.st_size ||
+            source->mtime_ns != mtime_ns(&st)) {
+            LOG_DEBUG("'%s' changed since the index was built",
+                      glb.gl_pathv[i]);
+            stale = 1;
+        }
+    }
+
+    globfree(&glb);
+    return stale;
+}
+
+static int check_header(const struct DBIndexHeader* header, size_t len,
+                        const char* index_path) {
+    if (len < sizeof(*header)) {
+        return -EINVAL;
+    }
+
+    if (memcmp(header->magic, DB_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version != DB_INDEX_VERSION) {
+        LOG_DEBUG("Index '%s' has an old format", index_path);
+        return -ESTALE;
+    }
+
+    if (memcmp(header->magic, DB_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->names_offset + (size_t)header->names_len > len ||
+        header->sources_offset < sizeof(*header) ||
+        header->sources_offset + header->dat_count *
+            sizeof(struct DBIndexSource) > header->entries_offset ||
+        header->entries_offset + header->entry_count *
+            sizeof(struct DBIndexEntry) > header->roms_offset ||
+        header->roms_offset + header->entry_count *
+            sizeof(struct DBIndexRom) > header->system_roms_offset ||
+        header->system_roms_offset + header->entry_count *
+            sizeof(struct DBIndexRom) > header->names_offset) {
+        LOG_WARN("Index '%s' is corrupt", index_path);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void use_index(struct DBIndex* idx,
+                      const struct DBIndexHeader* header) {
+    idx->header = header;
+    idx->entries = (const struct DBIndexEntry*)
+                   ((const char*)header + header->entries_offset);
+    idx->sources = (const struct DBIndexSource*)
+                   ((const char*)header + header->sources_offset);
+    idx->roms = (const struct DBIndexRom*)
+                ((const char*)header + header->roms_offset);
+    idx->system_roms = (const struct DBIndexRom*)
+                       ((const char*)header + header->system_roms_offset);
+    idx->names = (const char*)header + header->names_offset;
+}
+
+/*
+ * Maps the index, which fails with -ESTALE when a DAT changed since it was
+ * built unless DB_INDEX_ALLOW_STALE is set. An old format never opens.
+ */
+int db_index_open(struct DBIndex* idx, const char* index_path, int flags) {
+    struct stat st;
+    const struct DBIndexHeader* header;
+    int fd;
+    int rv;
+
+    memset(idx, 0, sizeof(*idx));
+    fd = open(index_path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rv = -errno;
+        goto clean;
+    }
+
+    if (st.st_size < sizeof(*header)) {
+        rv = -EINVAL;
+        goto clean;
+    }
+
+    idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (idx->map == MAP_FAILED) {
+        idx->map = NULL;
+        rv = -errno;
+        goto clean;
+    }
+    idx->map_len = st.st_size;
+    idx->mapped = 1;
+
+    header = idx->map;
+    if ((rv = check_header(header, idx->map_len, index_path)) < 0) {
+        goto unmap;
+    }
+
+    if (!(flags & DB_INDEX_ALLOW_STALE) && index_is_stale(header)) {
+        rv = -ESTALE;
+        goto unmap;
+    }
+
+    use_index(idx, header);
+    rv = 0;
+    goto clean;
+
+unmap:
+    munmap(idx->map, idx->map_len);
+    idx->map = NULL;
+    idx->mapped = 0;
+clean:
+    close(fd);
+    return rv;
+}
+
+/* An index built into the executable, never stale */
+int db_index_open_static(struct DBIndex* idx, const void* data, size_t len) {
+    int rv;
+
+    memset(idx, 0, sizeof(*idx));
+    if ((rv = check_header(data, len, "<embedded>")) < 0) {
+        return rv;
+    }
+
+    idx->map = (void*)data;
+    idx->map_len = len;
+    use_index(idx, data);
+    return 0;
+}
+
+void db_index_close(struct DBIndex* idx) {
+    if (idx->mapped) {
+        munmap(idx->map, idx->map_len);
+    }
+
+    memset(idx, 0, sizeof(*idx));
+}
+
+static int copy_name(const struct DBIndex* idx, uint32_t offset,
+                     char* game_name, size_t max_len) {
+    if (offset >= idx->header->names_len) {
+        return -EINVAL;
+    }
+
+    strncpy(game_name, idx->names + offset, max_len - 1);
+    game_name[max_len - 1] = '\0';
+    return 0;
+}
+
+int db_index_find_sha1(const struct DBIndex* idx,
+                       const unsigned char* sha1,
+                       char* game_name, size_t max_len) {
+    size_t lo = 0;
+    size_t hi = idx->header->entry_count;
+    size_t mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = memcmp(idx->entries[mid].sha1, sha1, DB_SHA1_SIZE);
+        if (cmp == 0) {
+            return copy_name(idx, idx->entries[mid].name_offset,
+                             game_name, max_len);
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return -ENOENT;
+}
+
+/* The roms a lookup goes through, all of them or one system's */
+struct RomScope {
+    const struct DBIndexRom* roms;
+    size_t count;
+};
+
+static void rom_scope(const struct DBIndex* idx, const char* system,
+                      struct RomScope* scope) {
+    const struct DBIndexSource* source;
+
+    scope->roms = idx->roms;
+    scope->count = idx->header->entry_count;
+    if (system == NULL) {
+        return;
+    }
+
+    source = find_source(idx->header, NULL, system);
+    if (source == NULL || source->rom_first > idx->header->entry_count ||
+        source->rom_count > idx->header->entry_count - source->rom_first) {
+        scope->count = 0;
+        return;
+    }
+
+    scope->roms = idx->system_roms + source->rom_first;
+    scope->count = source->rom_count;
+}
+
+/* First rom that is not less than (size, crc) */
+static size_t lower_bound_rom(const struct RomScope* scope, uint64_t size,
+                              uint32_t crc) {
+    const struct DBIndexRom* roms = scope->roms;
+    size_t lo = 0;
+    size_t hi = scope->count;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (roms[mid].size < size ||
+            (roms[mid].size == size && roms[mid].crc < crc)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * Counts the distinct dumps in roms[first, end). Roms are sorted by entry
+ * and entries by sha1, so duplicates of one dump across DATs are adjacent
+ * and only count once. The name is only filled in when there is exactly one.
+ */
+static int count_roms(const struct DBIndex* idx, const struct RomScope* scope,
+                      size_t first, size_t end, char* game_name,
+                      size_t max_len) {
+    const struct DBIndexRom* roms = scope->roms;
+    size_t i;
+    int count = 0;
+
+    for (i = first; i < end; i++) {
+        if (i == first || memcmp(idx->entries[roms[i].entry].sha1,
+                                 idx->entries[roms[i - 1].entry].sha1,
+                                 DB_SHA1_SIZE) != 0) {
+            count++;
+        }
+    }
+
+    if (count == 1) {
+        copy_name(idx, idx->entries[roms[first].entry].name_offset,
+                  game_name, max_len);
+    }
+
+    return count;
+}
+
+/* The roms of `system` with this size and crc, scope.roms[*first, *end) */
+static void find_dump(const struct DBIndex* idx, const char* system,
+                      uint64_t size, uint32_t crc, struct RomScope* scope,
+                      size_t* first, size_t* end) {
+    rom_scope(idx, system, scope);
+    *first = lower_bound_rom(scope, size, crc);
+    *end = *first;
+    while (*end < scope->count &&
+           scope->roms[*end].size == size && scope->roms[*end].crc == crc) {
+        (*end)++;
+    }
+}
+
+/*
+ * Returns the number of distinct dumps with this size and crc, among the
+ * roms of `system`, or of every system if it is NULL
+ */
+int db_index_find_crc(const struct DBIndex* idx, const char* system,
+                      uint64_t size, uint32_t crc, char* game_name,
+                      size_t max_len) {
+    struct RomScope scope;
+    size_t first;
+    size_t end;
+
+    find_dump(idx, system, size, crc, &scope, &first, &end);
+    return count_roms(idx, &scope, first, end, game_name, max_len);
+}
+
+/*
+ * Collects the games, as name offsets, that list a rom of this size, crc
+ * and sha1 among the roms of `system`. Returns how many there are, even
+ * when only the first `max_games` fit.
+ */
+int db_index_find_games(const struct DBIndex* idx, const char* system,
+                        uint64_t size, uint32_t crc,
+                        const unsigned char* sha1, uint32_t* games,
+                        size_t max_games) {
+    const struct DBIndexEntry* entry;
+    struct RomScope scope;
+    size_t first;
+    size_t end;
+    size_t i;
+    size_t j;
+    size_t count = 0;
+
+    find_dump(idx, system, size, crc, &scope, &first, &end);
+    for (i = first; i < end; i++) {
+        entry = &idx->entries[scope.roms[i].entry];
+        if (memcmp(entry->sha1, sha1, DB_SHA1_SIZE) != 0) {
+            continue;
+        }
+
+        /* A game listing the same track twice still counts once */
+        for (j = first; j < i; j++) {
+            if (idx->entries[scope.roms[j].entry].name_offset ==
+                    entry->name_offset &&
+                memcmp(idx->entries[scope.roms[j].entry].sha1, sha1,
+                       DB_SHA1_SIZE) == 0) {
+                break;
+            }
+        }
+
+        if (j == i) {
+            if (count < max_games) {
+                games[count] = entry->name_offset;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Whether `game` lists a rom of this size, crc and sha1 */
+int db_index_has_game(const struct DBIndex* idx, const char* system,
+                      uint64_t size, uint32_t crc, const unsigned char* sha1,
+                      uint32_t game) {
+    const struct DBIndexEntry* entry;
+    struct RomScope scope;
+    size_t first;
+    size_t end;
+    size_t i;
+
+    find_dump(idx, system, size, crc, &scope, &first, &end);
+    for (i = first; i < end; i++) {
+        entry = &idx->entries[scope.roms[i].entry];
+        if (entry->name_offset == game &&
+            memcmp(entry->sha1, sha1, DB_SHA1_SIZE) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* The name of a game db_index_find_games returned */
+int db_index_game_name(const struct DBIndex* idx, uint32_t game,
+                       char* game_name, size_t max_len) {
+    return copy_name(idx, game, game_name, max_len);
+}
+
+/* Returns the number of distinct dumps of this size, like db_index_find_crc */
+int db_index_find_size(const struct DBIndex* idx, const char* system,
+                       uint64_t size, char* game_name, size_t max_len) {
+    struct RomScope scope;
+    size_t first;
+    size_t end;
+
+    rom_scope(idx, system, &scope);
+    first = lower_bound_rom(&scope, size, 0);
+    end = size < UINT64_MAX ? lower_bound_rom(&scope, size + 1, 0)
+                            : scope.count;
+
+    return count_roms(idx, &scope, first, end, game_name, max_len);
+}
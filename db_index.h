@@ -0,0 +1,92 @@
+#ifndef _DB_INDEX_H_
+#define _DB_INDEX_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#define DB_INDEX_PATH "db/index.bin"
+#define DB_SHA1_SIZE 20
+#define DB_SYSTEM_LEN 32
+#define DB_DIR_LEN 16
+
+/* Flags of db_index_open */
+#define DB_INDEX_ALLOW_STALE 1
+
+struct DBIndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dat_count;
+    uint32_t entry_count;
+    uint32_t roms_offset;
+    uint32_t names_offset;
+    uint32_t names_len;
+    uint32_t sources_offset;
+    uint32_t entries_offset;
+    /* The roms again, grouped by source, then sorted like roms */
+    uint32_t system_roms_offset;
+};
+
+/* The DAT each shard of the index was built from */
+struct DBIndexSource {
+    char system[DB_SYSTEM_LEN];
+    /* db or cddb, which both have DATs named after the system */
+    char dir[DB_DIR_LEN];
+    uint64_t size;
+    uint64_t mtime_ns;
+    /* The block of the grouped roms, shared by the DATs of one system */
+    uint32_t rom_first;
+    uint32_t rom_count;
+};
+
+struct DBIndexEntry {
+    unsigned char sha1[DB_SHA1_SIZE];
+    uint32_t name_offset;
+};
+
+/* Roms sorted by (size, crc), pointing back into the sha1 sorted entries */
+struct DBIndexRom {
+    uint64_t size;
+    uint32_t crc;
+    uint32_t entry;
+};
+
+struct DBIndex {
+    void* map;
+    size_t map_len;
+    /* Embedded tables are not unmapped */
+    int mapped;
+    const struct DBIndexHeader* header;
+    const struct DBIndexEntry* entries;
+    const struct DBIndexSource* sources;
+    const struct DBIndexRom* roms;
+    const struct DBIndexRom* system_roms;
+    const char* names;
+};
+
+int db_index_build(const char* index_path);
+int db_index_update(const char* index_path);
+int db_index_open(struct DBIndex* idx, const char* index_path, int flags);
+int db_index_open_static(struct DBIndex* idx, const void* data, size_t len);
+void db_index_close(struct DBIndex* idx);
+int db_index_find_sha1(const struct DBIndex* idx,
+                       const unsigned char* sha1,
+                       char* game_name, size_t max_len);
+int db_index_find_crc(const struct DBIndex* idx, const char* system,
+                      uint64_t size, uint32_t crc, char* game_name,
+                      size_t max_len);
+int db_index_find_games(const struct DBIndex* idx, const char* system,
+                        uint64_t size, uint32_t crc,
+                        const unsigned char* sha1, uint32_t* games,
+                        size_t max_games);
+int db_index_has_game(const struct DBIndex* idx, const char* system,
+                      uint64_t size, uint32_t crc, const unsigned char* sha1,
+                      uint32_t game);
+int db_index_game_name(const struct DBIndex* idx, uint32_t game,
+                       char* game_name, size_t max_len);
+int db_index_find_size(const struct DBIndex* idx, const char* system,
+                       uint64_t size, char* game_name, size_t max_len);
+int db_parse_hex(const char* hex, size_t hex_len,
+                 unsigned char* out, size_t out_len);
+void db_format_hex(const unsigned char* data, size_t len, char* out);
+
+#endif
@@ -0,0 +1,780 @@
+#include "detect.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include "sha1.h"
+#include "crc32.h"
+#include "parser.h"
+#include "cd_detect.h"
+#include "rom_reader.h"
+#include "detect_cache.h"
+#include "run_info.h"
+#include "embedded.h"
+#include "trace.h"
+#include "core_prefetch.h"
+
+#include "log.h"
+
+#define SHA1_LEN 40
+#define HASH_LEN SHA1_LEN
+
+static int find_hash(struct Tokenizer* t, const char* hash, char* game_name,
+                     size_t max_len) {
+    struct Token name;
+    struct Token token;
+    while (1) {
+        if (find_token(t, "game") < 0) {
+            return -1;
+        }
+
+        if (find_token(t, "name") < 0) {
+            return -1;
+        }
+
+        if (get_token(t, &name) <= 0) {
+            return -1;
+        }
+
+        if (find_token(t, "sha1") < 0) {
+            return -1;
+        }
+
+        if (get_token(t, &token) <= 0) {
+            return -1;
+        }
+
+        if (token_case_equals(&token, hash)) {
+            token_copy(&name, game_name, max_len);
+            return 0;
+        }
+    }
+}
+
+static int scan_dat_file(const char* dat_path, const char* hash,
+                         char* game_name, size_t max_len) {
+    struct Tokenizer t;
+    const char* dat_name;
+    int offs;
+    int rv;
+
+    dat_name = strrchr(dat_path, '/');
+    dat_name = dat_name ? dat_name + 1 : dat_path;
+    offs = strchr(dat_name, '.') - dat_name + 1;
+    memcpy(game_name, dat_name, offs);
+
+    if (tokenizer_open(&t, dat_path) < 0) {
+        return -1;
+    }
+
+    rv = find_hash(&t, hash, game_name + offs, max_len - offs);
+    tokenizer_close(&t);
+    return rv;
+}
+
+/* The DAT of the system the rom looks like is searched first */
+static int scan_dat_files(const char* hash, const char* system,
+                          char* game_name, size_t max_len) {
+    // TODO: Error handling
+    int i;
+    char first_path[PATH_MAX];
+    glob_t glb;
+
+    if (system != NULL) {
+        snprintf(first_path, PATH_MAX, "db/%s.dat", system);
+        if (scan_dat_file(first_path, hash, game_name, max_len) == 0) {
+            return 0;
+        }
+    }
+
+    glob("db/*.dat", GLOB_NOSORT, NULL, &glb);
+    for (i = 0; i < glb.gl_pathc; i++) {
+        if (system != NULL && strcmp(glb.gl_pathv[i], first_path) == 0) {
+            continue;
+        }
+
+        if (scan_dat_file(glb.gl_pathv[i], hash, game_name, max_len) == 0) {
+            globfree(&glb);
+            return 0;
+        }
+    }
+    globfree(&glb);
+    return -1;
+}
+
+#define HASH_CRC32 0x1
+#define HASH_SHA1 0x2
+
+/* The whole file and, for headered dumps, the payload after the header */
+#define ROM_MAX_VARIANTS 2
+
+/* iNES and fwNES headers */
+#define NES_HEADER_LEN 16
+/* Copier headers in front of SNES and Mega Drive dumps */
+#define COPIER_HEADER_LEN 512
+
+struct RomVariant {
+    /* Bytes of the file left out of this variant */
+    size_t skip;
+    uint64_t size;
+    uint32_t crc;
+    unsigned char sha1[DB_SHA1_SIZE];
+};
+
+struct RomHashes {
+    /* Which of the hashes below are filled in */
+    int which;
+    size_t count;
+    struct RomVariant variants[ROM_MAX_VARIANTS];
+};
+
+/*
+ * DATs mostly list dumps without the header emulators and copiers put in
+ * front of them, so those are looked up both with and without it.
+ */
+static size_t rom_header_len(struct RomReader* r) {
+    const unsigned char* data;
+    ssize_t len;
+
+    if (r->size > COPIER_HEADER_LEN && r->size % 1024 == COPIER_HEADER_LEN) {
+        return COPIER_HEADER_LEN;
+    }
+
+    len = rom_reader_peek(r, NES_HEADER_LEN, &data);
+    if (len >= NES_HEADER_LEN && (memcmp(data, "NES\x1a", 4) == 0 ||
+                                  memcmp(data, "FDS\x1a", 4) == 0)) {
+        return NES_HEADER_LEN;
+    }
+
+    return 0;
+}
+
+/* Enough for the SNES HiROM header behind a copier header */
+#define CART_PROBE_LEN (0x10000 + COPIER_HEADER_LEN)
+
+struct CartMagic {
+    char* system_name;
+    size_t offset;
+    char* magic;
+    size_t len;
+    /* Tells apart systems sharing a header, given the matched bytes */
+    char* (*refine)(const unsigned char* header, size_t len);
+};
+
+/* Color games flag it at 0x143, just after the title */
+static char* gb_or_gbc(const unsigned char* header, size_t len) {
+    return len > 0x3f && (header[0x3f] & 0x80) ? "gbc" : "gb";
+}
+
+/* The high nibble of the last byte of the SEGA header is the region */
+static char* sms_or_gg(const unsigned char* header, size_t len) {
+    int region = len > 0xf ? header[0xf] >> 4 : 0;
+    return region >= 5 && region <= 7 ? "gg" : "sms";
+}
+
+static struct CartMagic CART_MAGIC[] = {
+    {"nes", 0, "NES\x1a", 4, NULL},
+    /* The start of the Nintendo logo every cartridge boots with */
+    {"gba", 0x04, "\x24\xff\xae\x51\x69\x9a\xa2\x21\x3d\x84\x82\x0a", 12,
+     NULL},
+    {"gb", 0x104, "\xce\xed\x66\x66\xcc\x0d\x00\x0b\x03\x73\x00\x83", 12,
+     gb_or_gbc},
+    {"smd", 0x100, "SEGA", 4, NULL},
+    {"sms", 0x7ff0, "TMR SEGA", 8, sms_or_gg},
+    {"sms", 0x3ff0, "TMR SEGA", 8, sms_or_gg},
+    {"sms", 0x1ff0, "TMR SEGA", 8, sms_or_gg},
+    {NULL, 0, NULL, 0, NULL}
+};
+
+/* LoROM and HiROM headers end with a checksum and its complement */
+static int is_snes_header(const unsigned char* data, size_t len,
+                          size_t offset) {
+    const unsigned char* c;
+
+    if (offset + 0x20 > len) {
+        return 0;
+    }
+
+    c = data + offset + 0x1c;
+    return (uint16_t)((c[0] | c[1] << 8) + (c[2] | c[3] << 8)) == 0xffff &&
+           (c[0] | c[1]) != 0;
+}
+
+static char* match_cart_header(const unsigned char* data, size_t len) {
+    const struct CartMagic* m;
+
+    for (m = CART_MAGIC; m->system_name != NULL; m++) {
+        if (m->offset + m->len <= len &&
+            memcmp(data + m->offset, m->magic, m->len) == 0) {
+            return m->refine ? m->refine(data + m->offset, len - m->offset)
+                             : m->system_name;
+        }
+    }
+
+    if (is_snes_header(data, len, 0x7fc0) ||
+        is_snes_header(data, len, 0xffc0)) {
+        return "snes";
+    }
+
+    return NULL;
+}
+
+/*
+ * Guesses the system from the cartridge header, so lookups can go to that
+ * system's roms first. Only the first CART_PROBE_LEN bytes are read, and
+ * a compressed rom is not inflated past its first chunk.
+ */
+static char* probe_cart_system(struct RomReader* r, size_t header_len) {
+    const unsigned char* data;
+    char* system;
+    ssize_t len;
+
+    if ((len = rom_reader_peek(r, CART_PROBE_LEN, &data)) <= 0) {
+        return NULL;
+    }
+
+    system = match_cart_header(data, len);
+    if (system == NULL && header_len == COPIER_HEADER_LEN &&
+        len > COPIER_HEADER_LEN) {
+        system = match_cart_header(data + COPIER_HEADER_LEN,
+                                   len - COPIER_HEADER_LEN);
+    }
+
+    return system;
+}
+
+static void rom_hashes_init(struct RomReader* r, struct RomHashes* hashes) {
+    size_t header_len = rom_header_len(r);
+
+    memset(hashes, 0, sizeof(*hashes));
+    hashes->count = 1;
+    hashes->variants[0].size = r->size;
+    if (header_len > 0) {
+        LOG_DEBUG("Found a %zu byte header", header_len);
+        hashes->variants[1].skip = header_len;
+        hashes->variants[1].size = r->size - header_len;
+        hashes->count = 2;
+    }
+}
+
+/* Reads the rom once from the start, computing the hashes selected by
+ * `which` for every variant. Hashes computed before are kept. */
+static int hash_rom_pass(struct RomReader* r, int which,
+                         struct RomHashes* hashes) {
+    SHA1Context sha[ROM_MAX_VARIANTS];
+    struct RomVariant* v;
+    const unsigned char* data;
+    uint64_t pos = 0;
+    size_t skip;
+    size_t i;
+    ssize_t rv;
+
+    if ((rv = rom_reader_rewind(r)) < 0) {
+        return rv;
+    }
+
+    hashes->which &= ~which;
+    for (i = 0; i < hashes->count; i++) {
+        SHA1Reset(&sha[i]);
+        hashes->variants[i].size = 0;
+        if (which & HASH_CRC32) {
+            hashes->variants[i].crc = 0;
+        }
+    }
+
+    while ((rv = rom_reader_next(r, &data)) > 0) {
+        for (i = 0; i < hashes->count; i++) {
+            v = &hashes->variants[i];
+            skip = pos < v->skip ? v->skip - pos : 0;
+            if (skip >= (size_t)rv) {
+                continue;
+            }
+
+            v->size += rv - skip;
+            if (which & HASH_CRC32) {
+                v->crc = crc32_update(v->crc, data + skip, rv - skip);
+            }
+
+            if (which & HASH_SHA1) {
+                SHA1Input(&sha[i], data + skip, rv - skip);
+            }
+        }
+        pos += rv;
+    }
+
+    if (rv < 0) {
+        return rv;
+    }
+
+    for (i = 0; i < hashes->count; i++) {
+        if ((which & HASH_SHA1) &&
+            !SHA1ResultBinary(&sha[i], hashes->variants[i].sha1)) {
+            return -EINVAL;
+        }
+    }
+
+    hashes->which |= which;
+    return 0;
+}
+
+static int hash_rom(struct RomReader* r, int which, struct RomHashes* hashes) {
+    struct TraceSpan span;
+    int rv;
+
+    TRACE_BEGIN(&span, TRACE_HASH_ROM);
+    rv = hash_rom_pass(r, which, hashes);
+    TRACE_END(&span);
+    return rv;
+}
+
+/*
+ * Zips list the size and crc of every file they hold, so any of them that
+ * is known settles the lookup without inflating anything. Returns the
+ * number of dumps matching the best member, like db_index_find_crc.
+ */
+static int find_zip_member(const struct DBIndex* idx, const char* system,
+                           const struct RomReader* r, char* game_name,
+                           size_t max_len) {
+    const struct RomMember* member;
+    int best = 0;
+    int rv;
+    size_t i;
+
+    for (i = 0; i < r->member_count; i++) {
+        member = &r->members[i];
+        rv = db_index_find_crc(idx, system, member->size, member->crc,
+                               game_name, max_len);
+        if (rv == 1) {
+            LOG_DEBUG("Found zipped rom with size %llu and crc %08X",
+                      (unsigned long long)member->size, member->crc);
+            return 1;
+        }
+
+        if (rv > best) {
+            best = rv;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Looks the rom up among the roms of `system`, or of every system if it
+ * is NULL. Hashes already in `hashes` are reused, so a second lookup in a
+ * wider scope does not read the rom again.
+ */
+static int find_rom_in_index(const struct DBIndex* idx, int strict_verify,
+                             const char* system, struct RomReader* r,
+                             struct RomHashes* hashes, char* game_name,
+                             size_t max_len) {
+    struct RomVariant* v;
+    int size_hits[ROM_MAX_VARIANTS];
+    int which = HASH_CRC32;
+    int candidates = 0;
+    int shared = 0;
+    size_t i;
+    int rv;
+
+    if (!strict_verify && r->member_count > 1 &&
+        find_zip_member(idx, system, r, game_name, max_len) == 1) {
+        return 0;
+    }
+
+    /* Sizes no DAT knows about need no hashing at all. A size only one
+     * dump has still needs its crc, any file could be that long. */
+    for (i = 0; i < hashes->count; i++) {
+        v = &hashes->variants[i];
+        size_hits[i] = db_index_find_size(idx, system, v->size, game_name,
+                                          max_len);
+        LOG_DEBUG("%d roms with size %llu", size_hits[i],
+                  (unsigned long long)v->size);
+        if (size_hits[i] > 0) {
+            candidates++;
+        }
+    }
+
+    if (candidates == 0) {
+        return -ENOENT;
+    }
+
+    if (!strict_verify) {
+        /* Inflating costs more than hashing, so never do it twice */
+        if (rom_reader_is_compressed(r)) {
+            which |= HASH_SHA1;
+        }
+
+        if (r->has_crc && hashes->count == 1) {
+            /* The container already knows it */
+            hashes->which |= HASH_CRC32;
+            hashes->variants[0].crc = r->crc;
+        } else if (!(hashes->which & HASH_CRC32) &&
+                   (rv = hash_rom(r, which, hashes)) < 0) {
+            return rv;
+        }
+
+        /* Headerless first, that is how DATs list them */
+        for (i = hashes->count; i-- > 0;) {
+            v = &hashes->variants[i];
+            if (size_hits[i] == 0) {
+                continue;
+            }
+
+            rv = db_index_find_crc(idx, system, v->size, v->crc, game_name,
+                                   max_len);
+            LOG_DEBUG("%d roms with size %llu and crc %08X", rv,
+                      (unsigned long long)v->size, v->crc);
+            if (rv == 1) {
+                return 0;
+            }
+
+            if (rv == 0) {
+                size_hits[i] = 0;
+            }
+            shared += rv;
+        }
+
+        if (shared == 0) {
+            return -ENOENT;
+        }
+
+        LOG_DEBUG("%d roms share a crc, confirming with sha1", shared);
+    }
+
+    if (!(hashes->which & HASH_SHA1) &&
+        (rv = hash_rom(r, HASH_SHA1, hashes)) < 0) {
+        return rv;
+    }
+
+    for (i = hashes->count; i-- > 0;) {
+        if (size_hits[i] > 0 &&
+            db_index_find_sha1(idx, hashes->variants[i].sha1, game_name,
+                               max_len) == 0) {
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+static char* suffix_system(const char* name);
+
+static int lookup_rom(const struct DetectContext* ctx, struct RomReader* r,
+                      char* game_name, size_t max_len) {
+    struct RomHashes hashes;
+    char hash[HASH_LEN + 1];
+    char* system;
+    size_t i;
+    int rv;
+
+    rom_hashes_init(r, &hashes);
+    system = probe_cart_system(r, hashes.variants[hashes.count - 1].skip);
+    if (system != NULL) {
+        LOG_DEBUG("Header looks like a %s rom", system);
+    }
+
+    /* Hashing is what takes long, the core loads in the meantime */
+    core_prefetch_system(system ? system : suffix_system(r->name));
+
+    if (ctx->has_index) {
+        /* A wrong guess only costs a second look at the index */
+        if (system != NULL) {
+            rv = find_rom_in_index(&ctx->index, ctx->strict, system, r,
+                                   &hashes, game_name, max_len);
+            if (rv != -ENOENT) {
+                return rv;
+            }
+            LOG_DEBUG("Not a known %s rom, trying every system", system);
+        }
+
+        return find_rom_in_index(&ctx->index, ctx->strict, NULL, r, &hashes,
+                                 game_name, max_len);
+    }
+
+    if ((rv = hash_rom(r, HASH_SHA1, &hashes)) < 0) {
+        return rv;
+    }
+
+    for (i = hashes.count; i-- > 0;) {
+        db_format_hex(hashes.variants[i].sha1, DB_SHA1_SIZE, hash);
+        if (scan_dat_files(hash, system, game_name, max_len) == 0) {
+            return 0;
+        }
+        LOG_DEBUG("Unknown rom with sha1 %s", hash);
+    }
+
+    return -ENOENT;
+}
+
+static int find_rom_canonical_name(const struct DetectContext* ctx,
+                                   struct RomReader* r, char* game_name,
+                                   size_t max_len) {
+    struct TraceSpan span;
+    int rv;
+
+    TRACE_BEGIN(&span, TRACE_ROM_LOOKUP);
+    rv = lookup_rom(ctx, r, game_name, max_len);
+    TRACE_END(&span);
+    return rv;
+}
+
+static char* SUFFIX_MATCH[] = {
+    ".nes", "nes",
+    ".gen", "smd",
+    ".smd", "smd",
+    ".bin", "smd",
+    ".sfc", "snes",
+    ".smc", "snes",
+    ".gg", "gg",
+    ".sms", "sms",
+    ".pce", "pce",
+    ".gba", "gba",
+    ".gb", "gb",
+    ".gbc", "gbc",
+    ".nds", "nds",
+    ".wsc", "wswan",
+    ".a26", "a26",
+    NULL
+};
+
+/* The system a rom's suffix stands for, or NULL */
+static char* suffix_system(const char* name) {
+    char* suffix = strrchr(name, '.');
+    char** tmp_suffix;
+
+    for (tmp_suffix = SUFFIX_MATCH; suffix && *tmp_suffix != NULL;
+         tmp_suffix += 2) {
+        if (strcasecmp(suffix, *tmp_suffix) == 0) {
+            return *(tmp_suffix + 1);
+        }
+    }
+
+    return NULL;
+}
+
+static int is_rom_name(const char* path) {
+    char* suffix = strrchr(path, '.');
+    char** tmp_suffix;
+
+    if (suffix == NULL) {
+        return 0;
+    }
+
+    for (tmp_suffix = SUFFIX_MATCH; *tmp_suffix != NULL; tmp_suffix += 2) {
+        if (strcasecmp(suffix, *tmp_suffix) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int detect_rom_game(const struct DetectContext* ctx,
+                           const char* path, char* game_name,
+                           size_t max_len) {
+    int rv;
+    struct RomReader r;
+    char* system;
+
+    if ((rv = rom_reader_open(&r, path, is_rom_name)) < 0) {
+        LOG_WARN("Could not open rom: %s", strerror(-rv));
+        return rv;
+    }
+
+    if ((rv = find_rom_canonical_name(ctx, &r, game_name, max_len)) < 0) {
+        if (rv != -ENOENT) {
+            LOG_WARN("Could not hash rom: %s", strerror(-rv));
+        }
+        LOG_DEBUG("Could not detect rom, guessing");
+
+        /* Guesses go by the name inside the archive */
+        rv = -EINVAL;
+        if ((system = suffix_system(r.name)) != NULL) {
+            snprintf(game_name, max_len, "%s.<unknown>", system);
+            rv = 0;
+        }
+    }
+
+    rom_reader_close(&r);
+    return rv;
+}
+
+static int is_cd_image(const char* path) {
+    size_t len = strlen(path);
+    return len >= 4 && ((strcasecmp(path + len - 4, ".cue") == 0) ||
+                        (strcasecmp(path + len - 4, ".m3u") == 0) ||
+                        (strcasecmp(path + len - 4, ".gdi") == 0));
+}
+
+int detect_game(const struct DetectContext* ctx, const char* path,
+                char* game_name, size_t max_len) {
+    struct TraceSpan span;
+    int rv;
+
+    TRACE_BEGIN(&span, TRACE_DETECT_GAME);
+    if (is_cd_image(path)) {
+        LOG_INFO("Starting CD game detection...");
+        rv = detect_cd_game(&ctx->ps1_ids,
+                            ctx->has_index ? &ctx->index : NULL, path,
+                            game_name, max_len);
+    } else {
+        LOG_INFO("Starting rom game detection...");
+        rv = detect_rom_game(ctx, path, game_name, max_len);
+    }
+    TRACE_END(&span);
+    return rv;
+}
+
+int detect_is_supported(const char* path) {
+    return is_cd_image(path) || is_rom_name(path) ||
+           rom_reader_is_archive(path);
+}
+
+int detect_external_db = 0;
+int detect_update_index = 0;
+
+/* Uses the tables built into the executable, all of them or none */
+static int open_embedded(struct DetectContext* ctx) {
+    const void* index;
+    const void* ps1_ids;
+    const void* rules;
+    size_t index_len;
+    size_t ps1_ids_len;
+    size_t rules_len;
+    int rv;
+
+    if ((rv = embedded_table(EMBEDDED_DB_INDEX, &index, &index_len)) < 0 ||
+        (rv = embedded_table(EMBEDDED_PS1_IDS, &ps1_ids,
+                             &ps1_ids_len)) < 0 ||
+        (rv = embedded_table(EMBEDDED_LAUNCH_RULES, &rules,
+                             &rules_len)) < 0) {
+        return rv;
+    }
+
+    if ((rv = db_index_open_static(&ctx->index, index, index_len)) < 0) {
+        goto fail;
+    }
+    ctx->has_index = 1;
+
+    if ((rv = cddb_open_static(&ctx->ps1_ids, ps1_ids, ps1_ids_len)) < 0 ||
+        (rv = launch_rules_open_static(&ctx->rules, rules, rules_len)) < 0) {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    LOG_WARN("Embedded tables are corrupt: %s", strerror(-rv));
+    detect_context_free(ctx);
+    return rv;
+}
+
+/*
+ * Loads the tables built into the executable when there are any, and
+ * db/, cddb/ and launch.conf otherwise or with detect_external_db set.
+ */
+int detect_context_init(struct DetectContext* ctx, int strict) {
+    struct TraceSpan span;
+    int rv;
+
+    TRACE_BEGIN(&span, TRACE_CONTEXT_INIT);
+    memset(ctx, 0, sizeof(*ctx));
+    if (!detect_external_db && open_embedded(ctx) == 0) {
+        LOG_DEBUG("Using embedded tables");
+        ctx->strict = strict;
+        TRACE_END(&span);
+        return 0;
+    }
+
+    ctx->strict = strict;
+    if ((rv = launch_rules_load(&ctx->rules, LAUNCH_CONF_PATH)) < 0) {
+        LOG_WARN("Could not load '%s': %s", LAUNCH_CONF_PATH, strerror(-rv));
+    }
+
+    if ((rv = cddb_open(&ctx->ps1_ids, CDDB_PS1_LIST, CDDB_PS1_INDEX)) < 0) {
+        LOG_DEBUG("PS1 id list unavailable: %s", strerror(-rv));
+    }
+
+    /* Only the shards of DATs that changed are parsed again */
+    if ((rv = db_index_open(&ctx->index, DB_INDEX_PATH, 0)) < 0 &&
+        detect_update_index && db_index_update(DB_INDEX_PATH) == 0) {
+        rv = db_index_open(&ctx->index, DB_INDEX_PATH, 0);
+    }
+
+    /* Launches never rebuild it, a stale index still beats the DATs */
+    if (rv == -ESTALE && (rv = db_index_open(&ctx->index, DB_INDEX_PATH,
+                                             DB_INDEX_ALLOW_STALE)) == 0) {
+        LOG_WARN("'%s' is out of date, run --rebuild-db", DB_INDEX_PATH);
+    }
+
+    if (rv < 0) {
+        LOG_DEBUG("DB index unavailable (%s), scanning DAT files",
+                  strerror(-rv));
+    } else {
+        ctx->has_index = 1;
+    }
+
+    TRACE_END(&span);
+    return 0;
+}
+
+void detect_context_free(struct DetectContext* ctx) {
+    if (ctx->has_index) {
+        db_index_close(&ctx->index);
+    }
+
+    launch_rules_free(&ctx->rules);
+    cddb_close(&ctx->ps1_ids);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int detect_resolve(const struct DetectContext* ctx, struct DetectCache* cache,
+                   const char* path, char* game_name, size_t max_len,
+                   struct RunInfo* info) {
+    struct DetectCacheKey key;
+    struct TraceSpan span;
+    int has_key;
+    int rv;
+
+    has_key = cache != NULL && cache->map != NULL &&
+              detect_cache_key(path, ctx->strict, &key) == 0;
+    if (has_key) {
+        TRACE_BEGIN(&span, TRACE_CACHE_LOOKUP);
+        rv = detect_cache_lookup(cache, &key, game_name, max_len, info);
+        TRACE_CACHE(rv == 0);
+        TRACE_END(&span);
+        if (rv == 0) {
+            LOG_DEBUG("Found '%s' in the detection cache", path);
+            return 1;
+        }
+    }
+
+    if ((rv = detect_game(ctx, path, game_name, max_len)) < 0) {
+        LOG_WARN("Could not detect game: %s", strerror(-rv));
+        return rv;
+    }
+
+    TRACE_BEGIN(&span, TRACE_RUN_INFO);
+    rv = get_run_info(&ctx->rules, info, game_name);
+    TRACE_END(&span);
+    if (rv < 0) {
+        LOG_WARN("Could not find sutable core for `%s`: %s", game_name,
+                 strerror(-rv));
+        return rv;
+    }
+
+    if (has_key) {
+        detect_cache_store(cache, &key, game_name, info);
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _DETECT_H_
+#define _DETECT_H_
+
+#include <unistd.h>
+
+#include "cddb.h"
+#include "db_index.h"
+#include "detect_cache.h"
+#include "run_info.h"
+
+/* State shared by every detection, loaded once per process */
+struct DetectContext {
+    struct DBIndex index;
+    int has_index;
+    struct LaunchRules rules;
+    struct CDDB ps1_ids;
+    int strict;
+};
+
+/* Load db/, cddb/ and launch.conf even when tables are embedded */
+extern int detect_external_db;
+
+/* Bring db/index.bin up to date when it is stale, only the daemon does */
+extern int detect_update_index;
+
+int detect_context_init(struct DetectContext* ctx, int strict);
+void detect_context_free(struct DetectContext* ctx);
+int detect_game(const struct DetectContext* ctx, const char* path,
+                char* game_name, size_t max_len);
+int detect_is_supported(const char* path);
+int detect_resolve(const struct DetectContext* ctx, struct DetectCache* cache,
+                   const char* path, char* game_name, size_t max_len,
+                   struct RunInfo* info);
+
+#endif
@@ -0,0 +1,357 @@
+#include "detect_cache.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "crc32.h"
+#include "detect.h"
+#include "embedded.h"
+#include "log.h"
+
+#define DETECT_CACHE_MAGIC "RLDC"
+#define DETECT_CACHE_VERSION 1
+#define DETECT_CACHE_SLOTS 4096
+#define DETECT_CACHE_MAX_PROBE 32
+
+/*
+ * Slots are claimed with a compare-and-swap from EMPTY to BUSY and published
+ * by a release store of READY once filled in. READY slots are never written
+ * again, so readers in other processes need no lock. A table is never
+ * cleared in place: when the databases change, or it fills up, a new file
+ * is renamed over it.
+ */
+#define SLOT_EMPTY 0
+#define SLOT_BUSY 1
+#define SLOT_READY 2
+
+/* Files whose changes invalidate every cached result */
+static const char* CACHE_DEPENDENCIES[] = {
+    "db/*.dat",
+    "cddb/*.idlst",
+    "cddb/*.dat",
+    "launch.conf",
+    NULL
+};
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* c = data;
+    while (len--) {
+        hash ^= *c++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t mtime_ns(const struct stat* st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* Tables detect_context_init() uses instead of the files above */
+static const int EMBEDDED_DEPENDENCIES[] = {
+    EMBEDDED_DB_INDEX,
+    EMBEDDED_PS1_IDS,
+    EMBEDDED_LAUNCH_RULES,
+};
+
+static pthread_once_t embedded_once = PTHREAD_ONCE_INIT;
+static uint64_t embedded_generation;
+static int has_embedded_generation;
+
+/* The blobs never change at runtime, so they are only hashed once */
+static void hash_embedded(void) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t stamp[2];
+    const void* data;
+    size_t len;
+    size_t i;
+
+    for (i = 0; i < sizeof(EMBEDDED_DEPENDENCIES) /
+                    sizeof(EMBEDDED_DEPENDENCIES[0]); i++) {
+        if (embedded_table(EMBEDDED_DEPENDENCIES[i], &data, &len) < 0) {
+            return;
+        }
+
+        stamp[0] = len;
+        stamp[1] = crc32_update(0, data, len);
+        hash = fnv1a(hash, stamp, sizeof(stamp));
+    }
+
+    embedded_generation = hash;
+    has_embedded_generation = 1;
+}
+
+/* Fingerprint of every file the detection results depend on */
+uint64_t detect_cache_generation(void) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint64_t stamp[3];
+    struct stat st;
+    glob_t glb;
+    const char** pattern;
+    size_t i;
+
+    if (!detect_external_db) {
+        pthread_once(&embedded_once, hash_embedded);
+        if (has_embedded_generation) {
+            return embedded_generation;
+        }
+    }
+
+    for (pattern = CACHE_DEPENDENCIES; *pattern != NULL; pattern++) {
+        if (glob(*pattern, 0, NULL, &glb) != 0) {
+            continue;
+        }
+
+        for (i = 0; i < glb.gl_pathc; i++) {
+            if (stat(glb.gl_pathv[i], &st) < 0) {
+                continue;
+            }
+
+            stamp[0] = st.st_ino;
+            stamp[1] = st.st_size;
+            stamp[2] = mtime_ns(&st);
+            hash = fnv1a(hash, glb.gl_pathv[i], strlen(glb.gl_pathv[i]));
+            hash = fnv1a(hash, stamp, sizeof(stamp));
+        }
+
+        globfree(&glb);
+    }
+
+    return hash;
+}
+
+static size_t cache_size(uint32_t slot_count) {
+    return sizeof(struct DetectCacheHeader) +
+           (size_t)slot_count * sizeof(struct DetectCacheSlot);
+}
+
+static int map_cache(struct DetectCache* cache, int fd, size_t len) {
+    cache->map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache->map == MAP_FAILED) {
+        cache->map = NULL;
+        return -errno;
+    }
+
+    cache->map_len = len;
+    cache->header = cache->map;
+    cache->slots = (struct DetectCacheSlot*)(cache->header + 1);
+    return 0;
+}
+
+static int create_cache(struct DetectCache* cache, const char* cache_path,
+                        uint64_t generation) {
+    char tmp_path[PATH_MAX];
+    char dir_path[PATH_MAX];
+    size_t len = cache_size(DETECT_CACHE_SLOTS);
+    int fd;
+    int rv;
+
+    strncpy(dir_path, cache_path, PATH_MAX - 1);
+    dir_path[PATH_MAX - 1] = '\0';
+    if (mkdir(dirname(dir_path), 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    snprintf(tmp_path, PATH_MAX, "%s.%d", cache_path, (int)getpid());
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    /* The file is sparse, untouched slots read as SLOT_EMPTY */
+    if (ftruncate(fd, len) < 0) {
+        rv = -errno;
+        goto fail;
+    }
+
+    if ((rv = map_cache(cache, fd, len)) < 0) {
+        goto fail;
+    }
+
+    memcpy(cache->header->magic, DETECT_CACHE_MAGIC,
+           sizeof(cache->header->magic));
+    cache->header->version = DETECT_CACHE_VERSION;
+    cache->header->generation = generation;
+    cache->header->slot_count = DETECT_CACHE_SLOTS;
+    cache->header->used = 0;
+
+    if (rename(tmp_path, cache_path) < 0) {
+        rv = -errno;
+        munmap(cache->map, cache->map_len);
+        cache->map = NULL;
+        goto fail;
+    }
+
+    close(fd);
+    return 0;
+
+fail:
+    unlink(tmp_path);
+    close(fd);
+    return rv;
+}
+
+int detect_cache_open(struct DetectCache* cache, const char* cache_path) {
+    const struct DetectCacheHeader* header;
+    uint64_t generation = detect_cache_generation();
+    struct stat st;
+    int fd;
+    int rv;
+
+    memset(cache, 0, sizeof(*cache));
+    fd = open(cache_path, O_RDWR);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            return -errno;
+        }
+        LOG_DEBUG("Creating detection cache '%s'", cache_path);
+        return create_cache(cache, cache_path, generation);
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rv = -errno;
+        close(fd);
+        return rv;
+    }
+
+    if (st.st_size < sizeof(*header) ||
+        (rv = map_cache(cache, fd, st.st_size)) < 0) {
+        close(fd);
+        return create_cache(cache, cache_path, generation);
+    }
+    close(fd);
+
+    header = cache->header;
+    if (memcmp(header->magic, DETECT_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == DETECT_CACHE_VERSION &&
+        cache_size(header->slot_count) == cache->map_len &&
+        header->generation == generation &&
+        __atomic_load_n(&header->used, __ATOMIC_RELAXED) <
+            header->slot_count / 4 * 3) {
+        return 0;
+    }
+
+    LOG_DEBUG("Detection cache is out of date, recreating");
+    detect_cache_close(cache);
+    return create_cache(cache, cache_path, generation);
+}
+
+void detect_cache_close(struct DetectCache* cache) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_len);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+}
+
+int detect_cache_key(const char* path, uint32_t flags,
+                     struct DetectCacheKey* key) {
+    struct stat st;
+    size_t len = strlen(path);
+
+    if (len >= DETECT_CACHE_PATH_LEN) {
+        return -ENAMETOOLONG;
+    }
+
+    if (stat(path, &st) < 0) {
+        return -errno;
+    }
+
+    memset(key, 0, sizeof(*key));
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_ns = mtime_ns(&st);
+    key->path_hash = fnv1a(0xcbf29ce484222325ULL, path, len);
+    key->flags = flags;
+    memcpy(key->path, path, len);
+    return 0;
+}
+
+static uint32_t key_slot(const struct DetectCache* cache,
+                         const struct DetectCacheKey* key) {
+    uint64_t hash = fnv1a(key->path_hash, &key->ino, sizeof(key->ino));
+    return hash % cache->header->slot_count;
+}
+
+int detect_cache_lookup(const struct DetectCache* cache,
+                        const struct DetectCacheKey* key,
+                        char* game_name, size_t max_len,
+                        struct RunInfo* info) {
+    const struct DetectCacheSlot* slot;
+    uint32_t i = key_slot(cache, key);
+    int probe;
+
+    if (cache->map == NULL) {
+        return -ENOENT;
+    }
+
+    for (probe = 0; probe < DETECT_CACHE_MAX_PROBE; probe++) {
+        slot = &cache->slots[i];
+        switch (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) {
+            case SLOT_EMPTY:
+                return -ENOENT;
+            case SLOT_READY:
+                if (memcmp(&slot->key, key, sizeof(*key)) == 0) {
+                    strncpy(game_name, slot->game_name, max_len - 1);
+                    game_name[max_len - 1] = '\0';
+                    *info = slot->info;
+                    return 0;
+                }
+                break;
+        }
+
+        i = (i + 1) % cache->header->slot_count;
+    }
+
+    return -ENOENT;
+}
+
+int detect_cache_store(struct DetectCache* cache,
+                       const struct DetectCacheKey* key,
+                       const char* game_name, const struct RunInfo* info) {
+    struct DetectCacheSlot* slot;
+    uint32_t i = key_slot(cache, key);
+    uint32_t expected;
+    int probe;
+
+    if (cache->map == NULL) {
+        return -ENOENT;
+    }
+
+    for (probe = 0; probe < DETECT_CACHE_MAX_PROBE; probe++) {
+        slot = &cache->slots[i];
+        expected = SLOT_EMPTY;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, SLOT_BUSY,
+                                        0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE)) {
+            slot->key = *key;
+            strncpy(slot->game_name, game_name, DETECT_CACHE_NAME_LEN - 1);
+            slot->game_name[DETECT_CACHE_NAME_LEN - 1] = '\0';
+            slot->info = *info;
+            __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+            __atomic_add_fetch(&cache->header->used, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        if (expected == SLOT_READY &&
+            memcmp(&slot->key, key, sizeof(*key)) == 0) {
+            /* Another launcher got there first */
+            return 0;
+        }
+
+        i = (i + 1) % cache->header->slot_count;
+    }
+
+    return -ENOSPC;
+}
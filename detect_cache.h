@@ -0,0 +1,59 @@
+#ifndef _DETECT_CACHE_H_
+#define _DETECT_CACHE_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "run_info.h"
+
+#define DETECT_CACHE_PATH "cache/detect.cache"
+#define DETECT_CACHE_PATH_LEN 256
+#define DETECT_CACHE_NAME_LEN 256
+
+struct DetectCacheKey {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t path_hash;
+    uint32_t flags;
+    char path[DETECT_CACHE_PATH_LEN];
+};
+
+struct DetectCacheSlot {
+    uint32_t state;
+    uint32_t reserved;
+    struct DetectCacheKey key;
+    char game_name[DETECT_CACHE_NAME_LEN];
+    struct RunInfo info;
+};
+
+struct DetectCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t generation;
+    uint32_t slot_count;
+    uint32_t used;
+};
+
+struct DetectCache {
+    void* map;
+    size_t map_len;
+    struct DetectCacheHeader* header;
+    struct DetectCacheSlot* slots;
+};
+
+uint64_t detect_cache_generation(void);
+int detect_cache_open(struct DetectCache* cache, const char* cache_path);
+void detect_cache_close(struct DetectCache* cache);
+int detect_cache_key(const char* path, uint32_t flags,
+                     struct DetectCacheKey* key);
+int detect_cache_lookup(const struct DetectCache* cache,
+                        const struct DetectCacheKey* key,
+                        char* game_name, size_t max_len,
+                        struct RunInfo* info);
+int detect_cache_store(struct DetectCache* cache,
+                       const struct DetectCacheKey* key,
+                       const char* game_name, const struct RunInfo* info);
+
+#endif
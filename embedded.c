@@ -0,0 +1,45 @@
+#include "embedded.h"
+
+#include <errno.h>
+#include <stddef.h>
+
+/*
+ * Defined by tables.S, which is only linked in when the tables are
+ * embedded. Otherwise the weak references resolve to NULL.
+ */
+extern const unsigned char embedded_db_index[] __attribute__((weak));
+extern const unsigned char embedded_db_index_end[] __attribute__((weak));
+extern const unsigned char embedded_ps1_ids[] __attribute__((weak));
+extern const unsigned char embedded_ps1_ids_end[] __attribute__((weak));
+extern const unsigned char embedded_launch_rules[] __attribute__((weak));
+extern const unsigned char embedded_launch_rules_end[] __attribute__((weak));
+
+int embedded_table(int which, const void** data, size_t* len) {
+    const unsigned char* start;
+    const unsigned char* end;
+
+    switch (which) {
+        case EMBEDDED_DB_INDEX:
+            start = embedded_db_index;
+            end = embedded_db_index_end;
+            break;
+        case EMBEDDED_PS1_IDS:
+            start = embedded_ps1_ids;
+            end = embedded_ps1_ids_end;
+            break;
+        case EMBEDDED_LAUNCH_RULES:
+            start = embedded_launch_rules;
+            end = embedded_launch_rules_end;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (start == NULL || end == NULL) {
+        return -ENOENT;
+    }
+
+    *data = start;
+    *len = end - start;
+    return 0;
+}
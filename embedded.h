@@ -0,0 +1,15 @@
+#ifndef _EMBEDDED_H_
+#define _EMBEDDED_H_
+
+#include <unistd.h>
+
+/* Tables compiled into the executable by make EMBED_TABLES=1 */
+#define EMBEDDED_DB_INDEX 0
+#define EMBEDDED_PS1_IDS 1
+#define EMBEDDED_LAUNCH_RULES 2
+
+#define EMBEDDED_DIR "tables"
+
+int embedded_table(int which, const void** data, size_t* len);
+
+#endif
@@ -0,0 +1,70 @@
+#include "log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Longer messages are cut short */
+#define LOG_BUFF_LEN 1024
+
+int log_level = LOG_LEVEL_DEBUG;
+
+static const char* LEVEL_NAMES[] = {
+    "debug",
+    "info",
+    "warning",
+    "none",
+    NULL
+};
+
+/* Formatted here so every message goes out in one write */
+static __thread char buff[LOG_BUFF_LEN];
+
+int log_parse_level(const char* name) {
+    int i;
+
+    for (i = 0; LEVEL_NAMES[i] != NULL; i++) {
+        if (strcasecmp(name, LEVEL_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+
+    /* "warn" is what LOG_WARN calls it */
+    if (strcasecmp(name, "warn") == 0) {
+        return LOG_LEVEL_WARN;
+    }
+
+    return -EINVAL;
+}
+
+void log_init(void) {
+    const char* env = getenv(LOG_ENV);
+    int level;
+
+    if (env != NULL && (level = log_parse_level(env)) >= 0) {
+        log_level = level;
+    }
+}
+
+void log_write(int fd, const char* level, const char* file, int line,
+               const char* msg, ...) {
+    va_list args;
+    size_t len;
+    int rv;
+
+    rv = snprintf(buff, LOG_BUFF_LEN, "%s::%s+%d::", level, file, line);
+    len = rv < 0 ? 0 : (size_t)rv < LOG_BUFF_LEN ? (size_t)rv
+                                                  : LOG_BUFF_LEN - 1;
+
+    va_start(args, msg);
+    rv = vsnprintf(buff + len, LOG_BUFF_LEN - len, msg, args);
+    va_end(args);
+    len += rv < 0 ? 0 : (size_t)rv < LOG_BUFF_LEN - len ? (size_t)rv
+                                                        : LOG_BUFF_LEN - 1 - len;
+
+    buff[len++] = '\n';
+    while (write(fd, buff, len) < 0 && errno == EINTR);
+}
@@ -1,6 +1,41 @@
-#include <stdio.h>
+#ifndef _LOG_H_
+#define _LOG_H_
 
-#define LOG(stream, level, msg, ...) fprintf(stream, "%s::%s+%d::", level, __FILE__, __LINE__); fprintf(stream, msg, ##__VA_ARGS__); fprintf(stream, "\n")
-#define LOG_DEBUG(msg, ...) LOG(stderr, "DEBUG", msg, ##__VA_ARGS__)
-#define LOG_WARN(msg, ...) LOG(stderr, "WARNING", msg, ##__VA_ARGS__)
-#define LOG_INFO(msg, ...) LOG(stdout, "INFO", msg, ##__VA_ARGS__)
+#include <unistd.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_NONE 3
+
+/* Messages below this level are not compiled in at all */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_ENV "RETROLAUNCH_LOG"
+
+/* Messages below this level are skipped at runtime */
+extern int log_level;
+
+void log_init(void);
+int log_parse_level(const char* name);
+void log_write(int fd, const char* level, const char* file, int line,
+               const char* msg, ...)
+    __attribute__((format(printf, 5, 6)));
+
+#define LOG(fd, level, name, msg, ...) \
+    do { \
+        if ((level) >= LOG_COMPILE_LEVEL && (level) >= log_level) { \
+            log_write(fd, name, __FILE__, __LINE__, msg, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(msg, ...) \
+    LOG(STDERR_FILENO, LOG_LEVEL_DEBUG, "DEBUG", msg, ##__VA_ARGS__)
+#define LOG_WARN(msg, ...) \
+    LOG(STDERR_FILENO, LOG_LEVEL_WARN, "WARNING", msg, ##__VA_ARGS__)
+#define LOG_INFO(msg, ...) \
+    LOG(STDOUT_FILENO, LOG_LEVEL_INFO, "INFO", msg, ##__VA_ARGS__)
+
+#endif
@@ -10,286 +10,321 @@
 #include <libgen.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <stdint.h>
+#include <getopt.h>
 
 #include "sha1.h"
+#include "crc32.h"
 #include "parser.h"
-#include "cd_detect.h"
+#include "db_index.h"
+#include "cddb.h"
+#include "detect.h"
+#include "detect_cache.h"
+#include "run_info.h"
+#include "scan.h"
+#include "daemon.h"
+#include "trace.h"
+#include "core_prefetch.h"
+#include "alloc_stats.h"
+#include "arena.h"
 
 #include "log.h"
 
-#define SHA1_LEN 40
-#define HASH_LEN SHA1_LEN
+/* Always confirm identification with a full SHA-1 */
+static int strict_verify = 0;
+static int use_cache = 1;
+static int use_daemon = 1;
 
-static int find_hash(int fd, const char* hash, char* game_name, size_t max_len) {
-    ssize_t rv;
-    char token[MAX_TOKEN_LEN];
-    while (1) {
-        if (find_token(fd, "game") < 0) {
-            return -1;
-        }
-
-        if (find_token(fd, "name") < 0) {
-            return -1;
-        }
+static int run_retroarch(const char* path, const struct RunInfo* info) {
+    char core_path[PATH_MAX];
+    sprintf(core_path, CORE_PATH_FORMAT, info->core);
+    char* retro_argv[30] = {"retroarch",
+                          "-L", core_path};
+    int argi = 3;
+    if (info->multitap) {
+        retro_argv[argi] = "-4";
+        argi++;
+        LOG_INFO("Game supports multitap");
+    }
 
-        if (get_token(fd, game_name, max_len) < 0) {
-            return -1;
-        }
+    if (info->dualanalog) {
+        retro_argv[argi] = "-A";
+        argi ++;
+        retro_argv[argi] = "1";
+        argi ++;
+        retro_argv[argi] = "-A";
+        argi ++;
+        retro_argv[argi] = "2";
+        argi ++;
+        LOG_INFO("Game supports the dualshock controller");
+    }
 
-        if (find_token(fd, "sha1") < 0) {
-            return -1;
-        }
+    retro_argv[argi] = (char*)path;
+    argi ++;
+    retro_argv[argi] = NULL;
+    /* exec skips the exit handlers */
+    trace_flush();
+    execvp(retro_argv[0], retro_argv);
+    return -errno;
+}
 
-        if (get_token(fd, token, MAX_TOKEN_LEN) < 0) {
-            return -1;
-        }
+static const struct option OPTIONS[] = {
+    {"build-index", no_argument, NULL, 'b'},
+    {"rebuild-db", no_argument, NULL, 'r'},
+    {"strict", no_argument, NULL, 's'},
+    {"no-cache", no_argument, NULL, 'n'},
+    {"scan", required_argument, NULL, 'S'},
+    {"catalog", required_argument, NULL, 'c'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"daemon", no_argument, NULL, 'd'},
+    {"no-daemon", no_argument, NULL, 'D'},
+    {"identify", no_argument, NULL, 'i'},
+    {"trace", required_argument, NULL, 't'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"build-tables", required_argument, NULL, 'T'},
+    {"external-db", no_argument, NULL, 'e'},
+    {NULL, 0, NULL, 0}
+};
 
-        if (strcasecmp(hash, token) == 0) {
-            return 0;
-        }
-    }
-}
+static void open_cache(struct DetectCache* cache) {
+    int rv;
 
-static int find_rom_canonical_name(const char* hash, char* game_name,
-                                   size_t max_len) {
-    // TODO: Error handling
-    int i;
-    int fd;
-    int offs;
-    char* dat_path;
-    char* dat_name;
-    glob_t glb;
-    glob("db/*.dat", GLOB_NOSORT, NULL, &glb);
-    for (i = 0; i < glb.gl_pathc; i++) {
-        dat_path = glb.gl_pathv[i];
-        dat_name = basename(dat_path);
-        offs = strchr(dat_name, '.') - dat_name + 1;
-        memcpy(game_name, dat_name, offs);
-
-        fd = open(dat_path, O_RDONLY);
-        if (find_hash(fd, hash, game_name + offs,
-                      max_len - offs) == 0) {
-            close(fd);
-            return 0;
+    if (!use_cache || (rv = detect_cache_open(cache, DETECT_CACHE_PATH)) < 0) {
+        if (use_cache) {
+            LOG_DEBUG("Detection cache unavailable: %s", strerror(-rv));
         }
-
-        close(fd);
+        memset(cache, 0, sizeof(*cache));
     }
-    return -1;
 }
 
-static int get_sha1(const char* path, char* result) {
-    int fd;
+/* Writes the tables make EMBED_TABLES=1 compiles in */
+static int build_tables(const char* dir) {
+    struct LaunchRules rules;
+    char path[PATH_MAX];
     int rv;
-    int buff_len = 4096;
-    char buff[buff_len];
-    SHA1Context sha;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        return -errno;
+    snprintf(path, PATH_MAX, "%s/index.bin", dir);
+    if ((rv = db_index_build(path)) < 0) {
+        return rv;
     }
 
-    SHA1Reset(&sha);
-    rv = 1;
-    while (rv > 0) {
-        rv = read(fd, buff, buff_len);
-        if (rv < 0) {
-            close(fd);
-            return -errno;
-        }
+    snprintf(path, PATH_MAX, "%s/ps1.idx", dir);
+    if ((rv = cddb_build(CDDB_PS1_LIST, path)) < 0) {
+        return rv;
+    }
 
-        SHA1Input(&sha, buff, rv);
+    if ((rv = launch_rules_load(&rules, LAUNCH_CONF_PATH)) < 0) {
+        LOG_WARN("Could not load '%s': %s", LAUNCH_CONF_PATH, strerror(-rv));
+        return rv;
     }
 
-    if (!SHA1Result(&sha)) {
-        return -1;
+    snprintf(path, PATH_MAX, "%s/rules.bin", dir);
+    if ((rv = launch_rules_save(&rules, path)) < 0) {
+        LOG_WARN("Could not save '%s': %s", path, strerror(-rv));
     }
 
-    sprintf(result, "%08X%08X%08X%08X%08X",
-           sha.Message_Digest[0],
-           sha.Message_Digest[1],
-           sha.Message_Digest[2],
-           sha.Message_Digest[3],
-           sha.Message_Digest[4]);
-    return 0;
+    launch_rules_free(&rules);
+    return rv;
 }
 
-struct RunInfo {
-    char core[50];
-    int multitap;
-    int dualanalog;
-};
-
-static int get_run_info(struct RunInfo* info, char* game_name) {
-    int fd = open("./launch.conf", O_RDONLY);
+/* Runs the detection in this process, as the daemon would */
+static int resolve_locally(const char* path, int op, char* game_name,
+                           size_t max_len, struct RunInfo* info) {
+    struct DetectContext ctx;
+    struct DetectCache cache;
     int rv;
-    char token[MAX_TOKEN_LEN];
-    if (fd < 0) {
-        return -errno;
-    }
 
-    memset(info, 0, sizeof(struct RunInfo));
+    detect_context_init(&ctx, strict_verify);
+    open_cache(&cache);
+    if (op == DAEMON_RESOLVE) {
+        core_prefetch_enable(&ctx.rules);
+    }
 
-    while (1) {
-        if ((rv = get_token(fd, token, MAX_TOKEN_LEN)) < 0) {
-            goto clean;
+    if (op == DAEMON_IDENTIFY) {
+        rv = detect_game(&ctx, path, game_name, max_len);
+        if (rv < 0) {
+            LOG_WARN("Could not detect game: %s", strerror(-rv));
         }
-
-        if (fnmatch(token, game_name, 0) != 0) {
-            if ((rv = find_token(fd, ";")) < 0) {
-                goto clean;
-            }
-            continue;
+    } else {
+        rv = detect_resolve(&ctx, &cache, path, game_name, max_len, info);
+        /* Cache hits never detect a system, but name the core */
+        if (rv >= 0) {
+            core_prefetch_core(info->core);
         }
+    }
 
-        LOG_DEBUG("Matched rule '%s'", token);
-
-        if ((rv = get_token(fd, token, MAX_TOKEN_LEN)) < 0) {
-            goto clean;
-        }
+    detect_cache_close(&cache);
+    detect_context_free(&ctx);
+    arena_reset(launch_arena());
+    return rv;
+}
 
-        break;
+/* Returns 1 if the daemon answered, filling `rv` with its result */
+static int resolve_with_daemon(const char* path, int op, char* game_name,
+                               size_t max_len, struct RunInfo* info,
+                               int* rv) {
+    struct DaemonResponse resp;
+    struct TraceSpan span;
+    uint32_t flags = 0;
+    int err;
+
+    if (strict_verify) {
+        flags |= DAEMON_STRICT;
+    }
+    if (!use_cache) {
+        flags |= DAEMON_NO_CACHE;
     }
 
-    strncpy(info->core, token, 50);
-    info->multitap = 0;
-    info->dualanalog = 0;
-
-    if ((rv = get_token(fd, token, MAX_TOKEN_LEN)) < 0) {
-        goto clean;
+    TRACE_BEGIN(&span, TRACE_DAEMON_REQUEST);
+    err = daemon_request(DAEMON_SOCKET_PATH, op, flags, path, &resp);
+    TRACE_END(&span);
+    if (err < 0) {
+        LOG_DEBUG("Daemon unavailable: %s", strerror(-err));
+        return 0;
     }
 
-    while (strcmp(token, ";") != 0) {
-        if (strcmp(token, "multitap") == 0) {
-            info->multitap = 1;
-        } else if (strcmp(token, "dualanalog") == 0) {
-            info->dualanalog = 1;
-        }
+    *rv = resp.status;
+    if (*rv < 0) {
+        LOG_WARN("Daemon could not resolve '%s': %s", path, strerror(-*rv));
+        return 1;
+    }
 
-        if ((rv = get_token(fd, token, MAX_TOKEN_LEN)) < 0) {
-            goto clean;
-        }
+    strncpy(game_name, resp.game_name, max_len - 1);
+    game_name[max_len - 1] = '\0';
+    *info = resp.info;
 
+    /* The daemon does not prefetch, it never launches anything */
+    if (op == DAEMON_RESOLVE) {
+        core_prefetch_core(info->core);
     }
-    rv = 0;
-clean:
-    close(fd);
-    return rv;
+    return 1;
 }
 
-char* SUFFIX_MATCH[] = {
-    ".nes", "nes",
-    ".gen", "smd",
-    ".smd", "smd",
-    ".bin", "smd",
-    ".sfc", "snes",
-    ".smc", "snes",
-    ".gg", "gg",
-    ".sms", "sms",
-    ".pce", "pce",
-    ".gba", "gba",
-    ".gb", "gb",
-    ".gbc", "gbc",
-    ".nds", "nds",
-    ".wsc", "wswan",
-    ".a26", "a26",
-    NULL
-};
-
-static int detect_rom_game(const char* path, char* game_name,
-                           size_t max_len) {
-    char hash[HASH_LEN + 1];
+int main(int argc, char* argv[]) {
+    char game_name[MAX_TOKEN_LEN];
+    char* path;
+    char* scan_dir = NULL;
+    char* catalog_path = "catalog.tsv";
+    char* prog_name;
+    int jobs = 0;
+    int serve;
+    int op = DAEMON_RESOLVE;
+    struct DetectContext ctx;
+    struct DetectCache cache;
+    struct RunInfo info;
+    const char* sha1_impl;
+    const char* crc32_impl;
     int rv;
-    char* suffix = strrchr(path, '.');
-    char** tmp_suffix;
-    if ((rv = get_sha1(path, hash)) < 0) {
-        LOG_WARN("Could not calculate hash: %s", strerror(-rv));
-    }
-
-    if (find_rom_canonical_name(hash, game_name, max_len) < 0) {
-        LOG_DEBUG("Could not detect rom with hash `%s` guessing", hash);
-
-        for (tmp_suffix = SUFFIX_MATCH; *tmp_suffix != NULL;
-             tmp_suffix += 2) {
-            if (strcasecmp(suffix, *tmp_suffix) == 0) {
-                snprintf(game_name, max_len, "%s.<unknown>",
-                         *(tmp_suffix + 1));
-                return 0;
-            }
+    int opt;
+
+    log_init();
+
+    /* Installed as retrolaunchd, serve by default */
+    prog_name = strrchr(argv[0], '/');
+    prog_name = prog_name ? prog_name + 1 : argv[0];
+    serve = strcmp(prog_name, "retrolaunchd") == 0;
+
+    while ((opt = getopt_long(argc, argv, "", OPTIONS, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if ((rv = db_index_build(DB_INDEX_PATH)) < 0) {
+                    return -rv;
+                }
+                return -cddb_build(CDDB_PS1_LIST, CDDB_PS1_INDEX);
+            case 'r':
+                return -db_index_update(DB_INDEX_PATH);
+            case 's':
+                strict_verify = 1;
+                break;
+            case 'n':
+                use_cache = 0;
+                break;
+            case 'S':
+                scan_dir = optarg;
+                break;
+            case 'c':
+                catalog_path = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'd':
+                serve = 1;
+                break;
+            case 'D':
+                use_daemon = 0;
+                break;
+            case 'i':
+                op = DAEMON_IDENTIFY;
+                break;
+            case 't':
+                trace_enable(optarg);
+                break;
+            case 'T':
+                return -build_tables(optarg);
+            case 'e':
+                /* The daemon answers from the tables it loaded */
+                detect_external_db = 1;
+                use_daemon = 0;
+                break;
+            case 'l':
+                if ((rv = log_parse_level(optarg)) < 0) {
+                    LOG_WARN("Unknown log level '%s'", optarg);
+                    return -rv;
+                }
+                log_level = rv;
+                break;
+            default:
+                return -1;
         }
-        return -EINVAL;
     }
 
-    return 0;
-}
-
-static int detect_game(const char* path, char* game_name, size_t max_len) {
-    if ((strcasecmp(path + strlen(path) - 4, ".cue") == 0) ||
-        (strcasecmp(path + strlen(path) - 4, ".m3u") == 0)) {
-        LOG_INFO("Starting CD game detection...");
-        return detect_cd_game(path, game_name, max_len);
-    } else {
-        LOG_INFO("Starting rom game detection...");
-        return detect_rom_game(path, game_name, max_len);
+    if (!serve && scan_dir == NULL && optind >= argc) {
+        return -1;
     }
-}
 
-static int run_retroarch(const char* path, const struct RunInfo* info) {
-    char core_path[PATH_MAX];
-    sprintf(core_path, "./cores/libretro-%s.so", info->core);
-    char* retro_argv[30] = {"retroarch",
-                          "-L", core_path};
-    int argi = 3;
-    if (info->multitap) {
-        retro_argv[argi] = "-4";
-        argi++;
-        LOG_INFO("Game supports multitap");
+    /* Pick the hash backends before any worker thread hashes */
+    sha1_impl = SHA1SelectImplementation();
+    crc32_impl = crc32_select_implementation();
+    LOG_DEBUG("Using %s SHA-1 implementation", sha1_impl);
+    LOG_DEBUG("Using %s CRC32 implementation", crc32_impl);
+    if (serve) {
+        return -daemon_serve(DAEMON_SOCKET_PATH, jobs, use_cache);
     }
 
-    if (info->dualanalog) {
-        retro_argv[argi] = "-A";
-        argi ++;
-        retro_argv[argi] = "1";
-        argi ++;
-        retro_argv[argi] = "-A";
-        argi ++;
-        retro_argv[argi] = "2";
-        argi ++;
-        LOG_INFO("Game supports the dualshock controller");
+    if (scan_dir != NULL) {
+        detect_context_init(&ctx, strict_verify);
+        open_cache(&cache);
+        rv = scan_library(&ctx, &cache, scan_dir, catalog_path, jobs);
+        detect_cache_close(&cache);
+        detect_context_free(&ctx);
+        return -rv;
     }
 
-    retro_argv[argi] = strdup(path);
-    argi ++;
-    retro_argv[argi] = NULL;
-    execvp(retro_argv[0], retro_argv);
-    return -errno;
-}
-
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        return -1;
+    path = argv[optind];
+    LOG_INFO("Analyzing '%s'", path);
+    if (!use_daemon || !resolve_with_daemon(path, op, game_name,
+                                            MAX_TOKEN_LEN, &info, &rv)) {
+        rv = resolve_locally(path, op, game_name, MAX_TOKEN_LEN, &info);
     }
 
-    char game_name[MAX_TOKEN_LEN];
-    char* path = argv[1];
-    struct RunInfo info;
-    int rv;
-    int fd = -1;
-
-    LOG_INFO("Analyzing '%s'", path);
-    if ((rv = detect_game(path, game_name, MAX_TOKEN_LEN)) < 0) {
-        LOG_WARN("Could not detect game: %s", strerror(-rv));
+    if (rv < 0) {
         return -rv;
     }
 
     LOG_INFO("Game is `%s`", game_name);
-    if ((rv = get_run_info(&info, game_name)) < 0) {
-        LOG_WARN("Could not find sutable core: %s", strerror(-rv));
-        return -1;
+#if ALLOC_STATS
+    LOG_DEBUG("Made %lu heap allocations", alloc_stats_count());
+#endif
+    if (op == DAEMON_IDENTIFY) {
+        return 0;
     }
 
     LOG_DEBUG("Usinge libretro core '%s'", info.core);
+    if ((rv = core_usage_record(game_name, info.core)) < 0) {
+        LOG_DEBUG("Could not record core usage: %s", strerror(-rv));
+    }
+
     LOG_INFO("Launching '%s'", path);
 
     rv = run_retroarch(path, &info);
@@ -2,19 +2,73 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
-ssize_t get_token(int fd, char* token, size_t max_len) {
-    char* c = token;
-    int rv;
-    ssize_t len = 0;
-    int in_string = 0;
+#include "trace.h"
+
+#define READ_CHUNK_LEN (64 * 1024)
+/* Smaller files are copied into the launch arena, mapping them costs
+ * more than the copy */
+#define ARENA_READ_MAX_LEN (64 * 1024)
+
+static int read_to_arena(struct Tokenizer* t, int fd, size_t len) {
+    struct Arena* arena = launch_arena();
+    size_t mark = arena_mark(arena);
+    ssize_t rv;
+
+    if ((t->buff = arena_alloc(arena, len)) == NULL) {
+        return -ENOMEM;
+    }
+
+    /* A file that shrank meanwhile is read up to its new end */
+    while (t->len < len) {
+        rv = pread(fd, t->buff + t->len, len - t->len, t->len);
+        TRACE_READ(rv);
+        if (rv == 0) {
+            break;
+        } else if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            rv = -errno;
+            arena_release(arena, mark);
+            t->buff = NULL;
+            t->len = 0;
+            return rv;
+        }
+
+        t->len += rv;
+    }
+
+    t->arena = arena;
+    t->arena_mark = mark;
+    return 0;
+}
+
+static int read_whole(struct Tokenizer* t, int fd) {
+    size_t cap = 0;
+    ssize_t rv;
+    char* tmp;
 
     while (1) {
-        rv = read(fd, c, 1);
+        if (t->len == cap) {
+            cap += READ_CHUNK_LEN;
+            if ((tmp = realloc(t->buff, cap)) == NULL) {
+                return -ENOMEM;
+            }
+            t->buff = tmp;
+        }
+
+        rv = read(fd, t->buff + t->len, cap - t->len);
+        TRACE_READ(rv);
         if (rv == 0) {
             return 0;
-        } else if (rv < 1) {
+        } else if (rv < 0) {
             switch(errno) {
                 case EINTR:
                 case EAGAIN:
@@ -24,48 +78,145 @@ ssize_t get_token(int fd, char* token, size_t max_len) {
             }
         }
 
-        switch (*c) {
-            case ' ':
-            case '\t':
-            case '\r':
-            case '\n':
-                if (c == token) {
-                    continue;
-                }
-
-                if (!in_string) {
-                    *c = '\0';
-                    return len;
-                }
-                break;
-            case '\"':
-                if (c == token) {
-                    in_string = 1;
-                    continue;
-                }
+        t->len += rv;
+    }
+}
+
+int tokenizer_open(struct Tokenizer* t, const char* path) {
+    struct stat st;
+    int fd;
+    int rv;
+
+    memset(t, 0, sizeof(*t));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        if (st.st_size <= ARENA_READ_MAX_LEN &&
+            read_to_arena(t, fd, st.st_size) == 0) {
+            close(fd);
+            return 0;
+        }
 
-                *c = '\0';
-                return len;
+        t->buff = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (t->buff != MAP_FAILED) {
+            madvise(t->buff, st.st_size, MADV_SEQUENTIAL);
+            t->len = st.st_size;
+            t->mapped = 1;
+            close(fd);
+            return 0;
         }
+        t->buff = NULL;
+    }
+
+    /* Pipes and other special files are slurped instead */
+    if ((rv = read_whole(t, fd)) < 0) {
+        tokenizer_close(t);
+    }
 
-        len++;
+    close(fd);
+    return rv;
+}
+
+void tokenizer_close(struct Tokenizer* t) {
+    if (t->mapped) {
+        munmap(t->buff, t->len);
+    } else if (t->arena != NULL) {
+        arena_release(t->arena, t->arena_mark);
+    } else {
+        free(t->buff);
+    }
+
+    memset(t, 0, sizeof(*t));
+}
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int get_token(struct Tokenizer* t, struct Token* token) {
+    const char* end = t->buff + t->len;
+    const char* c = t->buff + t->pos;
+
+    while (c < end && is_space(*c)) {
         c++;
-        if (len == max_len) {
-            *c = '\0';
-            return len;
+    }
+
+    if (c == end) {
+        t->pos = t->len;
+        return 0;
+    }
+
+    if (*c == '\"') {
+        token->start = ++c;
+        while (c < end && *c != '\"') {
+            c++;
         }
+        token->len = c - token->start;
+        /* Skip the closing quote */
+        if (c < end) {
+            c++;
+        }
+    } else {
+        token->start = c;
+        while (c < end && !is_space(*c) && *c != '\"') {
+            c++;
+        }
+        token->len = c - token->start;
     }
+
+    t->pos = c - t->buff;
+    return 1;
 }
 
-int find_token(int fd, char* token) {
-    int tmp_len = strlen(token);
-    char* tmp_token = calloc(tmp_len, sizeof(char));
-    while (strncmp(tmp_token, token, tmp_len) != 0) {
-        if (get_token(fd, tmp_token, tmp_len) <= 0) {
-            return -1;
+int get_line(struct Tokenizer* t, struct Token* line) {
+    const char* end = t->buff + t->len;
+    const char* c = t->buff + t->pos;
+
+    if (c == end) {
+        return 0;
+    }
+
+    line->start = c;
+    while (c < end && *c != '\n') {
+        c++;
+    }
+
+    line->len = c - line->start;
+    if (line->len > 0 && line->start[line->len - 1] == '\r') {
+        line->len--;
+    }
+
+    t->pos = (c < end ? c + 1 : c) - t->buff;
+    return 1;
+}
+
+int find_token(struct Tokenizer* t, const char* token) {
+    struct Token tmp_token;
+    while (get_token(t, &tmp_token) > 0) {
+        if (token_equals(&tmp_token, token)) {
+            return 0;
         }
     }
 
-    return 0;
+    return -1;
+}
+
+int token_equals(const struct Token* token, const char* str) {
+    return strncmp(token->start, str, token->len) == 0 &&
+           str[token->len] == '\0';
+}
+
+int token_case_equals(const struct Token* token, const char* str) {
+    return strncasecmp(token->start, str, token->len) == 0 &&
+           str[token->len] == '\0';
 }
 
+size_t token_copy(const struct Token* token, char* dest, size_t max_len) {
+    size_t len = token->len < max_len - 1 ? token->len : max_len - 1;
+    memcpy(dest, token->start, len);
+    dest[len] = '\0';
+    return len;
+}
@@ -1,6 +1,37 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
 #include <unistd.h>
 
+#include "arena.h"
+
 #define MAX_TOKEN_LEN 255
 
-ssize_t get_token(int fd, char* token, size_t max_len);
-int find_token(int fd, char* token);
+/* A view into the tokenizer buffer, not NUL terminated */
+struct Token {
+    const char* start;
+    size_t len;
+};
+
+struct Tokenizer {
+    char* buff;
+    size_t len;
+    size_t pos;
+    int mapped;
+    /* Set when the file was read into the launch arena */
+    struct Arena* arena;
+    size_t arena_mark;
+};
+
+int tokenizer_open(struct Tokenizer* t, const char* path);
+void tokenizer_close(struct Tokenizer* t);
+
+int get_token(struct Tokenizer* t, struct Token* token);
+int get_line(struct Tokenizer* t, struct Token* line);
+int find_token(struct Tokenizer* t, const char* token);
+
+int token_equals(const struct Token* token, const char* str);
+int token_case_equals(const struct Token* token, const char* str);
+size_t token_copy(const struct Token* token, char* dest, size_t max_len);
+
+#endif
@@ -0,0 +1,510 @@
+#include "rom_reader.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "trace.h"
+
+#include "log.h"
+
+#define ZIP_EOCD_SIGNATURE 0x06054b50
+#define ZIP_EOCD_LEN 22
+#define ZIP_MAX_COMMENT_LEN 0xFFFF
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_CENTRAL_LEN 46
+#define ZIP_LOCAL_SIGNATURE 0x04034b50
+#define ZIP_LOCAL_LEN 30
+#define ZIP_FLAG_ENCRYPTED 0x1
+#define ZIP_METHOD_STORED 0
+#define ZIP_METHOD_DEFLATED 8
+
+static uint16_t read_le16(const unsigned char* data) {
+    return data[0] | data[1] << 8;
+}
+
+static uint32_t read_le32(const unsigned char* data) {
+    return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static int has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len &&
+           strcasecmp(name + len - suffix_len, suffix) == 0;
+}
+
+int rom_reader_is_archive(const char* path) {
+    return has_suffix(path, ".gz") || has_suffix(path, ".zip");
+}
+
+static int read_full(int fd, void* buff, size_t len, off_t offset) {
+    ssize_t rv;
+    do {
+        rv = pread(fd, buff, len, offset);
+        TRACE_READ(rv);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0) {
+        return -errno;
+    }
+
+    return (size_t)rv == len ? 0 : -EINVAL;
+}
+
+/* The trailer holds the CRC32 and the uncompressed size modulo 2^32 */
+static int open_gzip(struct RomReader* r, const char* path, off_t file_size) {
+    unsigned char trailer[8];
+    int rv;
+
+    if (file_size < 18) {
+        return -EINVAL;
+    }
+
+    if ((rv = read_full(r->fd, trailer, sizeof(trailer),
+                        file_size - sizeof(trailer))) < 0) {
+        return rv;
+    }
+
+    strncpy(r->name, path, PATH_MAX - 1);
+    r->name[strlen(r->name) - strlen(".gz")] = '\0';
+    r->format = ROM_GZIP;
+    r->crc = read_le32(trailer);
+    r->has_crc = 1;
+    r->size = read_le32(trailer + 4);
+    r->data_offset = 0;
+    r->data_len = file_size;
+    return 0;
+}
+
+static int find_zip_directory(struct RomReader* r, off_t file_size,
+                              uint32_t* entries, uint32_t* dir_offset,
+                              uint32_t* dir_len) {
+    size_t len = ZIP_EOCD_LEN;
+    const unsigned char* eocd;
+    size_t i;
+    int rv;
+
+    if (file_size < ZIP_EOCD_LEN) {
+        return -EINVAL;
+    }
+
+    /* Most zips have no comment, so try the last bytes on their own */
+    if ((rv = read_full(r->fd, r->in, len, file_size - len)) < 0) {
+        return rv;
+    }
+
+    if (read_le32(r->in) != ZIP_EOCD_SIGNATURE) {
+        len = file_size < ZIP_EOCD_LEN + ZIP_MAX_COMMENT_LEN ?
+              file_size : ZIP_EOCD_LEN + ZIP_MAX_COMMENT_LEN;
+        if ((rv = read_full(r->fd, r->in, len, file_size - len)) < 0) {
+            return rv;
+        }
+    }
+
+    /* The end record is followed only by its comment */
+    for (i = len - ZIP_EOCD_LEN + 1; i-- > 0;) {
+        eocd = r->in + i;
+        if (read_le32(eocd) == ZIP_EOCD_SIGNATURE &&
+            i + ZIP_EOCD_LEN + read_le16(eocd + 20) <= len) {
+            *entries = read_le16(eocd + 10);
+            *dir_len = read_le32(eocd + 12);
+            *dir_offset = read_le32(eocd + 16);
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+/*
+ * Picks the first entry that looks like a rom, or failing that the
+ * biggest one, using the central directory.
+ */
+static int open_zip(struct RomReader* r, const char* path, off_t file_size,
+                    int (*is_rom_name)(const char* name)) {
+    const unsigned char* entry;
+    const unsigned char* rom = NULL;
+    const unsigned char* best = NULL;
+    unsigned char local[ZIP_LOCAL_LEN];
+    char name[PATH_MAX];
+    uint32_t entries;
+    uint32_t dir_offset;
+    uint32_t dir_len;
+    uint32_t i;
+    size_t pos;
+    size_t name_len;
+    int rv;
+
+    if ((rv = find_zip_directory(r, file_size, &entries, &dir_offset,
+                                 &dir_len)) < 0) {
+        LOG_DEBUG("'%s' is not a zip file", path);
+        return rv;
+    }
+
+    if (dir_len > ROM_READER_BUFF_LEN ||
+        (rv = read_full(r->fd, r->in, dir_len, dir_offset)) < 0) {
+        return rv < 0 ? rv : -E2BIG;
+    }
+
+    for (i = 0, pos = 0; i < entries; i++) {
+        entry = r->in + pos;
+        if (pos + ZIP_CENTRAL_LEN > dir_len ||
+            read_le32(entry) != ZIP_CENTRAL_SIGNATURE) {
+            return -EINVAL;
+        }
+
+        name_len = read_le16(entry + 28);
+        if (pos + ZIP_CENTRAL_LEN + name_len > dir_len) {
+            return -EINVAL;
+        }
+        pos += ZIP_CENTRAL_LEN + name_len + read_le16(entry + 30) +
+               read_le16(entry + 32);
+
+        if (name_len == 0 || name_len >= PATH_MAX ||
+            entry[ZIP_CENTRAL_LEN + name_len - 1] == '/' ||
+            (read_le16(entry + 8) & ZIP_FLAG_ENCRYPTED)) {
+            continue;
+        }
+
+        if (r->member_count < ROM_READER_MAX_MEMBERS) {
+            r->members[r->member_count].size = read_le32(entry + 24);
+            r->members[r->member_count].crc = read_le32(entry + 16);
+            r->member_count++;
+        }
+
+        memcpy(name, entry + ZIP_CENTRAL_LEN, name_len);
+        name[name_len] = '\0';
+        if (rom == NULL && is_rom_name != NULL && is_rom_name(name)) {
+            rom = entry;
+        }
+
+        if (best == NULL || read_le32(entry + 24) > read_le32(best + 24)) {
+            best = entry;
+        }
+    }
+
+    if (rom != NULL) {
+        best = rom;
+    }
+
+    if (best == NULL) {
+        LOG_DEBUG("No usable entry in '%s'", path);
+        return -ENOENT;
+    }
+
+    switch (read_le16(best + 10)) {
+        case ZIP_METHOD_STORED:
+            r->format = ROM_ZIP_STORED;
+            break;
+        case ZIP_METHOD_DEFLATED:
+            r->format = ROM_ZIP_DEFLATED;
+            break;
+        default:
+            LOG_DEBUG("Unsupported compression method %u in '%s'",
+                      read_le16(best + 10), path);
+            return -ENOTSUP;
+    }
+
+    name_len = read_le16(best + 28);
+    memcpy(r->name, best + ZIP_CENTRAL_LEN, name_len);
+    r->name[name_len] = '\0';
+    r->size = read_le32(best + 24);
+    r->crc = read_le32(best + 16);
+    r->has_crc = 1;
+    r->data_len = read_le32(best + 20);
+
+    /* The local header's name and extra field may differ in length */
+    if ((rv = read_full(r->fd, local, sizeof(local),
+                        read_le32(best + 42))) < 0) {
+        return rv;
+    }
+
+    if (read_le32(local) != ZIP_LOCAL_SIGNATURE) {
+        return -EINVAL;
+    }
+
+    r->data_offset = read_le32(best + 42) + ZIP_LOCAL_LEN +
+                     read_le16(local + 26) + read_le16(local + 28);
+    return 0;
+}
+
+static voidpf arena_zalloc(voidpf opaque, uInt items, uInt size) {
+    return arena_alloc(opaque, (size_t)items * size);
+}
+
+/* Given back all at once when the reader closes */
+static void arena_zfree(voidpf opaque, voidpf address) {
+}
+
+int rom_reader_open(struct RomReader* r, const char* path,
+                    int (*is_rom_name)(const char* name)) {
+    struct stat st;
+    int rv;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        return -errno;
+    }
+
+    if (fstat(r->fd, &st) < 0) {
+        rv = -errno;
+        goto fail;
+    }
+
+    r->arena = launch_arena();
+    r->arena_mark = arena_mark(r->arena);
+    r->in = arena_alloc(r->arena, ROM_READER_BUFF_LEN);
+    r->out = arena_alloc(r->arena, ROM_READER_BUFF_LEN);
+    if (r->in == NULL || r->out == NULL) {
+        rv = -ENOMEM;
+        goto fail;
+    }
+
+    if (has_suffix(path, ".gz")) {
+        rv = open_gzip(r, path, st.st_size);
+    } else if (has_suffix(path, ".zip")) {
+        rv = open_zip(r, path, st.st_size, is_rom_name);
+    } else {
+        strncpy(r->name, path, PATH_MAX - 1);
+        r->format = ROM_PLAIN;
+        r->size = st.st_size;
+        r->data_offset = 0;
+        r->data_len = st.st_size;
+        rv = 0;
+    }
+
+    if (rv < 0) {
+        goto fail;
+    }
+
+    if (r->format != ROM_PLAIN) {
+        LOG_DEBUG("Reading '%s' from '%s'", r->name, path);
+    }
+
+    /* Without it big roms are read on this thread like small ones */
+    if (r->data_len >= ROM_READER_ASYNC_MIN_LEN) {
+        r->ring = arena_alloc(r->arena, ASYNC_READ_LEN);
+    }
+
+    return rom_reader_rewind(r);
+
+fail:
+    rom_reader_close(r);
+    return rv;
+}
+
+static void stop_async(struct RomReader* r) {
+    if (r->async_active) {
+        async_read_stop(&r->async);
+        r->async_active = 0;
+    }
+}
+
+void rom_reader_close(struct RomReader* r) {
+    struct Arena* arena = r->arena;
+    size_t mark = r->arena_mark;
+
+    stop_async(r);
+    if (r->zs_active) {
+        inflateEnd(&r->zs);
+    }
+
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    arena_release(arena, mark);
+}
+
+int rom_reader_is_compressed(const struct RomReader* r) {
+    return r->format == ROM_GZIP || r->format == ROM_ZIP_DEFLATED;
+}
+
+int rom_reader_rewind(struct RomReader* r) {
+    int rv;
+
+    /* A peeked chunk is the start of the rom already */
+    if (r->peeked > 0) {
+        return 0;
+    }
+
+    stop_async(r);
+    r->pos = 0;
+    r->done = 0;
+    if (!rom_reader_is_compressed(r)) {
+        return 0;
+    }
+
+    if (r->zs_active) {
+        rv = inflateReset(&r->zs);
+    } else {
+        memset(&r->zs, 0, sizeof(r->zs));
+        r->zs.zalloc = arena_zalloc;
+        r->zs.zfree = arena_zfree;
+        r->zs.opaque = r->arena;
+        /* Raw deflate for zip entries, gzip framing otherwise */
+        rv = inflateInit2(&r->zs, r->format == ROM_GZIP ? 16 + MAX_WBITS
+                                                        : -MAX_WBITS);
+        r->zs_active = rv == Z_OK;
+    }
+
+    r->zs.next_in = r->in;
+    r->zs.avail_in = 0;
+    return rv == Z_OK ? 0 : -ENOMEM;
+}
+
+/* Hands out the stored data through the read-ahead thread */
+static int fill_input_async(struct RomReader* r) {
+    const unsigned char* data;
+    ssize_t rv;
+
+    rv = async_read_next(&r->async, &data);
+    TRACE_READ(rv);
+    if (rv < 0) {
+        return rv;
+    }
+
+    r->pos += rv;
+    r->zs.next_in = (unsigned char*)data;
+    r->zs.avail_in = rv;
+    return rv;
+}
+
+static int fill_input(struct RomReader* r) {
+    size_t len = r->data_len - r->pos < ROM_READER_BUFF_LEN ?
+                 r->data_len - r->pos : ROM_READER_BUFF_LEN;
+    ssize_t rv;
+
+    /* Started at the beginning of each pass, only a rewind stops it */
+    if (!r->async_active && r->pos == 0 && r->ring != NULL &&
+        async_read_start(&r->async, r->fd, r->data_offset,
+                         r->data_len, r->ring) == 0) {
+        r->async_active = 1;
+    }
+
+    if (r->async_active) {
+        return fill_input_async(r);
+    }
+
+    do {
+        rv = pread(r->fd, r->in, len, r->data_offset + r->pos);
+        TRACE_READ(rv);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0) {
+        return -errno;
+    }
+
+    r->pos += rv;
+    r->zs.next_in = r->in;
+    r->zs.avail_in = rv;
+    return rv;
+}
+
+/*
+ * Points `data` at the next chunk of the rom. Returns its length, 0 at the
+ * end of the rom.
+ */
+ssize_t rom_reader_next(struct RomReader* r, const unsigned char** data) {
+    ssize_t rv;
+    int zrv;
+
+    if (r->peeked > 0) {
+        *data = r->out;
+        rv = r->peeked;
+        r->peeked = 0;
+        return rv;
+    }
+
+    if (r->done) {
+        return 0;
+    }
+
+    if (!rom_reader_is_compressed(r)) {
+        r->zs.avail_in = 0;
+        if ((rv = fill_input(r)) <= 0) {
+            r->done = 1;
+            return rv;
+        }
+        *data = r->zs.next_in;
+        return rv;
+    }
+
+    r->zs.next_out = r->out;
+    r->zs.avail_out = ROM_READER_BUFF_LEN;
+    while (r->zs.avail_out > 0) {
+        if (r->zs.avail_in == 0) {
+            if ((rv = fill_input(r)) < 0) {
+                return rv;
+            }
+
+            if (rv == 0) {
+                LOG_DEBUG("Compressed data in '%s' is truncated", r->name);
+                return -EINVAL;
+            }
+        }
+
+        zrv = inflate(&r->zs, Z_NO_FLUSH);
+        if (zrv == Z_STREAM_END) {
+            r->done = 1;
+            break;
+        }
+
+        if (zrv != Z_OK && zrv != Z_BUF_ERROR) {
+            LOG_DEBUG("Could not inflate '%s': %s", r->name,
+                      r->zs.msg ? r->zs.msg : "unknown error");
+            return -EINVAL;
+        }
+    }
+
+    *data = r->out;
+    return ROM_READER_BUFF_LEN - r->zs.avail_out;
+}
+
+/*
+ * Points `data` at the first bytes of the rom, at least `len` of them
+ * unless the rom is shorter. An inflated chunk is kept for the next
+ * rom_reader_next, so peeking at a compressed rom costs no extra work.
+ */
+ssize_t rom_reader_peek(struct RomReader* r, size_t len,
+                        const unsigned char** data) {
+    ssize_t rv;
+    int zrv;
+
+    if (r->peeked > 0) {
+        *data = r->out;
+        return r->peeked;
+    }
+
+    if (!rom_reader_is_compressed(r)) {
+        if (len > ROM_READER_BUFF_LEN) {
+            len = ROM_READER_BUFF_LEN;
+        }
+
+        do {
+            rv = pread(r->fd, r->in, len, r->data_offset);
+            TRACE_READ(rv);
+        } while (rv < 0 && errno == EINTR);
+
+        *data = r->in;
+        return rv < 0 ? -errno : rv;
+    }
+
+    if ((r->pos > 0 || r->done) && (zrv = rom_reader_rewind(r)) < 0) {
+        return zrv;
+    }
+
+    if ((rv = rom_reader_next(r, data)) > 0) {
+        r->peeked = rv;
+    }
+    return rv;
+}
@@ -0,0 +1,76 @@
+#ifndef _ROM_READER_H_
+#define _ROM_READER_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "async_read.h"
+#include "arena.h"
+
+#define ROM_READER_BUFF_LEN (256 * 1024)
+/* Smaller roms are read faster than a thread starts */
+#define ROM_READER_ASYNC_MIN_LEN (4 * 1024 * 1024)
+#define ROM_READER_MAX_MEMBERS 16
+
+enum RomFormat {
+    ROM_PLAIN,
+    ROM_GZIP,
+    ROM_ZIP_STORED,
+    ROM_ZIP_DEFLATED
+};
+
+struct RomMember {
+    uint64_t size;
+    uint32_t crc;
+};
+
+/*
+ * Sequential access to a rom's contents, inflating .gz and .zip files on
+ * the fly. The decoded data is handed out from a buffer owned by the
+ * reader and reused for every chunk. Buffers and zlib's state come from
+ * the launch arena and go back to it on close.
+ */
+struct RomReader {
+    int fd;
+    enum RomFormat format;
+    /* The rom's own name, inside the archive if there is one */
+    char name[PATH_MAX];
+    /* Uncompressed size and CRC32, as recorded by the container */
+    uint64_t size;
+    uint32_t crc;
+    int has_crc;
+    /* The files of a zip, from its central directory */
+    struct RomMember members[ROM_READER_MAX_MEMBERS];
+    size_t member_count;
+    /* Where the stored data is in the file */
+    off_t data_offset;
+    off_t data_len;
+    off_t pos;
+    z_stream zs;
+    int zs_active;
+    int done;
+    /* Length of an inflated first chunk not handed out yet */
+    ssize_t peeked;
+    /* Read-ahead of the stored data, for big roms */
+    struct AsyncRead async;
+    int async_active;
+    unsigned char* ring;
+    unsigned char* in;
+    unsigned char* out;
+    struct Arena* arena;
+    size_t arena_mark;
+};
+
+int rom_reader_open(struct RomReader* r, const char* path,
+                    int (*is_rom_name)(const char* name));
+void rom_reader_close(struct RomReader* r);
+int rom_reader_is_compressed(const struct RomReader* r);
+int rom_reader_is_archive(const char* path);
+int rom_reader_rewind(struct RomReader* r);
+ssize_t rom_reader_peek(struct RomReader* r, size_t len,
+                        const unsigned char** data);
+ssize_t rom_reader_next(struct RomReader* r, const unsigned char** data);
+
+#endif
@@ -0,0 +1,409 @@
+#include "run_info.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "parser.h"
+
+#include "log.h"
+
+#define RULE_NONE UINT32_MAX
+
+#define RULES_MAGIC "RLLR"
+#define RULES_VERSION 1
+
+/* Characters that end the literal head of a pattern */
+#define GLOB_SPECIAL "*?[\\"
+
+enum LaunchRuleKind {
+    /* No wildcards, the name has to equal the pattern */
+    RULE_EXACT,
+    /* A literal head followed by a single trailing '*' */
+    RULE_PREFIX,
+    /* Anything else is left to fnmatch */
+    RULE_GLOB
+};
+
+struct LaunchRule {
+    uint32_t pattern;
+    uint32_t kind;
+    /* Next rule with the same literal head, in file order */
+    uint32_t next;
+    struct RunInfo info;
+};
+
+struct LaunchRuleNode {
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t first_rule;
+    uint32_t last_rule;
+    /* Lowest rule index anywhere under this node */
+    uint32_t min_rule;
+    unsigned char c;
+};
+
+/* The compiled rules as saved, followed by the three arrays */
+struct LaunchRulesHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t rule_count;
+    uint32_t node_count;
+    uint32_t strings_len;
+};
+
+static int grow(void** array, uint32_t count, size_t item_size) {
+    void* tmp;
+    /* Capacity doubles from 16, so the array is full at 16, 32, 64... */
+    if (count == 0) {
+        count = 16;
+    } else if (count >= 16 && (count & (count - 1)) == 0) {
+        count *= 2;
+    } else {
+        return 0;
+    }
+
+    tmp = realloc(*array, count * item_size);
+    if (tmp == NULL) {
+        return -ENOMEM;
+    }
+
+    *array = tmp;
+    return 0;
+}
+
+static int add_node(struct LaunchRules* rules, unsigned char c,
+                    uint32_t* index) {
+    struct LaunchRuleNode* node;
+    if (grow((void**)&rules->nodes, rules->node_count, sizeof(*node)) < 0) {
+        return -ENOMEM;
+    }
+
+    node = &rules->nodes[rules->node_count];
+    node->first_child = RULE_NONE;
+    node->next_sibling = RULE_NONE;
+    node->first_rule = RULE_NONE;
+    node->last_rule = RULE_NONE;
+    node->min_rule = RULE_NONE;
+    node->c = c;
+    *index = rules->node_count++;
+    return 0;
+}
+
+static uint32_t find_child(const struct LaunchRules* rules, uint32_t node,
+                           unsigned char c) {
+    uint32_t child = rules->nodes[node].first_child;
+    while (child != RULE_NONE && rules->nodes[child].c != c) {
+        child = rules->nodes[child].next_sibling;
+    }
+
+    return child;
+}
+
+/* Strings double from 256 bytes, so loading takes a handful of reallocs */
+static size_t strings_cap(size_t len) {
+    size_t cap = 256;
+    while (cap < len) {
+        cap *= 2;
+    }
+
+    return cap;
+}
+
+static int add_string(struct LaunchRules* rules, const struct Token* token,
+                      uint32_t* offset) {
+    size_t len = rules->strings_len + token->len + 1;
+    char* tmp;
+
+    if (rules->strings == NULL || len > strings_cap(rules->strings_len)) {
+        if ((tmp = realloc(rules->strings, strings_cap(len))) == NULL) {
+            return -ENOMEM;
+        }
+        rules->strings = tmp;
+    }
+
+    memcpy(rules->strings + rules->strings_len, token->start, token->len);
+    rules->strings[rules->strings_len + token->len] = '\0';
+    *offset = rules->strings_len;
+    rules->strings_len += token->len + 1;
+    return 0;
+}
+
+/* Rules are added in file order so every list stays sorted by index */
+static int add_rule(struct LaunchRules* rules, const struct Token* pattern,
+                    const struct RunInfo* info) {
+    struct LaunchRule* rule;
+    uint32_t index = rules->rule_count;
+    uint32_t node = 0;
+    uint32_t child;
+    size_t head_len;
+    size_t i;
+    int rv;
+
+    if ((rv = grow((void**)&rules->rules, rules->rule_count,
+                   sizeof(*rule))) < 0) {
+        return rv;
+    }
+
+    rule = &rules->rules[index];
+    if ((rv = add_string(rules, pattern, &rule->pattern)) < 0) {
+        return rv;
+    }
+
+    head_len = strcspn(rules->strings + rule->pattern, GLOB_SPECIAL);
+    if (head_len == pattern->len) {
+        rule->kind = RULE_EXACT;
+    } else if (head_len + 1 == pattern->len &&
+               pattern->start[head_len] == '*') {
+        rule->kind = RULE_PREFIX;
+    } else {
+        rule->kind = RULE_GLOB;
+    }
+    rule->next = RULE_NONE;
+    rule->info = *info;
+
+    for (i = 0; i <= head_len; i++) {
+        if (rules->nodes[node].min_rule == RULE_NONE) {
+            rules->nodes[node].min_rule = index;
+        }
+
+        if (i == head_len) {
+            break;
+        }
+
+        child = find_child(rules, node, pattern->start[i]);
+        if (child == RULE_NONE) {
+            if ((rv = add_node(rules, pattern->start[i], &child)) < 0) {
+                return rv;
+            }
+            rules->nodes[child].next_sibling = rules->nodes[node].first_child;
+            rules->nodes[node].first_child = child;
+        }
+        node = child;
+    }
+
+    if (rules->nodes[node].last_rule == RULE_NONE) {
+        rules->nodes[node].first_rule = index;
+    } else {
+        rules->rules[rules->nodes[node].last_rule].next = index;
+    }
+    rules->nodes[node].last_rule = index;
+    rules->rule_count++;
+    return 0;
+}
+
+int launch_rules_load(struct LaunchRules* rules, const char* path) {
+    struct Tokenizer t;
+    struct Token pattern;
+    struct Token token;
+    struct RunInfo info;
+    uint32_t root;
+    int rv;
+
+    memset(rules, 0, sizeof(*rules));
+    if ((rv = tokenizer_open(&t, path)) < 0) {
+        return rv;
+    }
+
+    if ((rv = add_node(rules, '\0', &root)) < 0) {
+        goto clean;
+    }
+
+    /* pattern core [multitap] [dualanalog] ; */
+    while (get_token(&t, &pattern) > 0) {
+        memset(&info, 0, sizeof(info));
+        if (get_token(&t, &token) <= 0) {
+            LOG_WARN("Rule '%.*s' in '%s' has no core", (int)pattern.len,
+                     pattern.start, path);
+            break;
+        }
+
+        token_copy(&token, info.core, sizeof(info.core));
+
+        while ((rv = get_token(&t, &token)) > 0 && !token_equals(&token, ";")) {
+            if (token_equals(&token, "multitap")) {
+                info.multitap = 1;
+            } else if (token_equals(&token, "dualanalog")) {
+                info.dualanalog = 1;
+            }
+        }
+
+        if (rv <= 0) {
+            LOG_WARN("Rule '%.*s' in '%s' is not terminated",
+                     (int)pattern.len, pattern.start, path);
+            break;
+        }
+
+        if ((rv = add_rule(rules, &pattern, &info)) < 0) {
+            goto clean;
+        }
+    }
+
+    LOG_DEBUG("Compiled %u launch rules into %u nodes", rules->rule_count,
+              rules->node_count);
+    rv = 0;
+clean:
+    tokenizer_close(&t);
+    if (rv < 0) {
+        launch_rules_free(rules);
+    }
+    return rv;
+}
+
+static int write_all(int fd, const void* buff, size_t len) {
+    const char* c = buff;
+    ssize_t rv;
+    while (len > 0) {
+        rv = write(fd, c, len);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        c += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+/* Saves the compiled rules for launch_rules_open_static */
+int launch_rules_save(const struct LaunchRules* rules, const char* path) {
+    struct LaunchRulesHeader header;
+    char tmp_path[PATH_MAX];
+    int fd;
+    int rv;
+
+    memcpy(header.magic, RULES_MAGIC, sizeof(header.magic));
+    header.version = RULES_VERSION;
+    header.rule_count = rules->rule_count;
+    header.node_count = rules->node_count;
+    header.strings_len = rules->strings_len;
+
+    snprintf(tmp_path, PATH_MAX, "%s.%d", path, (int)getpid());
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if ((rv = write_all(fd, &header, sizeof(header))) < 0 ||
+        (rv = write_all(fd, rules->rules,
+                        rules->rule_count * sizeof(*rules->rules))) < 0 ||
+        (rv = write_all(fd, rules->nodes,
+                        rules->node_count * sizeof(*rules->nodes))) < 0 ||
+        (rv = write_all(fd, rules->strings, rules->strings_len)) < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return rv;
+    }
+
+    close(fd);
+    if (rename(tmp_path, path) < 0) {
+        rv = -errno;
+        unlink(tmp_path);
+        return rv;
+    }
+
+    return 0;
+}
+
+/* Uses rules saved by launch_rules_save in place, without copying them */
+int launch_rules_open_static(struct LaunchRules* rules, const void* table,
+                             size_t len) {
+    const struct LaunchRulesHeader* header = table;
+    const char* data = (const char*)(header + 1);
+    size_t rules_len;
+    size_t nodes_len;
+
+    memset(rules, 0, sizeof(*rules));
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, RULES_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != RULES_VERSION || header->node_count == 0) {
+        return -EINVAL;
+    }
+
+    rules_len = header->rule_count * sizeof(struct LaunchRule);
+    nodes_len = header->node_count * sizeof(struct LaunchRuleNode);
+    if (sizeof(*header) + rules_len + nodes_len + header->strings_len > len) {
+        return -EINVAL;
+    }
+
+    rules->rules = (struct LaunchRule*)data;
+    rules->rule_count = header->rule_count;
+    rules->nodes = (struct LaunchRuleNode*)(data + rules_len);
+    rules->node_count = header->node_count;
+    rules->strings = (char*)(data + rules_len + nodes_len);
+    rules->strings_len = header->strings_len;
+    rules->is_static = 1;
+    return 0;
+}
+
+void launch_rules_free(struct LaunchRules* rules) {
+    if (!rules->is_static) {
+        free(rules->rules);
+        free(rules->nodes);
+        free(rules->strings);
+    }
+    memset(rules, 0, sizeof(*rules));
+}
+
+static int rule_matches(const struct LaunchRules* rules,
+                        const struct LaunchRule* rule, const char* game_name,
+                        size_t depth) {
+    switch (rule->kind) {
+        case RULE_EXACT:
+            return game_name[depth] == '\0';
+        case RULE_PREFIX:
+            return 1;
+        default:
+            return fnmatch(rules->strings + rule->pattern, game_name, 0) == 0;
+    }
+}
+
+/*
+ * Walks the trie along the name. Only rules whose literal head is a prefix
+ * of the name can match, and of those the one that comes first in the file
+ * wins.
+ */
+int get_run_info(const struct LaunchRules* rules, struct RunInfo* info,
+                 const char* game_name) {
+    uint32_t best = RULE_NONE;
+    uint32_t node = 0;
+    uint32_t i;
+    size_t depth = 0;
+
+    memset(info, 0, sizeof(struct RunInfo));
+    if (rules->node_count == 0) {
+        return -ENOENT;
+    }
+
+    while (node != RULE_NONE && rules->nodes[node].min_rule < best) {
+        for (i = rules->nodes[node].first_rule; i < best;
+             i = rules->rules[i].next) {
+            if (rule_matches(rules, &rules->rules[i], game_name, depth)) {
+                best = i;
+                break;
+            }
+        }
+
+        if (game_name[depth] == '\0') {
+            break;
+        }
+
+        node = find_child(rules, node, game_name[depth++]);
+    }
+
+    if (best == RULE_NONE) {
+        return -ENOENT;
+    }
+
+    LOG_DEBUG("Matched rule '%s'", rules->strings + rules->rules[best].pattern);
+    *info = rules->rules[best].info;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _RUN_INFO_H_
+#define _RUN_INFO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LAUNCH_CONF_PATH "./launch.conf"
+
+struct RunInfo {
+    char core[50];
+    int multitap;
+    int dualanalog;
+};
+
+struct LaunchRule;
+struct LaunchRuleNode;
+
+/*
+ * launch.conf compiled into a trie over the literal head of every pattern,
+ * the part before the first wildcard. The first level of the trie buckets
+ * the rules by system since every pattern starts with one.
+ */
+struct LaunchRules {
+    struct LaunchRule* rules;
+    uint32_t rule_count;
+    struct LaunchRuleNode* nodes;
+    uint32_t node_count;
+    char* strings;
+    size_t strings_len;
+    /* Points into a table built into the executable */
+    int is_static;
+};
+
+int launch_rules_load(struct LaunchRules* rules, const char* path);
+int launch_rules_save(const struct LaunchRules* rules, const char* path);
+int launch_rules_open_static(struct LaunchRules* rules, const void* table,
+                             size_t len);
+void launch_rules_free(struct LaunchRules* rules);
+int get_run_info(const struct LaunchRules* rules, struct RunInfo* info,
+                 const char* game_name);
+
+#endif
@@ -0,0 +1,588 @@
+#include "scan.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "parser.h"
+#include "alloc_stats.h"
+#include "arena.h"
+#include "cd_hash.h"
+
+#include "log.h"
+
+#define SCAN_MAX_JOBS 64
+#define SCAN_CHUNK_LEN (64 * 1024)
+
+/*
+ * Queued paths are packed into chunks, each worker fills one of its own.
+ * A chunk counts the tasks pointing into it, plus one while it is being
+ * filled, and is recycled once they are all done, so a scan only
+ * allocates as many as are ever queued at once.
+ */
+struct PathChunk {
+    struct PathChunk* next;
+    long refs;
+    size_t used;
+    char data[SCAN_CHUNK_LEN];
+};
+
+struct ScanTask {
+    char* path;
+    struct PathChunk* chunk;
+    int is_dir;
+};
+
+/*
+ * Each worker owns a deque: it pushes and pops at the tail, idle workers
+ * steal from the head, which holds the oldest (and for directories, the
+ * biggest) pieces of work.
+ */
+struct ScanQueue {
+    pthread_mutex_t lock;
+    struct ScanTask* tasks;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct Scanner {
+    const struct DetectContext* ctx;
+    struct DetectCache* cache;
+    FILE* catalog;
+    pthread_mutex_t catalog_lock;
+    struct ScanQueue queues[SCAN_MAX_JOBS];
+    pthread_mutex_t chunks_lock;
+    struct PathChunk* free_chunks;
+    int jobs;
+    /* Tasks queued or running, the scan ends when it drops to zero */
+    long pending;
+    /* Idle workers sleep until a push or the end of the scan */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    unsigned long pushes;
+    long identified;
+    long failed;
+};
+
+struct ScanWorker {
+    struct Scanner* scanner;
+    int id;
+    pthread_t thread;
+    /* The chunk paths are being added to */
+    struct PathChunk* chunk;
+};
+
+static void chunk_release(struct Scanner* s, struct PathChunk* chunk) {
+    if (chunk == NULL ||
+        __atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&s->chunks_lock);
+    chunk->next = s->free_chunks;
+    s->free_chunks = chunk;
+    pthread_mutex_unlock(&s->chunks_lock);
+}
+
+static struct PathChunk* chunk_take(struct Scanner* s) {
+    struct PathChunk* chunk;
+
+    pthread_mutex_lock(&s->chunks_lock);
+    if ((chunk = s->free_chunks) != NULL) {
+        s->free_chunks = chunk->next;
+    }
+    pthread_mutex_unlock(&s->chunks_lock);
+
+    if (chunk == NULL && (chunk = malloc(sizeof(*chunk))) == NULL) {
+        return NULL;
+    }
+
+    chunk->refs = 1;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* Copies `path` into the worker's chunk, taking a reference for its task */
+static char* add_path(struct ScanWorker* w, const char* path,
+                      struct PathChunk** chunk) {
+    size_t len = strlen(path) + 1;
+    char* copy;
+
+    if (w->chunk == NULL || SCAN_CHUNK_LEN - w->chunk->used < len) {
+        chunk_release(w->scanner, w->chunk);
+        if ((w->chunk = chunk_take(w->scanner)) == NULL) {
+            return NULL;
+        }
+    }
+
+    copy = w->chunk->data + w->chunk->used;
+    memcpy(copy, path, len);
+    w->chunk->used += len;
+    __atomic_add_fetch(&w->chunk->refs, 1, __ATOMIC_RELAXED);
+    *chunk = w->chunk;
+    return copy;
+}
+
+static int queue_push(struct ScanQueue* q, char* path,
+                      struct PathChunk* chunk, int is_dir) {
+    struct ScanTask* tmp;
+    size_t count;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        count = q->tail - q->head;
+        if (q->head > q->cap / 2) {
+            memmove(q->tasks, q->tasks + q->head, count * sizeof(*tmp));
+        } else {
+            q->cap = q->cap ? q->cap * 2 : 256;
+            tmp = malloc(q->cap * sizeof(*tmp));
+            if (tmp == NULL) {
+                pthread_mutex_unlock(&q->lock);
+                return -ENOMEM;
+            }
+            memcpy(tmp, q->tasks + q->head, count * sizeof(*tmp));
+            free(q->tasks);
+            q->tasks = tmp;
+        }
+        q->head = 0;
+        q->tail = count;
+    }
+
+    q->tasks[q->tail].path = path;
+    q->tasks[q->tail].chunk = chunk;
+    q->tasks[q->tail].is_dir = is_dir;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Also copies out the path of the file that will be popped next, if any,
+ * since a thief may recycle it as soon as the lock is released */
+static int queue_pop(struct ScanQueue* q, struct ScanTask* task,
+                     char* next_file) {
+    int rv = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *task = q->tasks[--q->tail];
+        rv = 1;
+        if (q->tail > q->head && !q->tasks[q->tail - 1].is_dir) {
+            strncpy(next_file, q->tasks[q->tail - 1].path, PATH_MAX - 1);
+            next_file[PATH_MAX - 1] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return rv;
+}
+
+static int queue_steal(struct ScanQueue* q, struct ScanTask* task) {
+    int rv = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *task = q->tasks[q->head++];
+        rv = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return rv;
+}
+
+static int scanner_push(struct ScanWorker* w, const char* path,
+                        int is_dir) {
+    struct Scanner* s = w->scanner;
+    struct PathChunk* chunk;
+    char* copy;
+    int rv;
+
+    if ((copy = add_path(w, path, &chunk)) == NULL) {
+        return -ENOMEM;
+    }
+
+    __atomic_add_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+    if ((rv = queue_push(&s->queues[w->id], copy, chunk, is_dir)) < 0) {
+        __atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST);
+        chunk_release(s, chunk);
+        return rv;
+    }
+
+    pthread_mutex_lock(&s->idle_lock);
+    __atomic_add_fetch(&s->pushes, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&s->idle_cond);
+    pthread_mutex_unlock(&s->idle_lock);
+    return 0;
+}
+
+static int has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len &&
+           strcasecmp(name + len - suffix_len, suffix) == 0;
+}
+
+struct TrackNames {
+    struct CDTrackFile* files;
+    char** names;
+    size_t count;
+    size_t cap;
+};
+
+/*
+ * Collects the names of the track files a CUE or GDI sheet in the directory
+ * references, they are identified through the sheet
+ */
+static void add_cue_tracks(struct Arena* arena, const char* cue_path,
+                           struct TrackNames* tracks) {
+    char dir_copy[PATH_MAX];
+    const char* name;
+    char** grown;
+    size_t dir_len;
+    size_t count = 0;
+    size_t i;
+
+    /* Shared by every sheet of the directory */
+    if (tracks->files == NULL &&
+        (tracks->files = arena_alloc(arena, CD_MAX_TRACK_FILES *
+                                                sizeof(*tracks->files))) ==
+            NULL) {
+        return;
+    }
+
+    /* A sheet with a missing track still names the ones before it */
+    cd_list_track_files(cue_path, tracks->files, CD_MAX_TRACK_FILES, &count);
+    strncpy(dir_copy, cue_path, PATH_MAX - 1);
+    dir_copy[PATH_MAX - 1] = '\0';
+    dir_len = strlen(dirname(dir_copy));
+    for (i = 0; i < count; i++) {
+        name = tracks->files[i].path + dir_len + 1;
+        if (strchr(name, '/') != NULL) {
+            continue;
+        }
+
+        if (tracks->count == tracks->cap) {
+            tracks->cap = tracks->cap ? tracks->cap * 2 : 16;
+            grown = arena_alloc(arena, tracks->cap * sizeof(*grown));
+            if (grown == NULL) {
+                return;
+            }
+            if (tracks->count > 0) {
+                memcpy(grown, tracks->names,
+                       tracks->count * sizeof(*grown));
+            }
+            tracks->names = grown;
+        }
+
+        if ((tracks->names[tracks->count] = arena_strdup(arena, name)) !=
+            NULL) {
+            tracks->count++;
+        }
+    }
+}
+
+static int is_cue_track(const struct TrackNames* tracks, const char* name) {
+    size_t i;
+
+    for (i = 0; i < tracks->count; i++) {
+        if (strcmp(tracks->names[i], name) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void scan_dir(struct ScanWorker* w, const char* dir_path) {
+    struct Arena* arena = launch_arena();
+    size_t mark = arena_mark(arena);
+    struct TrackNames tracks;
+    DIR* dir;
+    struct dirent* ent;
+    struct stat st;
+    int is_dir;
+    char path[PATH_MAX];
+
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        LOG_WARN("Could not open directory '%s': %s", dir_path,
+                 strerror(errno));
+        return;
+    }
+
+    memset(&tracks, 0, sizeof(tracks));
+    while ((ent = readdir(dir)) != NULL) {
+        if ((has_suffix(ent->d_name, ".cue") ||
+             has_suffix(ent->d_name, ".gdi")) &&
+            snprintf(path, PATH_MAX, "%s/%s", dir_path,
+                     ent->d_name) < PATH_MAX) {
+            add_cue_tracks(arena, path, &tracks);
+        }
+    }
+    rewinddir(dir);
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        if (snprintf(path, PATH_MAX, "%s/%s", dir_path,
+                     ent->d_name) >= PATH_MAX) {
+            continue;
+        }
+
+        if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+            is_dir = ent->d_type == DT_DIR;
+        } else if (stat(path, &st) == 0 &&
+                   (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            is_dir = S_ISDIR(st.st_mode);
+        } else {
+            continue;
+        }
+
+        if (!is_dir && (!detect_is_supported(ent->d_name) ||
+                        is_cue_track(&tracks, ent->d_name))) {
+            continue;
+        }
+
+        if (scanner_push(w, path, is_dir) < 0) {
+            break;
+        }
+    }
+
+    closedir(dir);
+    arena_release(arena, mark);
+}
+
+static void write_field(FILE* out, const char* field) {
+    const char* c;
+    for (c = field; *c != '\0'; c++) {
+        switch (*c) {
+            case '\t':
+                fputs("\\t", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            default:
+                fputc(*c, out);
+        }
+    }
+}
+
+/* path, system, name, core and flags, tab separated */
+static void write_entry(struct Scanner* s, const char* path,
+                        const char* game_name, const struct RunInfo* info) {
+    const char* name = strchr(game_name, '.');
+    size_t system_len = name ? name - game_name : strlen(game_name);
+
+    pthread_mutex_lock(&s->catalog_lock);
+    write_field(s->catalog, path);
+    fprintf(s->catalog, "\t%.*s\t", (int)system_len, game_name);
+    write_field(s->catalog, name ? name + 1 : "");
+    fputc('\t', s->catalog);
+    write_field(s->catalog, info->core);
+    fprintf(s->catalog, "\t%s%s%s\n",
+            info->multitap ? "multitap" : "",
+            info->multitap && info->dualanalog ? "," : "",
+            info->dualanalog ? "dualanalog" : "");
+    pthread_mutex_unlock(&s->catalog_lock);
+}
+
+/* Starts reading the next file in while this one is being hashed */
+static void prefetch_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+static void scan_file(struct Scanner* s, const char* path,
+                      const char* next_file) {
+    char game_name[MAX_TOKEN_LEN];
+    struct RunInfo info;
+    int rv;
+
+    if (next_file[0] != '\0') {
+        prefetch_file(next_file);
+    }
+
+    rv = detect_resolve(s->ctx, s->cache, path, game_name, MAX_TOKEN_LEN,
+                        &info);
+    /* Each file is a launch of its own, the next one reuses the memory */
+    arena_reset(launch_arena());
+    if (rv < 0) {
+        __atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    write_entry(s, path, game_name, &info);
+    __atomic_add_fetch(&s->identified, 1, __ATOMIC_RELAXED);
+}
+
+static int scanner_next(struct Scanner* s, int worker, struct ScanTask* task,
+                        char* next_file) {
+    int i;
+
+    next_file[0] = '\0';
+    if (queue_pop(&s->queues[worker], task, next_file)) {
+        return 1;
+    }
+
+    for (i = 1; i < s->jobs; i++) {
+        if (queue_steal(&s->queues[(worker + i) % s->jobs], task)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void* scan_worker(void* arg) {
+    struct ScanWorker* w = arg;
+    struct Scanner* s = w->scanner;
+    struct ScanTask task;
+    char next_file[PATH_MAX];
+    unsigned long pushes;
+
+    while (1) {
+        /* Taken before looking, so a push made meanwhile is not missed */
+        pushes = __atomic_load_n(&s->pushes, __ATOMIC_SEQ_CST);
+        if (!scanner_next(s, w->id, &task, next_file)) {
+            pthread_mutex_lock(&s->idle_lock);
+            while (s->pushes == pushes &&
+                   __atomic_load_n(&s->pending, __ATOMIC_SEQ_CST) > 0) {
+                pthread_cond_wait(&s->idle_cond, &s->idle_lock);
+            }
+            pthread_mutex_unlock(&s->idle_lock);
+
+            if (__atomic_load_n(&s->pending, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (task.is_dir) {
+            scan_dir(w, task.path);
+        } else {
+            scan_file(s, task.path, next_file);
+        }
+
+        chunk_release(s, task.chunk);
+        if (__atomic_sub_fetch(&s->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&s->idle_lock);
+            pthread_cond_broadcast(&s->idle_cond);
+            pthread_mutex_unlock(&s->idle_lock);
+        }
+    }
+
+    return NULL;
+}
+
+int scan_library(const struct DetectContext* ctx, struct DetectCache* cache,
+                 const char* root, const char* catalog_path, int jobs) {
+    struct Scanner s;
+    struct ScanWorker workers[SCAN_MAX_JOBS];
+    struct PathChunk* chunk;
+#if ALLOC_STATS
+    unsigned long allocs = alloc_stats_count();
+    long files;
+#endif
+    int started;
+    int rv;
+    int i;
+
+    if (jobs <= 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (jobs <= 0) {
+        jobs = 1;
+    } else if (jobs > SCAN_MAX_JOBS) {
+        jobs = SCAN_MAX_JOBS;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.ctx = ctx;
+    s.cache = cache;
+    s.jobs = jobs;
+    s.catalog = strcmp(catalog_path, "-") == 0 ? stdout
+                                               : fopen(catalog_path, "w");
+    if (s.catalog == NULL) {
+        LOG_WARN("Could not open catalog '%s': %s", catalog_path,
+                 strerror(errno));
+        return -errno;
+    }
+
+    pthread_mutex_init(&s.catalog_lock, NULL);
+    pthread_mutex_init(&s.chunks_lock, NULL);
+    pthread_mutex_init(&s.idle_lock, NULL);
+    pthread_cond_init(&s.idle_cond, NULL);
+    memset(workers, 0, sizeof(workers));
+    for (i = 0; i < jobs; i++) {
+        pthread_mutex_init(&s.queues[i].lock, NULL);
+        workers[i].scanner = &s;
+        workers[i].id = i;
+    }
+
+    if ((rv = scanner_push(&workers[0], root, 1)) < 0) {
+        goto clean;
+    }
+
+    LOG_INFO("Scanning '%s' with %d workers", root, jobs);
+    for (started = 0; started < jobs; started++) {
+        if (pthread_create(&workers[started].thread, NULL, scan_worker,
+                           &workers[started]) != 0) {
+            break;
+        }
+    }
+
+    if (started == 0) {
+        /* Nobody to do the work, so do it here */
+        scan_worker(&workers[0]);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    LOG_INFO("Identified %ld files, %ld failed", s.identified, s.failed);
+#if ALLOC_STATS
+    allocs = alloc_stats_count() - allocs;
+    files = s.identified + s.failed;
+    LOG_DEBUG("Made %lu heap allocations, %.2f per file", allocs,
+              files > 0 ? (double)allocs / files : 0.0);
+#endif
+    rv = 0;
+clean:
+    for (i = 0; i < jobs; i++) {
+        chunk_release(&s, workers[i].chunk);
+        free(s.queues[i].tasks);
+        pthread_mutex_destroy(&s.queues[i].lock);
+    }
+
+    /* Every task is done, so every chunk is back */
+    while ((chunk = s.free_chunks) != NULL) {
+        s.free_chunks = chunk->next;
+        free(chunk);
+    }
+    pthread_mutex_destroy(&s.chunks_lock);
+    pthread_cond_destroy(&s.idle_cond);
+    pthread_mutex_destroy(&s.idle_lock);
+    pthread_mutex_destroy(&s.catalog_lock);
+    if (s.catalog != stdout) {
+        fclose(s.catalog);
+    } else {
+        fflush(stdout);
+    }
+    return rv;
+}
@@ -0,0 +1,10 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include "detect.h"
+#include "detect_cache.h"
+
+int scan_library(const struct DetectContext* ctx, struct DetectCache* cache,
+                 const char* root, const char* catalog_path, int jobs);
+
+#endif
@@ -39,6 +39,10 @@
  */
 
 #include "sha1.h"
+#include "sha1_accel.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 /*
  *  Define the circular shift macro
@@ -50,6 +54,99 @@
 /* Function prototypes */
 void SHA1ProcessMessageBlock(SHA1Context *);
 void SHA1PadMessage(SHA1Context *);
+static void SHA1ProcessBlocksGeneric(unsigned *, const unsigned char *,
+                                     size_t);
+static void SHA1ProcessBlocksResolve(unsigned *, const unsigned char *,
+                                     size_t);
+
+/*
+ *  Block function selected by SHA1SelectImplementation.  It starts out
+ *  pointing at a resolver so that contexts used before the explicit
+ *  selection still pick the best available implementation.
+ */
+static SHA1BlockFunction SHA1ProcessBlocks = SHA1ProcessBlocksResolve;
+
+struct SHA1Implementation
+{
+    const char *name;
+    SHA1BlockFunction process_blocks;
+    int (*supported)(void);
+};
+
+static int SHA1AlwaysSupported(void)
+{
+    return 1;
+}
+
+/* In order of preference */
+static const struct SHA1Implementation SHA1Implementations[] =
+{
+#if defined(SHA1_ACCEL_X86)
+    { "sha-ni", SHA1ProcessBlocksSHANI, SHA1CPUHasSHANI },
+    { "ssse3", SHA1ProcessBlocksSSSE3, SHA1CPUHasSSSE3 },
+#endif
+#if defined(SHA1_ACCEL_ARMV8)
+    { "armv8-ce", SHA1ProcessBlocksARMv8, SHA1CPUHasARMv8 },
+#endif
+    { "generic", SHA1ProcessBlocksGeneric, SHA1AlwaysSupported },
+    { NULL, NULL, NULL }
+};
+
+/*
+ *  SHA1SelectImplementation
+ *
+ *  Description:
+ *      This function picks the fastest block function supported by the
+ *      running CPU.  The RETROLAUNCH_SHA1 environment variable may name
+ *      a specific implementation, which is used when it is supported.
+ *
+ *  Parameters:
+ *      None.
+ *
+ *  Returns:
+ *      The name of the selected implementation.
+ *
+ *  Comments:
+ *      Meant to be called once at startup, before any thread hashes.
+ *
+ */
+const char *SHA1SelectImplementation(void)
+{
+    const struct SHA1Implementation *impl;
+    const char *forced = getenv("RETROLAUNCH_SHA1");
+
+    for (impl = SHA1Implementations; impl->name != NULL; impl++)
+    {
+        if (forced != NULL && strcmp(forced, impl->name) != 0)
+        {
+            continue;
+        }
+
+        if (impl->supported())
+        {
+            break;
+        }
+    }
+
+    if (impl->name == NULL)
+    {
+        /* The forced implementation is unknown or unsupported */
+        impl = &SHA1Implementations[
+                sizeof(SHA1Implementations) /
+                sizeof(SHA1Implementations[0]) - 2];
+    }
+
+    SHA1ProcessBlocks = impl->process_blocks;
+    return impl->name;
+}
+
+static void SHA1ProcessBlocksResolve(unsigned *digest,
+                                     const unsigned char *blocks,
+                                     size_t count)
+{
+    SHA1SelectImplementation();
+    SHA1ProcessBlocks(digest, blocks, count);
+}
 
 /*  
  *  SHA1Reset
@@ -118,6 +215,45 @@ int SHA1Result(SHA1Context *context)
     return 1;
 }
 
+/*
+ *  SHA1ResultBinary
+ *
+ *  Description:
+ *      This function finishes the hash like SHA1Result and copies the
+ *      160-bit message digest as 20 big-endian octets.
+ *
+ *  Parameters:
+ *      context: [in/out]
+ *          The context to use to calculate the SHA-1 hash.
+ *      digest: [out]
+ *          Where the 20 octet digest is stored.
+ *
+ *  Returns:
+ *      1 if successful, 0 if it failed.
+ *
+ *  Comments:
+ *
+ */
+int SHA1ResultBinary(SHA1Context *context, unsigned char *digest)
+{
+    int i;
+
+    if (!SHA1Result(context))
+    {
+        return 0;
+    }
+
+    for(i = 0; i < 5; i++)
+    {
+        digest[i * 4]     = (context->Message_Digest[i] >> 24) & 0xFF;
+        digest[i * 4 + 1] = (context->Message_Digest[i] >> 16) & 0xFF;
+        digest[i * 4 + 2] = (context->Message_Digest[i] >> 8) & 0xFF;
+        digest[i * 4 + 3] = (context->Message_Digest[i]) & 0xFF;
+    }
+
+    return 1;
+}
+
 /*  
  *  SHA1Input
  *
@@ -142,8 +278,11 @@ int SHA1Result(SHA1Context *context)
  */
 void SHA1Input(     SHA1Context         *context,
                     const unsigned char *message_array,
-                    unsigned            length)
+                    size_t              length)
 {
+    size_t count;
+    unsigned long long bits;
+
     if (!length)
     {
         return;
@@ -155,33 +294,56 @@ void SHA1Input(     SHA1Context         *context,
         return;
     }
 
-    while(length-- && !context->Corrupted)
+    bits = ((unsigned long long) context->Length_High << 32) |
+           context->Length_Low;
+    if (length > (~0ULL - bits) / 8)
     {
-        context->Message_Block[context->Message_Block_Index++] =
-                                                (*message_array & 0xFF);
+        /* Message is too long */
+        context->Corrupted = 1;
+        return;
+    }
+    bits += (unsigned long long) length * 8;
+    context->Length_Low = bits & 0xFFFFFFFF;
+    context->Length_High = (bits >> 32) & 0xFFFFFFFF;
 
-        context->Length_Low += 8;
-        /* Force it to 32 bits */
-        context->Length_Low &= 0xFFFFFFFF;
-        if (context->Length_Low == 0)
+    /*
+     *  Top up a partially filled block first
+     */
+    if (context->Message_Block_Index > 0)
+    {
+        count = 64 - context->Message_Block_Index;
+        if (count > length)
         {
-            context->Length_High++;
-            /* Force it to 32 bits */
-            context->Length_High &= 0xFFFFFFFF;
-            if (context->Length_High == 0)
-            {
-                /* Message is too long */
-                context->Corrupted = 1;
-            }
+            count = length;
         }
 
-        if (context->Message_Block_Index == 64)
+        memcpy(context->Message_Block + context->Message_Block_Index,
+               message_array, count);
+        context->Message_Block_Index += count;
+        message_array += count;
+        length -= count;
+
+        if (context->Message_Block_Index < 64)
         {
-            SHA1ProcessMessageBlock(context);
+            return;
         }
 
-        message_array++;
+        SHA1ProcessMessageBlock(context);
+    }
+
+    /*
+     *  Whole blocks are hashed straight from the caller's buffer
+     */
+    count = length / 64;
+    if (count > 0)
+    {
+        SHA1ProcessBlocks(context->Message_Digest, message_array, count);
+        message_array += count * 64;
+        length -= count * 64;
     }
+
+    memcpy(context->Message_Block, message_array, length);
+    context->Message_Block_Index = length;
 }
 
 /*  
@@ -205,6 +367,22 @@ void SHA1Input(     SHA1Context         *context,
  *
  */
 void SHA1ProcessMessageBlock(SHA1Context *context)
+{
+    SHA1ProcessBlocks(context->Message_Digest, context->Message_Block, 1);
+    context->Message_Block_Index = 0;
+}
+
+/*
+ *  SHA1ProcessBlocksGeneric
+ *
+ *  Description:
+ *      Portable block function, processing count consecutive 512-bit
+ *      blocks into digest.
+ *
+ */
+static void SHA1ProcessBlocksGeneric(unsigned *digest,
+                                     const unsigned char *blocks,
+                                     size_t count)
 {
     const unsigned K[] =            /* Constants defined in SHA-1   */      
     {
@@ -218,86 +396,82 @@ void SHA1ProcessMessageBlock(SHA1Context *context)
     unsigned    W[80];              /* Word sequence                */
     unsigned    A, B, C, D, E;      /* Word buffers                 */
 
-    /*
-     *  Initialize the first 16 words in the array W
-     */
-    for(t = 0; t < 16; t++)
-    {
-        W[t] = ((unsigned) context->Message_Block[t * 4]) << 24;
-        W[t] |= ((unsigned) context->Message_Block[t * 4 + 1]) << 16;
-        W[t] |= ((unsigned) context->Message_Block[t * 4 + 2]) << 8;
-        W[t] |= ((unsigned) context->Message_Block[t * 4 + 3]);
-    }
-
-    for(t = 16; t < 80; t++)
+    for(; count > 0; count--, blocks += 64)
     {
-       W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }
+        /*
+         *  Initialize the first 16 words in the array W
+         */
+        for(t = 0; t < 16; t++)
+        {
+            W[t] = ((unsigned) blocks[t * 4]) << 24;
+            W[t] |= ((unsigned) blocks[t * 4 + 1]) << 16;
+            W[t] |= ((unsigned) blocks[t * 4 + 2]) << 8;
+            W[t] |= ((unsigned) blocks[t * 4 + 3]);
+        }
 
-    A = context->Message_Digest[0];
-    B = context->Message_Digest[1];
-    C = context->Message_Digest[2];
-    D = context->Message_Digest[3];
-    E = context->Message_Digest[4];
+        for(t = 16; t < 80; t++)
+        {
+           W[t] = SHA1CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+        }
 
-    for(t = 0; t < 20; t++)
-    {
-        temp =  SHA1CircularShift(5,A) +
-                ((B & C) | ((~B) & D)) + E + W[t] + K[0];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        A = digest[0];
+        B = digest[1];
+        C = digest[2];
+        D = digest[3];
+        E = digest[4];
 
-    for(t = 20; t < 40; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 0; t < 20; t++)
+        {
+            temp =  SHA1CircularShift(5,A) +
+                    ((B & C) | ((~B) & D)) + E + W[t] + K[0];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    for(t = 40; t < 60; t++)
-    {
-        temp = SHA1CircularShift(5,A) +
-               ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 20; t < 40; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    for(t = 60; t < 80; t++)
-    {
-        temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-        temp &= 0xFFFFFFFF;
-        E = D;
-        D = C;
-        C = SHA1CircularShift(30,B);
-        B = A;
-        A = temp;
-    }
+        for(t = 40; t < 60; t++)
+        {
+            temp = SHA1CircularShift(5,A) +
+                   ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    context->Message_Digest[0] =
-                        (context->Message_Digest[0] + A) & 0xFFFFFFFF;
-    context->Message_Digest[1] =
-                        (context->Message_Digest[1] + B) & 0xFFFFFFFF;
-    context->Message_Digest[2] =
-                        (context->Message_Digest[2] + C) & 0xFFFFFFFF;
-    context->Message_Digest[3] =
-                        (context->Message_Digest[3] + D) & 0xFFFFFFFF;
-    context->Message_Digest[4] =
-                        (context->Message_Digest[4] + E) & 0xFFFFFFFF;
+        for(t = 60; t < 80; t++)
+        {
+            temp = SHA1CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
+            temp &= 0xFFFFFFFF;
+            E = D;
+            D = C;
+            C = SHA1CircularShift(30,B);
+            B = A;
+            A = temp;
+        }
 
-    context->Message_Block_Index = 0;
+        digest[0] = (digest[0] + A) & 0xFFFFFFFF;
+        digest[1] = (digest[1] + B) & 0xFFFFFFFF;
+        digest[2] = (digest[2] + C) & 0xFFFFFFFF;
+        digest[3] = (digest[3] + D) & 0xFFFFFFFF;
+        digest[4] = (digest[4] + E) & 0xFFFFFFFF;
+    }
 }
 
 /*  
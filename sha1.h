@@ -24,6 +24,8 @@
 #ifndef _SHA1_H_
 #define _SHA1_H_
 
+#include <stddef.h>
+
 /* 
  *  This structure will hold context information for the hashing
  *  operation
@@ -47,8 +49,10 @@ typedef struct SHA1Context
  */
 void SHA1Reset(SHA1Context *);
 int SHA1Result(SHA1Context *);
+int SHA1ResultBinary(SHA1Context *, unsigned char *);
 void SHA1Input( SHA1Context *,
                 const unsigned char *,
-                unsigned);
+                size_t);
+const char *SHA1SelectImplementation(void);
 
 #endif
@@ -0,0 +1,310 @@
+#include "sha1_accel.h"
+
+#if defined(SHA1_ACCEL_X86)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+int SHA1CPUHasSHANI(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+        !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ebx & bit_SHA) != 0;
+}
+
+int SHA1CPUHasSSSE3(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+
+    return (ecx & bit_SSSE3) != 0;
+}
+
+/*
+ * Four rounds with the SHA extensions. `e` holds E plus the message
+ * words for this group, `e_next` receives the A of this group which
+ * becomes E (after rotation by sha1nexte) four rounds later.
+ */
+#define SHANI_ROUNDS(e, e_next, msg, f) \
+    e = _mm_sha1nexte_epu32(e, msg); \
+    e_next = abcd; \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, f)
+
+#define SHANI_LOAD(msg, offset) \
+    msg = _mm_shuffle_epi8( \
+        _mm_loadu_si128((const __m128i*)(blocks + (offset))), mask)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void SHA1ProcessBlocksSHANI(unsigned* digest, const unsigned char* blocks,
+                            size_t count) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)digest), 0x1B);
+    e0 = _mm_set_epi32(digest[4], 0, 0, 0);
+
+    for (; count > 0; count--, blocks += 64) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        /* Rounds 0-3 */
+        SHANI_LOAD(msg0, 0);
+        e0 = _mm_add_epi32(e0, msg0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        /* Rounds 4-15 */
+        SHANI_LOAD(msg1, 16);
+        SHANI_ROUNDS(e1, e0, msg1, 0);
+        msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+        SHANI_LOAD(msg2, 32);
+        SHANI_ROUNDS(e0, e1, msg2, 0);
+        msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+        msg0 = _mm_xor_si128(msg0, msg2);
+
+        SHANI_LOAD(msg3, 48);
+        SHANI_ROUNDS(e1, e0, msg3, 0);
+        msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+        msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+        msg1 = _mm_xor_si128(msg1, msg3);
+
+        /* Rounds 16-67, the message schedule runs three groups ahead */
+#define SHANI_SCHEDULE(e, e_next, m0, m1, m2, m3, f) \
+        SHANI_ROUNDS(e, e_next, m0, f); \
+        m1 = _mm_sha1msg2_epu32(m1, m0); \
+        m3 = _mm_sha1msg1_epu32(m3, m0); \
+        m2 = _mm_xor_si128(m2, m0)
+
+        SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 0);
+        SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 1);
+        SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 1);
+        SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 1);
+        SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 1);
+        SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 2);
+        SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 2);
+        SHANI_SCHEDULE(e1, e0, msg1, msg2, msg3, msg0, 2);
+        SHANI_SCHEDULE(e0, e1, msg2, msg3, msg0, msg1, 2);
+        SHANI_SCHEDULE(e1, e0, msg3, msg0, msg1, msg2, 3);
+        SHANI_SCHEDULE(e0, e1, msg0, msg1, msg2, msg3, 3);
+#undef SHANI_SCHEDULE
+
+        /* Rounds 68-79, the schedule drains */
+        SHANI_ROUNDS(e1, e0, msg1, 3);
+        msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+        msg3 = _mm_xor_si128(msg3, msg1);
+
+        SHANI_ROUNDS(e0, e1, msg2, 3);
+        msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+
+        SHANI_ROUNDS(e1, e0, msg3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i*)digest, _mm_shuffle_epi32(abcd, 0x1B));
+    digest[4] = _mm_extract_epi32(e0, 3);
+}
+
+#undef SHANI_LOAD
+#undef SHANI_ROUNDS
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define SSSE3_ROUND(a, b, c, d, e, f, t) \
+    e += ROL(a, 5) + (f) + wk[t]; \
+    b = ROL(b, 30)
+
+#define F0(b, c, d) (d ^ (b & (c ^ d)))
+#define F1(b, c, d) (b ^ c ^ d)
+#define F2(b, c, d) ((b & c) | (d & (b | c)))
+
+/*
+ * Scalar rounds fed by a vectorised message schedule: four words of
+ * W[t] + K are produced per iteration instead of one.
+ */
+__attribute__((target("ssse3")))
+void SHA1ProcessBlocksSSSE3(unsigned* digest, const unsigned char* blocks,
+                            size_t count) {
+    static const unsigned K[] = {
+        0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
+    };
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __attribute__((aligned(16))) unsigned w[80];
+    __attribute__((aligned(16))) unsigned wk[80];
+    __m128i x, rot;
+    unsigned a, b, c, d, e;
+    int t;
+
+    for (; count > 0; count--, blocks += 64) {
+        for (t = 0; t < 16; t += 4) {
+            x = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i*)(blocks + t * 4)), mask);
+            _mm_store_si128((__m128i*)&w[t], x);
+            _mm_store_si128((__m128i*)&wk[t],
+                            _mm_add_epi32(x, _mm_set1_epi32(K[0])));
+        }
+
+        for (t = 16; t < 80; t += 4) {
+            /* W[t-3..t] with the not yet known W[t] as zero */
+            x = _mm_srli_si128(_mm_load_si128((const __m128i*)&w[t - 4]), 4);
+            x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i*)&w[t - 8]));
+            x = _mm_xor_si128(x,
+                              _mm_loadu_si128((const __m128i*)&w[t - 14]));
+            x = _mm_xor_si128(x, _mm_load_si128((const __m128i*)&w[t - 16]));
+            x = _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+            /* Fold the rotated W[t] into the last lane */
+            rot = _mm_slli_si128(x, 12);
+            rot = _mm_or_si128(_mm_slli_epi32(rot, 1),
+                               _mm_srli_epi32(rot, 31));
+            x = _mm_xor_si128(x, rot);
+            _mm_store_si128((__m128i*)&w[t], x);
+            _mm_store_si128((__m128i*)&wk[t],
+                            _mm_add_epi32(x, _mm_set1_epi32(K[t / 20])));
+        }
+
+        a = digest[0];
+        b = digest[1];
+        c = digest[2];
+        d = digest[3];
+        e = digest[4];
+
+        for (t = 0; t < 20; t += 5) {
+            SSSE3_ROUND(a, b, c, d, e, F0(b, c, d), t);
+            SSSE3_ROUND(e, a, b, c, d, F0(a, b, c), t + 1);
+            SSSE3_ROUND(d, e, a, b, c, F0(e, a, b), t + 2);
+            SSSE3_ROUND(c, d, e, a, b, F0(d, e, a), t + 3);
+            SSSE3_ROUND(b, c, d, e, a, F0(c, d, e), t + 4);
+        }
+
+        for (t = 20; t < 40; t += 5) {
+            SSSE3_ROUND(a, b, c, d, e, F1(b, c, d), t);
+            SSSE3_ROUND(e, a, b, c, d, F1(a, b, c), t + 1);
+            SSSE3_ROUND(d, e, a, b, c, F1(e, a, b), t + 2);
+            SSSE3_ROUND(c, d, e, a, b, F1(d, e, a), t + 3);
+            SSSE3_ROUND(b, c, d, e, a, F1(c, d, e), t + 4);
+        }
+
+        for (t = 40; t < 60; t += 5) {
+            SSSE3_ROUND(a, b, c, d, e, F2(b, c, d), t);
+            SSSE3_ROUND(e, a, b, c, d, F2(a, b, c), t + 1);
+            SSSE3_ROUND(d, e, a, b, c, F2(e, a, b), t + 2);
+            SSSE3_ROUND(c, d, e, a, b, F2(d, e, a), t + 3);
+            SSSE3_ROUND(b, c, d, e, a, F2(c, d, e), t + 4);
+        }
+
+        for (t = 60; t < 80; t += 5) {
+            SSSE3_ROUND(a, b, c, d, e, F1(b, c, d), t);
+            SSSE3_ROUND(e, a, b, c, d, F1(a, b, c), t + 1);
+            SSSE3_ROUND(d, e, a, b, c, F1(e, a, b), t + 2);
+            SSSE3_ROUND(c, d, e, a, b, F1(d, e, a), t + 3);
+            SSSE3_ROUND(b, c, d, e, a, F1(c, d, e), t + 4);
+        }
+
+        digest[0] += a;
+        digest[1] += b;
+        digest[2] += c;
+        digest[3] += d;
+        digest[4] += e;
+    }
+}
+
+#undef F0
+#undef F1
+#undef F2
+#undef SSSE3_ROUND
+#undef ROL
+
+#endif /* SHA1_ACCEL_X86 */
+
+#if defined(SHA1_ACCEL_ARMV8)
+
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+
+int SHA1CPUHasARMv8(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+}
+
+__attribute__((target("+crypto")))
+void SHA1ProcessBlocksARMv8(unsigned* digest, const unsigned char* blocks,
+                            size_t count) {
+    static const unsigned K[] = {
+        0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
+    };
+    uint32x4_t abcd, abcd_save;
+    uint32x4_t msg[4];
+    uint32x4_t tmp[2];
+    uint32_t e, e_save, e_next;
+    int g;
+    int i;
+
+    abcd = vld1q_u32(digest);
+    e = digest[4];
+
+    for (; count > 0; count--, blocks += 64) {
+        abcd_save = abcd;
+        e_save = e;
+
+        for (i = 0; i < 4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(blocks + i * 16)));
+        }
+
+        tmp[0] = vaddq_u32(msg[0], vdupq_n_u32(K[0]));
+        tmp[1] = vaddq_u32(msg[1], vdupq_n_u32(K[0]));
+
+        /*
+         * Group g consumes W[4g..4g+3] + K from tmp, while the schedule
+         * finishes W for group g + 3 and starts it for group g + 4.
+         */
+        for (g = 0; g < 20; g++) {
+            e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            if (g < 5) {
+                abcd = vsha1cq_u32(abcd, e, tmp[g & 1]);
+            } else if (g < 10 || g >= 15) {
+                abcd = vsha1pq_u32(abcd, e, tmp[g & 1]);
+            } else {
+                abcd = vsha1mq_u32(abcd, e, tmp[g & 1]);
+            }
+            e = e_next;
+
+            if (g + 2 < 20) {
+                tmp[g & 1] = vaddq_u32(msg[(g + 2) & 3],
+                                       vdupq_n_u32(K[(g + 2) / 5]));
+            }
+
+            if (g >= 1 && g + 3 < 20) {
+                msg[(g + 3) & 3] = vsha1su1q_u32(msg[(g + 3) & 3],
+                                                 msg[(g + 2) & 3]);
+            }
+
+            if (g + 4 < 20) {
+                msg[g & 3] = vsha1su0q_u32(msg[g & 3], msg[(g + 1) & 3],
+                                           msg[(g + 2) & 3]);
+            }
+        }
+
+        e += e_save;
+        abcd = vaddq_u32(abcd, abcd_save);
+    }
+
+    vst1q_u32(digest, abcd);
+    digest[4] = e;
+}
+
+#endif /* SHA1_ACCEL_ARMV8 */
@@ -0,0 +1,35 @@
+/*
+ *  sha1_accel.h
+ *
+ *  Description:
+ *      Hardware accelerated SHA-1 block functions used by sha1.c.  Each
+ *      one processes count consecutive 64 octet blocks into the five
+ *      word digest and must only be called when the matching CPU check
+ *      returns non-zero.
+ *
+ */
+
+#ifndef _SHA1_ACCEL_H_
+#define _SHA1_ACCEL_H_
+
+#include <stddef.h>
+
+typedef void (*SHA1BlockFunction)(unsigned *digest,
+                                  const unsigned char *blocks,
+                                  size_t count);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_ACCEL_X86
+int SHA1CPUHasSHANI(void);
+int SHA1CPUHasSSSE3(void);
+void SHA1ProcessBlocksSHANI(unsigned *, const unsigned char *, size_t);
+void SHA1ProcessBlocksSSSE3(unsigned *, const unsigned char *, size_t);
+#endif
+
+#if defined(__aarch64__) && defined(__linux__)
+#define SHA1_ACCEL_ARMV8
+int SHA1CPUHasARMv8(void);
+void SHA1ProcessBlocksARMv8(unsigned *, const unsigned char *, size_t);
+#endif
+
+#endif
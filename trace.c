@@ -0,0 +1,220 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+
+/* Spans past this are left out of the timeline but still summed up */
+#define TRACE_MAX_EVENTS 4096
+
+struct TraceEvent {
+    int stage;
+    int tid;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+struct TraceTotals {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static const char* STAGE_NAMES[TRACE_STAGE_COUNT] = {
+    "context_init",
+    "daemon_request",
+    "cache_lookup",
+    "detect_game",
+    "find_rom_canonical_name",
+    "hash_rom",
+    "get_run_info",
+    "cd_find_data_track",
+    "cd_detect_system",
+    "cd_detect_ps1_game",
+    "cd_hash_disc"
+};
+
+int trace_enabled = 0;
+
+static const char* trace_path;
+static uint64_t trace_start_ns;
+static struct TraceEvent events[TRACE_MAX_EVENTS];
+static uint32_t event_count;
+static uint64_t dropped;
+static struct TraceTotals totals[TRACE_STAGE_COUNT];
+static int next_tid;
+
+static __thread struct TraceSpan* current;
+static __thread int tid;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void atomic_max(uint64_t* target, uint64_t value) {
+    uint64_t old = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while (old < value &&
+           !__atomic_compare_exchange_n(target, &old, value, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void flush_at_exit(void) {
+    trace_flush();
+}
+
+/* The trace is written to `path` by trace_flush, or at exit */
+void trace_enable(const char* path) {
+    trace_path = path;
+    trace_start_ns = now_ns();
+    trace_enabled = 1;
+    atexit(flush_at_exit);
+}
+
+void trace_span_begin(struct TraceSpan* span, int stage) {
+    memset(span, 0, sizeof(*span));
+    span->parent = current;
+    span->stage = stage;
+    span->start_ns = now_ns();
+    current = span;
+}
+
+void trace_span_end(struct TraceSpan* span) {
+    struct TraceTotals* t = &totals[span->stage];
+    struct TraceEvent* e;
+    uint64_t duration = now_ns() - span->start_ns;
+    uint32_t i;
+
+    current = span->parent;
+    if (current != NULL) {
+        current->bytes += span->bytes;
+        current->reads += span->reads;
+        current->hits += span->hits;
+        current->misses += span->misses;
+    }
+
+    __atomic_add_fetch(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->total_ns, duration, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->bytes, span->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->reads, span->reads, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->hits, span->hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->misses, span->misses, __ATOMIC_RELAXED);
+    atomic_max(&t->max_ns, duration);
+
+    if (tid == 0) {
+        tid = __atomic_add_fetch(&next_tid, 1, __ATOMIC_RELAXED);
+    }
+
+    i = __atomic_fetch_add(&event_count, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_MAX_EVENTS) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    e = &events[i];
+    e->stage = span->stage;
+    e->tid = tid;
+    e->start_ns = span->start_ns - trace_start_ns;
+    e->duration_ns = duration;
+    e->bytes = span->bytes;
+    e->reads = span->reads;
+    e->hits = span->hits;
+    e->misses = span->misses;
+}
+
+/* One read() or pread() call that returned `len` */
+void trace_count_read(ssize_t len) {
+    if (current != NULL) {
+        current->reads++;
+        current->bytes += len > 0 ? len : 0;
+    }
+}
+
+void trace_count_cache(int hit) {
+    if (current != NULL) {
+        if (hit) {
+            current->hits++;
+        } else {
+            current->misses++;
+        }
+    }
+}
+
+static void write_counters(FILE* out, uint64_t bytes, uint64_t reads,
+                           uint64_t hits, uint64_t misses) {
+    fprintf(out, "\"bytes\":%llu,\"reads\":%llu,\"cache_hits\":%llu,"
+            "\"cache_misses\":%llu", (unsigned long long)bytes,
+            (unsigned long long)reads, (unsigned long long)hits,
+            (unsigned long long)misses);
+}
+
+/*
+ * Writes a Chrome trace-event file, with complete events for the
+ * timeline and the per stage totals under "summary". Counters are
+ * inclusive of nested stages.
+ */
+int trace_flush(void) {
+    const struct TraceEvent* e;
+    const struct TraceTotals* t;
+    uint32_t count;
+    uint32_t i;
+    FILE* out;
+
+    if (!trace_enabled || trace_path == NULL) {
+        return 0;
+    }
+
+    if ((out = fopen(trace_path, "w")) == NULL) {
+        LOG_WARN("Could not write trace '%s': %s", trace_path,
+                 strerror(errno));
+        return -errno;
+    }
+
+    count = __atomic_load_n(&event_count, __ATOMIC_RELAXED);
+    if (count > TRACE_MAX_EVENTS) {
+        count = TRACE_MAX_EVENTS;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    for (i = 0; i < count; i++) {
+        e = &events[i];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                i ? "," : "", STAGE_NAMES[e->stage], (int)getpid(), e->tid,
+                e->start_ns / 1000.0, e->duration_ns / 1000.0);
+        write_counters(out, e->bytes, e->reads, e->hits, e->misses);
+        fprintf(out, "}}");
+    }
+
+    fprintf(out, "],\n\"displayTimeUnit\":\"ms\",\n\"droppedEvents\":%llu,"
+            "\n\"summary\":{", (unsigned long long)dropped);
+    for (i = 0; i < TRACE_STAGE_COUNT; i++) {
+        t = &totals[i];
+        fprintf(out, "%s\n\"%s\":{\"calls\":%llu,\"total_ns\":%llu,"
+                "\"max_ns\":%llu,", i ? "," : "", STAGE_NAMES[i],
+                (unsigned long long)t->calls,
+                (unsigned long long)t->total_ns,
+                (unsigned long long)t->max_ns);
+        write_counters(out, t->bytes, t->reads, t->hits, t->misses);
+        fprintf(out, "}");
+    }
+    fprintf(out, "}}\n");
+    fclose(out);
+
+    /* Written once, even if the launch goes on to exit */
+    trace_path = NULL;
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <unistd.h>
+
+/* Stages timed by --trace */
+enum TraceStage {
+    TRACE_CONTEXT_INIT,
+    TRACE_DAEMON_REQUEST,
+    TRACE_CACHE_LOOKUP,
+    TRACE_DETECT_GAME,
+    TRACE_ROM_LOOKUP,
+    TRACE_HASH_ROM,
+    TRACE_RUN_INFO,
+    TRACE_CD_DATA_TRACK,
+    TRACE_CD_SYSTEM,
+    TRACE_CD_PS1_GAME,
+    TRACE_CD_HASH,
+    TRACE_STAGE_COUNT
+};
+
+/*
+ * A running stage. Reads and cache lookups are charged to the innermost
+ * span of the thread doing them, and added to its parent when it ends.
+ */
+struct TraceSpan {
+    struct TraceSpan* parent;
+    int stage;
+    uint64_t start_ns;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* Only ever set before any other thread starts */
+extern int trace_enabled;
+
+void trace_enable(const char* path);
+int trace_flush(void);
+void trace_span_begin(struct TraceSpan* span, int stage);
+void trace_span_end(struct TraceSpan* span);
+void trace_count_read(ssize_t len);
+void trace_count_cache(int hit);
+
+/* The checks keep the cost of disabled tracing to a predicted branch */
+#define TRACE_BEGIN(span, stage) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_span_begin(span, stage); \
+        } \
+    } while (0)
+
+#define TRACE_END(span) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_span_end(span); \
+        } \
+    } while (0)
+
+#define TRACE_READ(len) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_count_read(len); \
+        } \
+    } while (0)
+
+#define TRACE_CACHE(hit) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_count_cache(hit); \
+        } \
+    } while (0)
+
+#endif